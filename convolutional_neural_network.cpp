@@ -1,16 +1,48 @@
 #include <math.h>
 
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <complex>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <fstream>
+#include <future>
+#include <iomanip>
 #include <iostream>
 #include <iterator>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <numeric>
 #include <random>
 #include <regex>
+#include <set>
+#include <sstream>
 #include <string>
+#include <thread>
 #include <tuple>
 #include <typeinfo>
 #include <vector>
 
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#if defined(__AVX512BF16__) || defined(__F16C__)
+#include <immintrin.h>
+#endif
+
 using namespace std;
 
 // Good diagram:
@@ -18,1111 +50,6894 @@ using namespace std;
 
 bool be_random = true;
 
-class Layer {
- public:
-  virtual ~Layer() = default;
+// Lazy elementwise expressions over vectors (rank 1), matrices (rank 2) and tensors (rank 3).
+// Layer::add_* and Layer::scalar_multiple build these instead of returning new nested vectors, so a
+// chain like add_tensors(w, scalar_multiple(g, -alpha)) is evaluated in one loop straight into its
+// destination. Leaves hold references: evaluate an expression within the statement that builds it.
+template <int Rank>
+struct Nested;
+template <>
+struct Nested<1> {
+  using type = vector<double>;
+};
+template <>
+struct Nested<2> {
+  using type = vector<vector<double>>;
+};
+template <>
+struct Nested<3> {
+  using type = vector<vector<vector<double>>>;
+};
 
-  vector<vector<vector<double>>> h(vector<vector<vector<double>>> x);
+template <class E, int Rank>
+struct Expr {
+  static const int rank = Rank;
 
-  // Helper functions
-  static void rand_init(vector<vector<vector<double>>>& tensor, int height, int width) {
-    for (int i = 0; i < height; i++) {
-      for (int j = 0; j < width; j++) {
-        // use numbers between -10 and 10
-        double n = (double)rand() / RAND_MAX;  // scales rand() to [0, 1].
-        n = n * 2 - 1;
-        tensor[i][j][0] = n;  // (possibly) change to use float to save memory
-      }
-    }
+  // Materializes the expression, allocating only the result.
+  operator typename Nested<Rank>::type() const {
+    typename Nested<Rank>::type out;
+    evaluate_into(out);
+    return out;
   }
 
-  static void rand_init(vector<vector<double>>& matrix, int height, int width) {
-    for (int i = 0; i < height; i++) {
-      for (int j = 0; j < width; j++) {
-        // use numbers between -10 and 10
-        double n = (double)rand() / RAND_MAX;  // scales rand() to [0, 1].
-        n = n * 2 - 1;
-        matrix[i][j] = n;  // (possibly) change to use float to save memory
+  // Writes the expression into out, reusing its storage when the shape already matches. out may be
+  // one of the operands since every element only depends on the same element of each operand.
+  void evaluate_into(typename Nested<Rank>::type& out) const {
+    const E& e = static_cast<const E&>(*this);
+    int d0 = e.dim(0);
+    int d1 = e.dim(1);
+    int d2 = e.dim(2);
+
+    if constexpr (Rank == 1) {
+      out.resize(d0);
+      _evaluate_row(e.row(0, 0), out.data(), d0);
+    } else if constexpr (Rank == 2) {
+      if (out.size() != d0 || (d0 > 0 && out[0].size() != d1)) {
+        out.assign(d0, vector<double>(d1, 0));
+      }
+      for (int i = 0; i < d0; i++) {
+        _evaluate_row(e.row(i, 0), out[i].data(), d1);
+      }
+    } else {
+      if (out.size() != d0 || (d0 > 0 && (out[0].size() != d1 || (d1 > 0 && out[0][0].size() != d2)))) {
+        out.assign(d0, vector<vector<double>>(d1, vector<double>(d2, 0)));
+      }
+      for (int i = 0; i < d0; i++) {
+        for (int j = 0; j < d1; j++) {
+          _evaluate_row(e.row(i, j), out[i][j].data(), d2);
+        }
       }
     }
   }
 
-  static void rand_init(vector<double>& matrix, int length) {
-    for (int i = 0; i < length; i++) {
-      // use numbers between -10 and 10
-      double n = (double)rand() / RAND_MAX;  // scales rand() to [0, 1].
-      n = n * 2 - 1;
-      matrix[i] = n;
+ private:
+  template <class Row>
+  void static _evaluate_row(Row row, double* out, int n) {
+    for (int k = 0; k < n; k++) {
+      out[k] = row[k];
     }
   }
+};
 
-  vector<double> static add_vectors(vector<double> a, vector<double> b) {
-    vector<double> c(a.size(), 0);
+// row(i, j) returns something indexable by the innermost coordinate. For leaves that is a plain
+// pointer to the contiguous row; indices beyond the rank are ignored.
+template <int Rank>
+struct LeafExpr : Expr<LeafExpr<Rank>, Rank> {
+  const typename Nested<Rank>::type& v;
 
-    for (int i = 0; i < a.size(); i++) {
-      c[i] = (a[i] + b[i]);
+  LeafExpr(const typename Nested<Rank>::type& v) : v(v) {}
+
+  int dim(int d) const {
+    if constexpr (Rank == 1) {
+      return d == 0 ? v.size() : 1;
+    } else if constexpr (Rank == 2) {
+      return d == 0 ? v.size() : d == 1 ? (v.empty() ? 0 : v[0].size()) : 1;
+    } else {
+      if (d == 0) {
+        return v.size();
+      }
+      if (d == 1) {
+        return v.empty() ? 0 : v[0].size();
+      }
+      return v.empty() || v[0].empty() ? 0 : v[0][0].size();
     }
+  }
 
-    return c;
+  const double* row(int i, int j) const {
+    if constexpr (Rank == 1) {
+      return v.data();
+    } else if constexpr (Rank == 2) {
+      return v[i].data();
+    } else {
+      return v[i][j].data();
+    }
   }
+};
 
-  vector<double> static scalar_multiple(vector<double> a, double n) {
-    vector<double> c(a.size(), 0);
+template <class A, class B>
+struct SumExpr : Expr<SumExpr<A, B>, A::rank> {
+  static_assert(A::rank == B::rank, "Elementwise operands must have the same rank");
+  A a;
+  B b;
 
-    for (int i = 0; i < a.size(); i++) {
-      c[i] = n * (a[i]);
-    }
+  SumExpr(A a, B b) : a(a), b(b) {}
 
-    return c;
-  }
+  template <class RowA, class RowB>
+  struct Row {
+    RowA a;
+    RowB b;
+    double operator[](int k) const { return a[k] + b[k]; }
+  };
 
-  vector<vector<double>> static add_matrices(vector<vector<double>> a, vector<vector<double>> b) {
-    vector<vector<double>> c(a.size(), vector<double>(a[0].size(), 0));
+  int dim(int d) const { return a.dim(d); }
 
-    for (int i = 0; i < a.size(); i++) {
-      for (int j = 0; j < a[0].size(); j++) {
-        c[i][j] = (a[i][j] + b[i][j]);
-      }
-    }
+  auto row(int i, int j) const { return Row<decltype(a.row(i, j)), decltype(b.row(i, j))>{a.row(i, j), b.row(i, j)}; }
+};
+
+template <class A>
+struct ScaledExpr : Expr<ScaledExpr<A>, A::rank> {
+  A a;
+  double n;
+
+  ScaledExpr(A a, double n) : a(a), n(n) {}
+
+  template <class RowA>
+  struct Row {
+    RowA a;
+    double n;
+    double operator[](int k) const { return n * a[k]; }
+  };
+
+  int dim(int d) const { return a.dim(d); }
+
+  auto row(int i, int j) const { return Row<decltype(a.row(i, j))>{a.row(i, j), n}; }
+};
+
+inline LeafExpr<1> as_expr(const vector<double>& v) { return LeafExpr<1>(v); }
+inline LeafExpr<2> as_expr(const vector<vector<double>>& v) { return LeafExpr<2>(v); }
+inline LeafExpr<3> as_expr(const vector<vector<vector<double>>>& v) { return LeafExpr<3>(v); }
+template <class E, int Rank>
+const E& as_expr(const Expr<E, Rank>& e) {
+  return static_cast<const E&>(e);
+}
+
+// Storage order of a Tensor: channel planes (CHW), or one vector of channels per pixel (HWC).
+enum class Layout { CHW, HWC };
+
+// Contiguous num_channels x height x width block. The compute kernels run on this so that their
+// tiles correspond to real cache footprints; Layer::h keeps the nested vectors as its interface.
+struct Tensor {
+  int channels = 0;
+  int height = 0;
+  int width = 0;
+  vector<double> data;
+  Layout layout = Layout::CHW;
 
-    return c;
+  Tensor() = default;
+
+  Tensor(int channels, int height, int width) { resize(channels, height, width); }
+
+  // Keeps the allocation when the tensor does not grow.
+  void resize(int channels, int height, int width) {
+    this->channels = channels;
+    this->height = height;
+    this->width = width;
+    data.resize((size_t)channels * height * width);
   }
 
-  vector<vector<double>> static scalar_multiple(vector<vector<double>> a, double n) {
-    vector<vector<double>> c(a.size(), vector<double>(a[0].size(), 0));
+  int size() const { return channels * height * width; }
 
-    for (int i = 0; i < a.size(); i++) {
-      for (int j = 0; j < a[0].size(); j++) {
-        c[i][j] = n * (a[i][j]);
-      }
-    }
+  vector<int> shape() const { return {channels, height, width}; }
 
-    return c;
+  // shape() == shape, without building the vector.
+  bool has_shape(const vector<int>& shape) const {
+    return shape.size() == 3 && channels == shape[0] && height == shape[1] && width == shape[2];
   }
 
-  vector<vector<vector<double>>> static add_tensors(vector<vector<vector<double>>> a,
-                                                    vector<vector<vector<double>>> b) {
-    vector<vector<vector<double>>> c(a.size(), vector<vector<double>>(a[0].size(), vector<double>(a[0][0].size(), 0)));
+  // Only for CHW tensors.
+  double* plane(int c) { return data.data() + (size_t)c * height * width; }
+  const double* plane(int c) const { return data.data() + (size_t)c * height * width; }
 
-    vector<vector<vector<double>>> c_column;
-    for (int i = 0; i < a.size(); i++) {
-      for (int j = 0; j < a[0].size(); j++) {
-        for (int k = 0; k < a[0][0].size(); k++) {
-          c[i][j][k] = (a[i][j][k] + b[i][j][k]);
+  size_t offset(int c, int i, int j) const {
+    return layout == Layout::CHW ? ((size_t)c * height + i) * width + j : ((size_t)i * width + j) * channels + c;
+  }
+  double& at(int c, int i, int j) { return data[offset(c, i, j)]; }
+  double at(int c, int i, int j) const { return data[offset(c, i, j)]; }
+
+  // Copies this tensor into out, stored in the given layout.
+  void convert(Layout layout, Tensor& out) const {
+    out.resize(channels, height, width);
+    out.layout = layout;
+    if (layout == this->layout) {
+      copy(data.begin(), data.end(), out.data.begin());
+    } else if (layout == Layout::HWC) {
+      transpose(data.data(), out.data.data(), channels, height * width);
+    } else {
+      transpose(data.data(), out.data.data(), height * width, channels);
+    }
+  }
+
+  // out (cols x rows) = in (rows x cols) transposed, in cache-sized blocks.
+  static void transpose(const double* in, double* out, int rows, int cols) {
+    const int block = 16;
+    for (int i0 = 0; i0 < rows; i0 += block) {
+      for (int j0 = 0; j0 < cols; j0 += block) {
+        for (int i = i0; i < min(rows, i0 + block); i++) {
+          for (int j = j0; j < min(cols, j0 + block); j++) {
+            out[(size_t)j * rows + i] = in[(size_t)i * cols + j];
+          }
         }
       }
     }
+  }
 
-    return c;
+  void load(const vector<vector<vector<double>>>& a) {
+    layout = Layout::CHW;
+    resize(a.size(), a.empty() ? 0 : a[0].size(), a.empty() || a[0].empty() ? 0 : a[0][0].size());
+    double* out = data.data();
+    for (auto& channel : a) {
+      for (auto& row : channel) {
+        out = copy(row.begin(), row.end(), out);
+      }
+    }
   }
 
-  vector<vector<vector<double>>> static scalar_multiple(vector<vector<vector<double>>> a, double n) {
-    vector<vector<vector<double>>> c(a.size(), vector<vector<double>>(a[0].size(), vector<double>(a[0][0].size(), 0)));
+  static Tensor from_nested(const vector<vector<vector<double>>>& a) {
+    Tensor t;
+    t.load(a);
+    return t;
+  }
 
-    vector<vector<vector<double>>> c_column;
-    for (int i = 0; i < a.size(); i++) {
-      for (int j = 0; j < a[0].size(); j++) {
-        for (int k = 0; k < a[0][0].size(); k++) {
-          c[i][j][k] = n * (a[i][j][k]);
-        }
+  vector<vector<vector<double>>> to_nested() const {
+    if (layout != Layout::CHW) {
+      Tensor chw;
+      convert(Layout::CHW, chw);
+      return chw.to_nested();
+    }
+    vector<vector<vector<double>>> a(channels);
+    const double* in = data.data();
+    for (int c = 0; c < channels; c++) {
+      a[c].reserve(height);
+      for (int i = 0; i < height; i++) {
+        a[c].emplace_back(in, in + width);
+        in += width;
       }
     }
-
-    return c;
+    return a;
   }
 };
 
-class Conv : public Layer {
- public:
-  int num_input_channels;
-  int num_filters;
-  vector<int> size_per_filter;
-  vector<int> stride_per_filter;
-
-  vector<vector<vector<double>>> filters;
-  // TODO: Add a bias per filter.
-  Conv(int num_input_channels, int num_filters, vector<int> size_per_filter, vector<int> stride_per_filter) {
-    // TODO: Check if there is a better way to save these.
-    this->num_input_channels = num_input_channels;
-    this->num_filters = num_filters;
-    this->size_per_filter = size_per_filter;
-    this->stride_per_filter = stride_per_filter;
+// 16-bit storage formats. Values are widened back to double before any arithmetic, so only storage
+// is reduced: bf16 keeps the exponent range of a float with 8 significant bits, fp16 has 11
+// significant bits but overflows to infinity above 65504.
+enum class Precision { Double, BF16, FP16 };
 
-    for (int i = 0; i < num_filters; i++) {
-      // Filters are square
-      int height = size_per_filter[i];
-      int width = size_per_filter[i];
+// Conversions between double and the 16-bit formats, rounding to nearest even through float. The
+// portable loops have no branches, so that the compiler vectorizes them; builds for CPUs with
+// AVX512-BF16 or F16C convert 16 or 8 values per instruction instead. The AVX512-BF16 instruction
+// flushes subnormal floats to zero, which the portable bf16 loop keeps.
+class HalfPrecision {
+ public:
+  static void to_bf16(const double* __restrict in, uint16_t* __restrict out, size_t n) {
+    size_t i = 0;
+#if defined(__AVX512BF16__) && defined(__AVX512DQ__)
+    for (; i + 16 <= n; i += 16) {
+      __m512 f = _mm512_insertf32x8(_mm512_castps256_ps512(_mm512_cvtpd_ps(_mm512_loadu_pd(in + i))),
+                                    _mm512_cvtpd_ps(_mm512_loadu_pd(in + i + 8)), 1);
+      _mm256_storeu_si256((__m256i*)(out + i), (__m256i)_mm512_cvtneps_pbh(f));
+    }
+#endif
+    for (; i < n; i++) {
+      uint32_t b = _bits((float)in[i]);
+      uint32_t rounded = (b + 0x7fff + ((b >> 16) & 1)) >> 16;
+      out[i] = (b & 0x7fffffff) > 0x7f800000 ? (b >> 16) | 0x40 : rounded;  // NaN stays NaN
+    }
+  }
 
-      vector<vector<double>> filter(height, vector<double>(width, 0));
-      Layer().rand_init(filter, height, width);
-      this->filters.push_back(filter);
+  static void from_bf16(const uint16_t* __restrict in, double* __restrict out, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+      out[i] = _float((uint32_t)in[i] << 16);
     }
   }
 
-  // TODO: Write a test for this function if needed.
-  vector<vector<vector<double>>> h(vector<vector<vector<double>>> a) {
-    // Input and output is num_channels x height x width
-    // First filter adds to the output of the first channel only, etc.
+  static void to_fp16(const double* __restrict in, uint16_t* __restrict out, size_t n) {
+    size_t i = 0;
+#ifdef __F16C__
+    for (; i + 8 <= n; i += 8) {
+      __m256 f = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm256_cvtpd_ps(_mm256_loadu_pd(in + i))),
+                                      _mm256_cvtpd_ps(_mm256_loadu_pd(in + i + 4)), 1);
+      _mm_storeu_si128((__m128i*)(out + i), _mm256_cvtps_ph(f, _MM_FROUND_TO_NEAREST_INT));
+    }
+#endif
+    for (; i < n; i++) {
+      out[i] = _fp16((float)in[i]);
+    }
+  }
 
-    // feature map (or activation map) is the output of one filter (or kernel or
-    // detector)
-    vector<vector<vector<double>>> output_block;
-    for (int i = 0; i < num_filters; i++) {  // Should be embarrassingly parallel
-      vector<vector<double>> feature_map = convolve(a, filters[i], stride_per_filter[i]);
-      output_block.push_back(feature_map);
+  static void from_fp16(const uint16_t* __restrict in, double* __restrict out, size_t n) {
+    size_t i = 0;
+#ifdef __F16C__
+    for (; i + 8 <= n; i += 8) {
+      __m256 f = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(in + i)));
+      _mm256_storeu_pd(out + i, _mm256_cvtps_pd(_mm256_castps256_ps128(f)));
+      _mm256_storeu_pd(out + i + 4, _mm256_cvtps_pd(_mm256_extractf128_ps(f, 1)));
+    }
+#endif
+    for (; i < n; i++) {
+      out[i] = _from_fp16(in[i]);
     }
-    return output_block;
   }
 
-  // static because this is a self-contained method
-  vector<vector<double>> static convolve(vector<vector<vector<double>>> a, vector<vector<double>> filter, int stride) {
-    // a is num_channels x height x width
-    // Reference:
-    // https://stats.stackexchange.com/questions/335321/in-a-convolutional-neural-network-cnn-when-convolving-the-image-is-the-opera
+  static uint32_t _bits(float f) {
+    uint32_t b;
+    memcpy(&b, &f, sizeof(b));
+    return b;
+  }
 
-    int depth = a.size();
-    int height = a[0].size();
-    int width = a[0][0].size();
+  static float _float(uint32_t b) {
+    float f;
+    memcpy(&f, &b, sizeof(f));
+    return f;
+  }
 
-    int depth_of_a = a.size();
-    vector<vector<double>> feature_map = _convolve(a[0], filter, stride);
-    for (int i = 1; i < depth; i++) {
-      vector<vector<double>> feature_map_for_depth = _convolve(a[i], filter, stride);
-      feature_map = add_matrices(feature_map, feature_map_for_depth);
+  static uint16_t _fp16(float f) {
+    const uint32_t denormal_magic = (127 - 15 + 23 - 10 + 1) << 23;
+    uint32_t b = _bits(f);
+    uint32_t sign = (b >> 16) & 0x8000;
+    b &= 0x7fffffff;
+    uint32_t h;
+    if (b >= (127 + 16) << 23) {
+      h = b > 0x7f800000 ? 0x7e00 : 0x7c00;  // NaN, or too large for fp16
+    } else if (b < (127 - 14) << 23) {
+      // Subnormal fp16: the float addition does the rounding.
+      h = _bits(_float(b) + _float(denormal_magic)) - denormal_magic;
+    } else {
+      h = (b - ((127 - 15) << 23) + 0xfff + ((b >> 13) & 1)) >> 13;
     }
+    return sign | h;
+  }
 
-    for (int depth = 0; depth < depth_of_a; depth++) {
+  static double _from_fp16(uint16_t h) {
+    const uint32_t exponent_mask = 0x7c00 << 13;
+    uint32_t b = (h & 0x7fff) << 13;
+    uint32_t exponent = b & exponent_mask;
+    b += (127 - 15) << 23;
+    float f;
+    if (exponent == exponent_mask) {
+      f = _float(b + ((128 - 16) << 23));  // Infinity or NaN
+    } else if (exponent == 0) {
+      f = _float(b + (1 << 23)) - _float((127 - 14) << 23);  // Subnormal
+    } else {
+      f = _float(b);
     }
-
-    return feature_map;
+    return h & 0x8000 ? -f : f;
   }
 
-  // Need to take into account stride.
-  vector<vector<double>> static _convolve(vector<vector<double>> a, vector<vector<double>> filter, int stride) {
-    // Height and width of the convolution.
-    int c_width = (a.size() - filter.size()) / stride + 1;
-    int c_height = (a[0].size() - filter.size()) / stride + 1;
-
-    vector<vector<double>> convolved(c_width, (vector<double>(c_height, 0)));
-    for (int i = 0; i < c_width; ++i) {
-      for (int j = 0; j < c_height; ++j) {
-        for (int x = 0; x < filter.size(); ++x) {
-          for (int y = 0; y < filter[0].size(); ++y) {
-            convolved[i][j] = convolved[i][j] + a[i * stride + x][j * stride + y] * filter[x][y];
-          }
-        }
+  void static conversion_test() {
+    vector<double> values = {0, -0.0, 1, -2.5, 0.15625, 1 + 1.0 / 512, 3.0e-6, 65504, 70000, -1e300, NAN};
+    for (int i = 0; i < 40; i++) {
+      values.push_back(((double)rand() / RAND_MAX * 2 - 1) * pow(2, i % 20 - 10));
+    }
+    vector<uint16_t> bf16(values.size()), fp16(values.size());
+    vector<double> widened_bf16(values.size()), widened_fp16(values.size());
+    to_bf16(values.data(), bf16.data(), values.size());
+    to_fp16(values.data(), fp16.data(), values.size());
+    from_bf16(bf16.data(), widened_bf16.data(), values.size());
+    from_fp16(fp16.data(), widened_fp16.data(), values.size());
+
+    // Exact values, rounding to even, overflow and NaN.
+    vector<double> exact = {0, -0.0, 1, -2.5, 0.15625};
+    for (int i = 0; i < exact.size(); i++) {
+      if (widened_bf16[i] != exact[i] || widened_fp16[i] != exact[i] ||
+          signbit(widened_fp16[i]) != signbit(exact[i])) {
+        throw(string) "Test failed! " + (string) __FUNCTION__;
+      }
+    }
+    if (widened_bf16[5] != 1 || widened_fp16[5] != 1 + 1.0 / 512 || abs(widened_fp16[6] - 3.0e-6) > pow(2, -25) ||
+        widened_fp16[7] != 65504 || widened_fp16[8] != INFINITY || widened_bf16[9] != -INFINITY ||
+        !isnan(widened_bf16[10]) || !isnan(widened_fp16[10])) {
+      throw(string) "Test failed! " + (string) __FUNCTION__;
+    }
+    // Half an ulp at most: 8 and 11 significant bits, and half the fp16 subnormal spacing.
+    for (int i = 11; i < values.size(); i++) {
+      if (abs(widened_bf16[i] - values[i]) > abs(values[i]) * pow(2, -8) ||
+          abs(widened_fp16[i] - values[i]) > abs(values[i]) * pow(2, -11) + pow(2, -25)) {
+        throw(string) "Test failed! " + (string) __FUNCTION__;
       }
     }
-
-    return convolved;
   }
+};
 
-  void static _convolve_test() {
-    vector<vector<double>> a = {{1.0, 1.0, 1.0, 0.0, 0.0},
-                                {0.0, 1.0, 1.0, 1.0, 0.0},
-                                {0.0, 0.0, 1.0, 1.0, 1.0},
-                                {0.0, 0.0, 1.0, 1.0, 0.0},
-                                {0.0, 1.0, 1.0, 0.0, 0.0}};
-    vector<vector<double>> filter = {{1.0, 0.0, 1.0}, {0.0, 1.0, 0.0}, {1.0, 0.0, 1.0}};
+// A Tensor stored in a 16-bit format, for activations that are only read back by the backward pass.
+struct PackedTensor {
+  int channels = 0;
+  int height = 0;
+  int width = 0;
+  Layout layout = Layout::CHW;
+  Precision precision = Precision::BF16;
+  vector<uint16_t> data;
+
+  bool empty() const { return data.empty(); }
+
+  void pack(const Tensor& t, Precision precision) {
+    channels = t.channels;
+    height = t.height;
+    width = t.width;
+    layout = t.layout;
+    this->precision = precision;
+    data.resize(t.size());
+    if (precision == Precision::FP16) {
+      HalfPrecision::to_fp16(t.data.data(), data.data(), data.size());
+    } else {
+      HalfPrecision::to_bf16(t.data.data(), data.data(), data.size());
+    }
+  }
 
-    vector<vector<double>> actual_output = _convolve(a, filter, 2);
-    vector<vector<double>> expected_output = {{4.0, 4.0}, {2.0, 4.0}};
+  void unpack(Tensor& out) const {
+    out.resize(channels, height, width);
+    out.layout = layout;
+    if (precision == Precision::FP16) {
+      HalfPrecision::from_fp16(data.data(), out.data.data(), data.size());
+    } else {
+      HalfPrecision::from_bf16(data.data(), out.data.data(), data.size());
+    }
+  }
+};
 
-    for (int i = 0; i < actual_output.size(); i++) {
-      for (int j = 0; j < actual_output[i].size(); j++) {
-        cout << actual_output[i][j] << ",";
-        if (actual_output[i][j] != expected_output[i][j]) {
-          throw(string) "Test failed! " + (string) __FUNCTION__;
-        }
-      }
-      cout << endl;
+// Counter-based random numbers (Philox4x32-10, Salmon et al., SC'11). Block n of a stream is a
+// keyed bijection of (n, stream id), so a stream holds no state but its position: it can seek, and
+// split() derives independent child streams for workers without any sharing between threads. The
+// numbers depend only on the seed and the stream ids, however the work is divided. Satisfies
+// UniformRandomBitGenerator, so the <random> distributions and std::shuffle accept it.
+class RngStream {
+ public:
+  using result_type = uint32_t;
+  static constexpr result_type min() { return 0; }
+  static constexpr result_type max() { return UINT32_MAX; }
+
+  explicit RngStream(uint64_t seed = 0, uint64_t stream = 0)
+      : key{(uint32_t)seed, (uint32_t)(seed >> 32)}, stream(stream) {}
+
+  result_type operator()() {
+    if (used == 4) {
+      block = philox({(uint32_t)position, (uint32_t)(position >> 32), (uint32_t)stream, (uint32_t)(stream >> 32)},
+                     key);
+      position++;
+      used = 0;
     }
+    return block[used++];
+  }
 
-    vector<vector<double>> a2 = {{1.0, 1.0, 1.0, 0.0, 0.0},
-                                 {0.0, 1.0, 1.0, 1.0, 0.0},
-                                 {0.0, 0.0, 1.0, 1.0, 1.0},
-                                 {0.0, 0.0, 1.0, 1.0, 0.0},
-                                 {0.0, 1.0, 1.0, 0.0, 0.0}};
-    vector<vector<double>> filter2 = {{1.0}};
+  // Uniform in [0, 1), with 53 random bits.
+  double uniform() {
+    uint64_t high = (*this)();
+    uint64_t low = (*this)() >> 11;
+    return ((high << 21) | low) * 0x1.0p-53;
+  }
 
-    vector<vector<double>> actual_output2 = _convolve(a2, filter2, 1);
-    vector<vector<double>> expected_output2 = {{1.0, 1.0, 1.0, 0.0, 0.0},
-                                               {0.0, 1.0, 1.0, 1.0, 0.0},
-                                               {0.0, 0.0, 1.0, 1.0, 1.0},
-                                               {0.0, 0.0, 1.0, 1.0, 0.0},
-                                               {0.0, 1.0, 1.0, 0.0, 0.0}};
+  double uniform(double low, double high) { return low + (high - low) * uniform(); }
 
-    for (int i = 0; i < actual_output2.size(); i++) {
-      for (int j = 0; j < actual_output2[i].size(); j++) {
-        cout << actual_output2[i][j] << ",";
-        if (actual_output2[i][j] != expected_output2[i][j]) {
-          throw(string) "Test failed! " + (string) __FUNCTION__;
-        }
+  // Uniform in [0, n), without modulo bias (Lemire's multiply and reject).
+  uint32_t below(uint32_t n) {
+    uint64_t m = (uint64_t)(*this)() * n;
+    if ((uint32_t)m < n) {
+      uint32_t threshold = -n % n;
+      while ((uint32_t)m < threshold) {
+        m = (uint64_t)(*this)() * n;
       }
-      cout << endl;
     }
+    return m >> 32;
   }
 
-  void static convolve_test() {
-    vector<vector<vector<double>>> a = {{{1.0, 1.0, 1.0, 0.0, 0.0},
-                                         {0.0, 1.0, 1.0, 1.0, 0.0},
-                                         {0.0, 0.0, 1.0, 1.0, 1.0},
-                                         {0.0, 0.0, 1.0, 1.0, 0.0},
-                                         {0.0, 1.0, 1.0, 0.0, 0.0}},
+  // A stream independent of this one and of its other children, given by this stream and child.
+  RngStream split(uint64_t child) const {
+    return RngStream(((uint64_t)key[1] << 32) | key[0], _mix(stream ^ _mix(child + 1)));
+  }
 
-                                        {{0.0, 1.0, 0.0, 1.0, 0.0},
-                                         {0.0, 0.0, 1.0, 1.0, 1.0},
-                                         {0.0, 0.0, 1.0, 1.0, 0.0},
-                                         {0.0, 1.0, 1.0, 0.0, 1.0},
-                                         {0.0, 1.0, 1.0, 0.0, 0.0}},
+  // Continues from the given block of four outputs.
+  void seek(uint64_t block_index) {
+    position = block_index;
+    used = 4;
+  }
 
-                                        {{1.0, 0.0, 0.0, 0.0, 0.0},
-                                         {0.0, 1.0, 0.0, 0.0, 0.0},
-                                         {0.0, 0.0, 1.0, 0.0, 0.0},
-                                         {0.0, 0.0, 0.0, 1.0, 0.0},
-                                         {0.0, 0.0, 0.0, 0.0, 1.0}}};
-    vector<vector<double>> filter = {{1, 0}, {1, 1}};
+  // Seed of the process: random when be_random is set, fixed otherwise.
+  static uint64_t process_seed() {
+    static const uint64_t seed = be_random ? ((uint64_t)random_device{}() << 32) | random_device{}() : 2021;
+    return seed;
+  }
 
-    vector<vector<double>> actual_output = convolve(a, filter, 2);
-    vector<vector<double>> expected_output = {{4.0, 5.0}, {1.0, 7.0}};
+  // A new child of the process stream on every call, for users that need their own randomness.
+  // Reproducible when be_random is off, as long as the calls come in the same order.
+  static RngStream next_stream() {
+    static atomic<uint64_t> streams{0};
+    return RngStream(process_seed()).split(streams++);
+  }
 
-    for (int i = 0; i < actual_output.size(); i++) {
-      for (int j = 0; j < actual_output[i].size(); j++) {
-        cout << actual_output[i][j] << ",";
-        if (actual_output[i][j] != expected_output[i][j]) {
-          throw(string) "Test failed! " + (string) __FUNCTION__;
-        }
+  static array<uint32_t, 4> philox(array<uint32_t, 4> counter, array<uint32_t, 2> key) {
+    for (int round = 0; round < 10; round++) {
+      if (round > 0) {
+        key[0] += 0x9E3779B9;
+        key[1] += 0xBB67AE85;
       }
-      cout << endl;
+      uint64_t p0 = (uint64_t)0xD2511F53 * counter[0];
+      uint64_t p1 = (uint64_t)0xCD9E8D57 * counter[2];
+      counter = {(uint32_t)(p1 >> 32) ^ counter[1] ^ key[0], (uint32_t)p1, (uint32_t)(p0 >> 32) ^ counter[3] ^ key[1],
+                 (uint32_t)p0};
     }
+    return counter;
+  }
 
-    vector<vector<vector<double>>> a2 = {{{9.0, 1.0, 9.0, 0.0, 9.0},
-                                          {0.0, 1.0, 9.0, 1.0, 0.0},
-                                          {9.0, 0.0, 9.0, 1.0, 9.0},
-                                          {0.0, 0.0, 9.0, 0.0, 0.0},
-                                          {9.0, 1.0, 9.0, 0.0, 9.0}}};
-    vector<vector<double>> filter2 = {{1.0}};
+  void static rng_test() {
+    // Known answers of the reference implementation (Random123).
+    if (philox({0, 0, 0, 0}, {0, 0}) != array<uint32_t, 4>{0x6627e8d5, 0xe169c58d, 0xbc57ac4c, 0x9b00dbd8} ||
+        philox({0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff}, {0xffffffff, 0xffffffff}) !=
+            array<uint32_t, 4>{0x408f276d, 0x41c83b0e, 0xa20bc7c6, 0x6d5451fd} ||
+        philox({0x243f6a88, 0x85a308d3, 0x13198a2e, 0x03707344}, {0xa4093822, 0x299f31d0}) !=
+            array<uint32_t, 4>{0xd16cfe09, 0x94fdcceb, 0x5001e420, 0x24126ea1}) {
+      throw(string) "Test failed! " + (string) __FUNCTION__;
+    }
 
-    vector<vector<double>> actual_output2 = convolve(a2, filter2, 2);
-    vector<vector<double>> expected_output2 = {{9.0, 9.0, 9.0}, {9.0, 9.0, 9.0}, {9.0, 9.0, 9.0}};
+    // Reproducible, seekable, and split into streams that differ from each other and the parent.
+    RngStream a = RngStream(42), b = RngStream(42);
+    vector<uint32_t> first;
+    for (int i = 0; i < 12; i++) {
+      first.push_back(a());
+      if (b() != first.back()) {
+        throw(string) "Test failed! " + (string) __FUNCTION__;
+      }
+    }
+    b.seek(2);
+    RngStream child0 = a.split(0), child1 = a.split(1), grandchild = child0.split(0);
+    uint32_t c0 = child0(), c1 = child1(), g = grandchild();
+    if (b() != first[8] || c0 == c1 || c0 == first[0] || g == c0 || a.split(0)() != c0) {
+      throw(string) "Test failed! " + (string) __FUNCTION__;
+    }
 
-    for (int i = 0; i < actual_output2.size(); i++) {
-      for (int j = 0; j < actual_output2[0].size(); j++) {
-        cout << actual_output2[i][j] << ",";
-        if (actual_output2[i][j] != expected_output2[i][j]) {
-          throw(string) "Test failed! " + (string) __FUNCTION__;
-        }
+    // Uniform doubles and bounded integers.
+    RngStream rng = RngStream(7);
+    double sum = 0;
+    vector<int> counts(6, 0);
+    for (int i = 0; i < 60000; i++) {
+      double u = rng.uniform();
+      if (!(u >= 0 && u < 1)) {
+        throw(string) "Test failed! " + (string) __FUNCTION__;
       }
-      cout << endl;
+      sum += u;
+      counts[rng.below(6)]++;
+    }
+    for (int count : counts) {
+      if (abs(count - 10000) > 500) {
+        throw(string) "Test failed! " + (string) __FUNCTION__;
+      }
+    }
+    if (abs(sum / 60000 - 0.5) > 0.01) {
+      throw(string) "Test failed! " + (string) __FUNCTION__;
     }
   }
-};
 
-class Pool : public Layer {};
+ private:
+  array<uint32_t, 2> key;
+  uint64_t stream;
+  uint64_t position = 0;  // Next block
+  array<uint32_t, 4> block;
+  int used = 4;  // Outputs of block already returned
+
+  // The SplitMix64 finalizer, a bijection that spreads every input bit over the output.
+  static uint64_t _mix(uint64_t z) {
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+    return z ^ (z >> 31);
+  }
+};
 
-class MaxPool : public Pool {
+// Source of the example indices fit() trains on, one minibatch at a time.
+class Sampler {
  public:
-  int height;
-  int width;
-  int stride;
+  virtual ~Sampler() = default;
 
-  // No num_input_channels variable is necessary because no weights are
-  // allocated for Pooling
-  MaxPool(int size) {
-    this->height = size;
-    this->width = size;
-    this->stride = size;
-  }
-
-  vector<vector<vector<double>>> h(vector<vector<vector<double>>> a) {
-    vector<vector<vector<double>>> output_block;
+  // Fills batch with the next k indices, reusing its storage.
+  virtual void next(int k, vector<int>& batch) = 0;
+};
 
-    int num_input_channels = a.size();
+// Independent uniform minibatches of distinct examples. Each minibatch is a partial Fisher-Yates
+// shuffle of the first k positions of a permutation kept between calls, so a step costs O(k) after
+// an O(N) setup. The first k positions are a uniform sample whatever order the permutation was left
+// in, so it never needs resetting.
+class MinibatchSampler : public Sampler {
+ public:
+  MinibatchSampler(int n, RngStream rng) : order(n), rng(rng) {
+    if (n < 1) {
+      throw(string) "Cannot sample from an empty dataset!";
+    }
+    iota(order.begin(), order.end(), 0);
+  }
 
-    for (int i = 0; i < num_input_channels; i++) {                               // Should be embarrassingly parallel
-      vector<vector<double>> pool_map = _max_pool(a[i], height, width, stride);  // Max pool by later
-      output_block.push_back(pool_map);
+  void next(int k, vector<int>& batch) override {
+    int n = order.size();
+    k = min(k, n);
+    batch.resize(k);
+    for (int i = 0; i < k; i++) {
+      swap(order[i], order[i + rng.below(n - i)]);
+      batch[i] = order[i];
     }
-    return output_block;
   }
 
-  vector<vector<double>> static _max_pool(vector<vector<double>> a, int height, int width, int stride) {
-    int i = 0;
-    int j = 0;
+ private:
+  vector<int> order;
+  RngStream rng;
+};
 
-    vector<vector<double>> pool_map;
-    while (i <= a.size() - height) {
-      vector<double> pooled_row;
+// Every example once per epoch, in an order drawn anew for each epoch. Epoch e is a Fisher-Yates
+// shuffle with child stream e of rng, so it does not depend on the epochs before it. A minibatch
+// that crosses the end of an epoch continues into the next one.
+class EpochShuffler : public Sampler {
+ public:
+  int epoch = 0;  // The epoch in progress
 
-      while (j <= a[0].size() - width) {
-        double max_value = numeric_limits<double>::lowest();
-        for (int x = 0; x < height && i + x < a.size(); ++x) {
-          for (int y = 0; y < width && j + y < a[0].size(); ++y) {
-            if (a[i + x][j + y] > max_value) {
-              max_value = a[i + x][j + y];
-            }
-          }
-        }
-        pooled_row.push_back(max_value);
-        j = j + stride;
-      }
-      pool_map.push_back(pooled_row);
-      j = 0;
-      i = i + stride;
+  EpochShuffler(int n, RngStream rng) : order(n), rng(rng) {
+    if (n < 1) {
+      throw(string) "Cannot sample from an empty dataset!";
     }
-    return pool_map;
+    _shuffle();
   }
 
-  void static _max_pool_test() {
-    vector<vector<double>> a = {{0, 1, 2, 3}, {4, 5, 6, 7}, {1, 1, 1, 1}, {9, 0, 6, 3}};
+  void next(int k, vector<int>& batch) override {
+    batch.resize(k);
+    for (int i = 0; i < k; i++) {
+      if (cursor == order.size()) {
+        epoch++;
+        _shuffle();
+      }
+      batch[i] = order[cursor++];
+    }
+  }
 
-    vector<vector<double>> test_val = _max_pool(a, 2, 2, 2);
-    vector<vector<double>> expected_val = {{5, 7}, {9, 6}};
-    for (int i = 0; i < test_val.size(); ++i) {
-      for (int j = 0; j < test_val[0].size(); ++j) {
-        cout << test_val[i][j] << ",";
-        if (test_val[i][j] != expected_val[i][j]) {
-          throw(string) "Test failed! " + (string) __FUNCTION__;
-        }
+  void static sampler_test() {
+    MinibatchSampler sampler = MinibatchSampler(50, RngStream(3));
+    MinibatchSampler same = MinibatchSampler(50, RngStream(3));
+    vector<int> batch, other;
+    vector<int> counts(50, 0);
+    for (int step = 0; step < 2000; step++) {
+      sampler.next(10, batch);
+      same.next(10, other);
+      if (batch != other || set<int>(batch.begin(), batch.end()).size() != 10) {
+        throw(string) "Test failed! " + (string) __FUNCTION__;
+      }
+      for (int i : batch) {
+        counts.at(i)++;
+      }
+    }
+    // Every example is drawn with probability k / N = 0.2 per step.
+    for (int count : counts) {
+      if (abs(count - 400) > 80) {
+        throw(string) "Test failed! " + (string) __FUNCTION__;
       }
-      cout << endl;
     }
 
-    vector<vector<double>> a2 = {{0, 1, 2, 3}, {4, 5, 6, 7}, {1, 1, 1, 1}, {9, 0, 6, 3}};
+    // Epochs are permutations, a different one every epoch, and minibatches run across their ends.
+    EpochShuffler shuffler = EpochShuffler(12, RngStream(3));
+    vector<int> epoch0, epoch1;
+    for (int step = 0; step < 6; step++) {
+      shuffler.next(4, batch);
+      vector<int>& epoch = step < 3 ? epoch0 : epoch1;
+      epoch.insert(epoch.end(), batch.begin(), batch.end());
+    }
+    vector<int> sorted0 = epoch0, sorted1 = epoch1, identity(12);
+    sort(sorted0.begin(), sorted0.end());
+    sort(sorted1.begin(), sorted1.end());
+    iota(identity.begin(), identity.end(), 0);
+    shuffler.next(5, batch);
+    shuffler.next(8, other);
+    if (sorted0 != identity || sorted1 != identity || epoch0 == epoch1 || shuffler.epoch != 3 ||
+        set<int>(other.begin(), other.begin() + 7).size() != 7) {
+      throw(string) "Test failed! " + (string) __FUNCTION__;
+    }
+  }
 
-    vector<vector<double>> test_val2 = _max_pool(a2, 1, 2, 3);
-    vector<vector<double>> expected_val2 = {{1}, {9}};
-    for (int i = 0; i < test_val2.size(); ++i) {
-      for (int j = 0; j < test_val2[0].size(); ++j) {
-        cout << test_val2[i][j] << ",";
-        if (test_val2[i][j] != expected_val2[i][j]) {
-          throw(string) "Test failed! " + (string) __FUNCTION__;
-        }
-      }
-      cout << endl;
+ private:
+  vector<int> order;
+  RngStream rng;
+  int cursor = 0;  // Next position of order to hand out
+
+  void _shuffle() {
+    RngStream stream = rng.split(epoch);
+    iota(order.begin(), order.end(), 0);
+    for (int i = order.size() - 1; i > 0; i--) {
+      swap(order[i], order[stream.below(i + 1)]);
     }
+    cursor = 0;
   }
 };
 
-class Act : public Layer {
+class Layer {
  public:
-  vector<vector<vector<double>>> h(vector<vector<vector<double>>> z) {
-    // Applied the sigmoid element wise.
-    vector<vector<vector<double>>> output_block;
-    for (int i = 0; i < z.size(); i++) {
-      vector<vector<double>> depth_output;
-      for (int j = 0; j < z[0].size(); j++) {
-        vector<double> row_output;
-        for (int k = 0; k < z[0][0].size(); k++) {
-          double activation = activation_func(z[i][j][k]);
-          row_output.push_back(activation);
-        }
-        depth_output.push_back(row_output);
+  virtual ~Layer() = default;
+
+  vector<vector<vector<double>>> h(vector<vector<vector<double>>> x);
+
+  // Stream rand_init draws from on this thread: a child of the process stream of its own, until
+  // seed_init() sets it. Workers that initialize in parallel and must be reproducible call
+  // seed_init(seed, worker) first.
+  static RngStream& init_stream() {
+    thread_local RngStream stream = RngStream::next_stream();
+    return stream;
+  }
+
+  static void seed_init(uint64_t seed, uint64_t stream = 0) { init_stream() = RngStream(seed, stream); }
+
+  // Helper functions
+  static void rand_init(vector<vector<vector<double>>>& tensor, int height, int width) {
+    for (int i = 0; i < height; i++) {
+      for (int j = 0; j < width; j++) {
+        tensor[i][j][0] = init_stream().uniform(-1, 1);  // (possibly) change to use float to save memory
       }
-      output_block.push_back(depth_output);
     }
-    return output_block;
   }
 
-  vector<vector<vector<double>>> da_dz(vector<vector<vector<double>>> z) {
-    // Applied the sigmoid element wise.
-    vector<vector<vector<double>>> output_block_partials;
-    for (int i = 0; i < z.size(); i++) {
-      vector<vector<double>> depth_output;
-      for (int j = 0; j < z[0].size(); j++) {
-        vector<double> row_output;
-        for (int k = 0; k < z[0][0].size(); k++) {
-          double activation = activation_func_derivative(z[i][j][k]);
-          row_output.push_back(activation);
-        }
-        depth_output.push_back(row_output);
+  static void rand_init(vector<vector<double>>& matrix, int height, int width) {
+    for (int i = 0; i < height; i++) {
+      for (int j = 0; j < width; j++) {
+        matrix[i][j] = init_stream().uniform(-1, 1);  // (possibly) change to use float to save memory
       }
-      output_block_partials.push_back(depth_output);
     }
-    return output_block_partials;
   }
 
-  virtual double activation_func(double z) = 0;
-  virtual double activation_func_derivative(double z) = 0;
-};
+  static void rand_init(vector<double>& matrix, int length) {
+    for (int i = 0; i < length; i++) {
+      matrix[i] = init_stream().uniform(-1, 1);
+    }
+  }
 
-class Sigmoid : public Act {
- public:
-  double activation_func(double z) { return 1 / (1 + exp(-z)); }
+  // Elementwise helpers. These return lazy expressions (see Expr) that convert to the nested vector
+  // they describe, or can be written into an existing one with assign().
+  template <class A, class B>
+  auto static add_vectors(const A& a, const B& b) {
+    static_assert(decltype(as_expr(a))::rank == 1, "add_vectors expects vectors");
+    return SumExpr(as_expr(a), as_expr(b));
+  }
 
-  double activation_func_derivative(double z) { return activation_func(z) * (1 - activation_func(z)); };
+  template <class A, class B>
+  auto static add_matrices(const A& a, const B& b) {
+    static_assert(decltype(as_expr(a))::rank == 2, "add_matrices expects matrices");
+    return SumExpr(as_expr(a), as_expr(b));
+  }
 
-  void static sigmoid_test() {
-    vector<vector<vector<double>>> z = {{{1, 1}, {2, 2}, {3, 3}}, {{1, 0}, {0, 1}, {1, -1}}};
-    vector<vector<vector<double>>> val = Sigmoid().h(z);
-    vector<vector<vector<double>>> expected = {{{0.731059, 0.731059}, {0.880797, 0.880797}, {0.952574, 0.952574}},
-                                               {{0.731059, 0.5}, {0.5, 0.731059}, {0.731059, 0.268941}}};
+  template <class A, class B>
+  auto static add_tensors(const A& a, const B& b) {
+    static_assert(decltype(as_expr(a))::rank == 3, "add_tensors expects tensors");
+    return SumExpr(as_expr(a), as_expr(b));
+  }
 
-    for (int i = 0; i < z.size(); i++) {
-      for (int j = 0; j < z[0].size(); j++) {
-        for (int k = 0; k < z[0][0].size(); k++) {
-          cout << val[i][j][k] << ", ";
-          if (abs(val[i][j][k] - expected[i][j][k]) > 0.0001) {
-            throw(string) "Test failed! " + (string) __FUNCTION__;
-          }
-        }
-      }
+  template <class A>
+  auto static scalar_multiple(const A& a, double n) {
+    return ScaledExpr(as_expr(a), n);
+  }
+
+  // Evaluates an expression into dst without allocating when dst already has the right shape.
+  template <class E, int Rank>
+  void static assign(typename Nested<Rank>::type& dst, const Expr<E, Rank>& e) {
+    e.evaluate_into(dst);
+  }
+
+  void static expression_test() {
+    vector<vector<vector<double>>> w = {{{1, 2}, {3, 4}}, {{5, 6}, {7, 8}}};
+    vector<vector<vector<double>>> g = {{{2, 2}, {2, 2}}, {{4, 4}, {4, 4}}};
+
+    vector<vector<vector<double>>> stepped = add_tensors(w, scalar_multiple(g, -0.5));
+    vector<vector<vector<double>>> expected = {{{0, 1}, {2, 3}}, {{3, 4}, {5, 6}}};
+    if (stepped != expected) {
+      throw(string) "Test failed! " + (string) __FUNCTION__;
     }
 
-    cout << endl;
+    // In place, and with the destination as an operand: no reallocation.
+    const double* row = w[1][1].data();
+    assign(w, add_tensors(w, scalar_multiple(add_tensors(g, g), -0.25)));
+    if (w != expected || w[1][1].data() != row) {
+      throw(string) "Test failed! " + (string) __FUNCTION__;
+    }
+
+    vector<vector<double>> m1 = {{1, 2}, {3, 4}};
+    vector<vector<double>> m2 = {{1, 1}, {1, 1}};
+    vector<double> v1 = {1, 2, 3};
+    vector<double> v2 = {3, 2, 1};
+    vector<vector<double>> m = add_matrices(m1, m2);
+    vector<double> v = scalar_multiple(add_vectors(v1, v2), 0.5);
+    if (m != vector<vector<double>>{{2, 3}, {4, 5}} || v != vector<double>{2, 2, 2}) {
+      throw(string) "Test failed! " + (string) __FUNCTION__;
+    }
   }
 };
 
-class Relu : public Act {
+// Ways Conv can compute its output. ConvPlanner binds one to every Conv layer at compile time.
+enum class ConvAlgorithm { Auto, Direct, Gemm, Winograd, Fft };
+
+// Loop tiling of the convolution kernel, chosen per layer shape by the Autotuner.
+struct ConvTiling {
+  int tile_rows = 8;   // Output rows per tile
+  int tile_cols = 64;  // Output columns per tile
+  int unroll = 4;      // Output columns per inner iteration (1, 2, 4 or 8)
+};
+
+class Conv : public Layer {
  public:
-  double activation_func(double z) { return max(0.0, z); }
+  int num_input_channels;
+  int num_filters;
+  vector<int> size_per_filter;
+  vector<int> stride_per_filter;
 
-  double activation_func_derivative(double z) {
-    if (z > 0) {
-      return 1;
-    } else {
-      return 0;
+  // num_filters x num_input_channels kernels of K x K: filters[f * num_input_channels + c] is the
+  // kernel filter f applies to input channel c. Call pack() after changing filters or biases.
+  vector<vector<vector<double>>> filters;
+  vector<double> biases;  // One per filter
+  // Filters and biases as read by the Direct and Gemm kernels: blocks of filter_block filters,
+  // [block][c][x][y][filter in block], with zero weights past the last filter.
+  vector<double> packed;
+  vector<double> packed_hwc;  // The weights for channels-last inputs, [x][y][c][f]
+  vector<array<double, 16>> winograd_weights;  // G g G^T of every kernel, for 3x3 filters
+  ConvTiling tiling;
+  ConvAlgorithm algorithm = ConvAlgorithm::Direct;
+  ConvAlgorithm forced_algorithm = ConvAlgorithm::Auto;  // Debugging override, applied by ConvPlanner
+  int padding = 0;  // Zero rows and columns on every side of the input, or Conv::same
+
+  // Pads so that the output is ceil(input / stride) in both dimensions.
+  static constexpr int same = -1;
+  // Filters whose weights for one tap are adjacent in packed, so that each input value a kernel
+  // loads updates that many output planes.
+  static constexpr int filter_block = 4;
+
+  Conv(int num_input_channels, int num_filters, vector<int> size_per_filter, vector<int> stride_per_filter,
+       int padding = 0) {
+    // TODO: Check if there is a better way to save these.
+    this->num_input_channels = num_input_channels;
+    this->num_filters = num_filters;
+    this->size_per_filter = size_per_filter;
+    this->stride_per_filter = stride_per_filter;
+    this->padding = padding;
+
+    for (int i = 0; i < num_filters; i++) {
+      // Filters are square
+      int height = size_per_filter[i];
+      int width = size_per_filter[i];
+
+      for (int c = 0; c < num_input_channels; c++) {
+        vector<vector<double>> filter(height, vector<double>(width, 0));
+        Layer().rand_init(filter, height, width);
+        this->filters.push_back(filter);
+      }
     }
-  };
+    this->biases = vector<double>(num_filters, 0);
+    rand_init(biases, num_filters);
+    pack();
+  }
 
-  void static relu_test() {
-    vector<vector<vector<double>>> z = {{{1, 1}, {2, -2}, {3, -3}}, {{1, 0}, {0, 1}, {1, -1}}};
-    vector<vector<vector<double>>> val = Relu().h(z);
-    vector<vector<vector<double>>> expected = {{{1, 1}, {2, 0}, {3, 0}}, {{1, 0}, {0, 1}, {1, 0}}};
+  // Filter f as a num_input_channels x K x K tensor.
+  vector<vector<vector<double>>> filter(int f) const {
+    return vector<vector<vector<double>>>(filters.begin() + f * num_input_channels,
+                                          filters.begin() + (f + 1) * num_input_channels);
+  }
 
-    for (int i = 0; i < z.size(); i++) {
-      for (int j = 0; j < z[0].size(); j++) {
-        for (int k = 0; k < z[0][0].size(); k++) {
-          cout << val[i][j][k] << ", ";
-          if (val[i][j][k] != expected[i][j][k]) {
-            throw(string) "Test failed! " + (string) __FUNCTION__;
+  // Rebuilds packed from filters and biases.
+  void pack() {
+    int k = size_per_filter[0];
+    int num_blocks = (num_filters + filter_block - 1) / filter_block;
+    packed.assign((size_t)num_blocks * filter_block * (num_input_channels * k * k + 1), 0.0);
+    double* block = packed.data();
+    for (int f0 = 0; f0 < num_filters; f0 += filter_block) {
+      for (int b = 0; b < filter_block && f0 + b < num_filters; b++) {
+        for (int c = 0; c < num_input_channels; c++) {
+          const vector<vector<double>>& kernel = filters[(f0 + b) * num_input_channels + c];
+          for (int x = 0; x < k; x++) {
+            for (int y = 0; y < k; y++) {
+              block[((c * k + x) * k + y) * filter_block + b] = kernel[x][y];
+            }
+          }
+        }
+      }
+      block += num_input_channels * k * k * filter_block;
+    }
+    // Biases follow the weight blocks.
+    copy(biases.begin(), biases.end(), block);
+
+    packed_hwc.resize((size_t)k * k * num_input_channels * num_filters);
+    for (int f = 0; f < num_filters; f++) {
+      for (int c = 0; c < num_input_channels; c++) {
+        for (int x = 0; x < k; x++) {
+          for (int y = 0; y < k; y++) {
+            packed_hwc[((x * k + y) * num_input_channels + c) * num_filters + f] =
+                filters[f * num_input_channels + c][x][y];
           }
         }
       }
     }
 
-    cout << endl;
+    winograd_weights.resize(k == 3 ? filters.size() : 0);
+    for (int f = 0; f < winograd_weights.size(); f++) {
+      const vector<vector<double>>& g = filters[f];
+      array<double, 16>& u = winograd_weights[f];
+      double gg[4][3];
+      for (int y = 0; y < 3; y++) {
+        gg[0][y] = g[0][y];
+        gg[1][y] = (g[0][y] + g[1][y] + g[2][y]) / 2;
+        gg[2][y] = (g[0][y] - g[1][y] + g[2][y]) / 2;
+        gg[3][y] = g[2][y];
+      }
+      for (int x = 0; x < 4; x++) {
+        u[x * 4 + 0] = gg[x][0];
+        u[x * 4 + 1] = (gg[x][0] + gg[x][1] + gg[x][2]) / 2;
+        u[x * 4 + 2] = (gg[x][0] - gg[x][1] + gg[x][2]) / 2;
+        u[x * 4 + 3] = gg[x][2];
+      }
+    }
   }
-};
 
-class Flatten : public Layer {
-  // Flattens to a column vector
- public:
-  vector<vector<vector<double>>> static f(vector<vector<vector<double>>> a) {
-    vector<vector<vector<double>>> flattened;
-    for (int i = 0; i < a.size(); i++) {
-      for (int j = 0; j < a[0].size(); j++) {
-        for (int k = 0; k < a[0][0].size(); k++) {
-          vector<vector<double>> num = {{a[i][j][k]}};
-          flattened.push_back(num);  // Add a one element row vector to the column
-        }
+  vector<vector<vector<double>>> h(vector<vector<vector<double>>> a) {
+    // Input is num_input_channels x height x width, output is num_filters x height x width
+    Tensor in = Tensor::from_nested(a);
+    Tensor out;
+    forward(in, out);
+    return out.to_nested();
+  }
+
+  vector<int> output_shape(const vector<int>& in_shape) const {
+    array<int, 3> shape = _output_shape(in_shape[0], in_shape[1], in_shape[2]);
+    return {shape[0], shape[1], shape[2]};
+  }
+
+  // output_shape() without the vectors, for the forward pass.
+  array<int, 3> _output_shape(int channels, int in_height, int in_width) const {
+    int k = size_per_filter[0];
+    int stride = stride_per_filter[0];
+    for (int i = 1; i < num_filters; i++) {
+      if (size_per_filter[i] != k || stride_per_filter[i] != stride) {
+        throw(string) "All filters of a Conv layer must produce feature maps of the same size!";
       }
     }
-    return flattened;
+    if (channels != num_input_channels) {
+      throw(string) "Mismatch between Conv parameters and incoming channels!";
+    }
+    array<int, 4> pad = pads(in_height, in_width);
+    int height = in_height + pad[0] + pad[2];
+    int width = in_width + pad[1] + pad[3];
+    if (height < k || width < k) {
+      throw(string) "Conv filter is larger than its input!";
+    }
+    return {num_filters, (height - k) / stride + 1, (width - k) / stride + 1};
   }
-};
-
-class Dense : public Layer {
- public:
-  int num_out;
-  int num_in;
 
-  vector<vector<vector<double>>> weights;
-  vector<double> biases;
+  // Zero padding {top, left, bottom, right} of an input of in_shape. With Conv::same an odd amount
+  // puts the extra row or column at the bottom or right.
+  array<int, 4> pads(const vector<int>& in_shape) const { return pads(in_shape[1], in_shape[2]); }
 
-  Dense(int num_out, int num_in) {
-    this->num_out = num_out;
-    this->num_in = num_in;
+  array<int, 4> pads(int height, int width) const {
+    if (padding != same) {
+      return {padding, padding, padding, padding};
+    }
+    int k = size_per_filter[0];
+    int stride = stride_per_filter[0];
+    int rows = max(0, ((height + stride - 1) / stride - 1) * stride + k - height);
+    int cols = max(0, ((width + stride - 1) / stride - 1) * stride + k - width);
+    return {rows / 2, cols / 2, rows - rows / 2, cols - cols / 2};
+  }
 
-    // Initialize weights with all values zero, then set all weights to a random value
-    this->weights = vector<vector<vector<double>>>(num_out, vector<vector<double>>(num_in, vector<double>(1, 0)));
-    rand_init(weights, num_out, num_in);
+  // The padding is never materialized. For an input of length n, the outputs [begin, end) of one
+  // dimension read inside the input at tap offset (tap index minus leading padding); the others
+  // read zeros and are skipped, so the loops over them need no bounds checks.
+  static int _inside_begin(int offset, int stride) { return offset >= 0 ? 0 : (-offset + stride - 1) / stride; }
+  static int _inside_end(int offset, int stride, int n) { return n - offset <= 0 ? 0 : (n - offset - 1) / stride + 1; }
+
+  void forward(const Tensor& in, Tensor& out) const {
+    array<int, 3> shape = _output_shape(in.channels, in.height, in.width);
+    out.resize(shape[0], shape[1], shape[2]);
+    out.layout = in.layout;
+    array<int, 4> pad = pads(in.height, in.width);
+    if (in.layout == Layout::HWC) {
+      _forward_hwc(in, out, pad);  // The algorithm choice applies to CHW inputs
+      return;
+    }
+    for (int f = 0; f < num_filters; f++) {
+      fill(out.plane(f), out.plane(f) + out.height * out.width, biases[f]);
+    }
 
-    // Initialize biases with all values zero, then set all biases to a random value
-    this->biases = vector<double>(num_out, 0);
-    rand_init(biases, num_out);
+    if (!supports(algorithm)) {
+      throw(string) "Convolution algorithm does not support this Conv layer!";
+    }
+    switch (algorithm) {
+      case ConvAlgorithm::Gemm:
+        _forward_gemm(in, out, pad);
+        break;
+      case ConvAlgorithm::Winograd:
+        _forward_winograd(in, out, pad);
+        break;
+      case ConvAlgorithm::Fft:
+        _forward_fft(in, out, pad);
+        break;
+      default:
+        // feature map (or activation map) is the output of one filter (or kernel or
+        // detector)
+        _forward_direct(in.data.data(), in.height, in.width, out.data.data(), out.height, out.width, pad);
+    }
   }
 
-  vector<vector<vector<double>>> h(vector<vector<vector<double>>> a) {
-    vector<vector<vector<double>>> zs;
+  // The Direct kernel on raw channel-major buffers: adds the convolution of the in_height x
+  // in_width input to the out_height x out_width output, which holds the biases or other sums.
+  void _forward_direct(const double* in, int in_height, int in_width, double* out, int out_height, int out_width,
+                       array<int, 4> pad) const {
+    switch (tiling.unroll) {
+      case 8:
+        _forward_direct<8>(in, in_height, in_width, out, out_height, out_width, pad);
+        break;
+      case 4:
+        _forward_direct<4>(in, in_height, in_width, out, out_height, out_width, pad);
+        break;
+      case 2:
+        _forward_direct<2>(in, in_height, in_width, out, out_height, out_width, pad);
+        break;
+      default:
+        _forward_direct<1>(in, in_height, in_width, out, out_height, out_width, pad);
+    }
+  }
 
-    if (a.size() != num_in) {
-      throw(string) "Mismatch between Dense parameters and incoming vector!";
+  // Adds dLoss/dfilters and dLoss/dbiases to dfilters and dbiases and, if grad_in is given, writes
+  // dLoss/din into it, given the forward input and dLoss/dout.
+  void backward(const Tensor& in, const Tensor& grad_out, Tensor* grad_in, vector<vector<vector<double>>>& dfilters,
+                vector<double>& dbiases) const {
+    int k = size_per_filter[0];
+    int stride = stride_per_filter[0];
+    array<int, 4> pad = pads(in.height, in.width);
+    if (grad_in) {
+      grad_in->resize(in.channels, in.height, in.width);
+      grad_in->layout = in.layout;
+      fill(grad_in->data.begin(), grad_in->data.end(), 0.0);
+    }
+    if (in.layout == Layout::HWC) {
+      _backward_hwc(in, grad_out, grad_in, dfilters, dbiases, pad);
+      return;
     }
 
-    for (int i = 0; i < num_out; i++) {
-      double z = biases[i];
-      for (int j = 0; j < num_in; j++) {
-        z = z + weights[i][j][0] * a[j][0][0];
+    for (int f = 0; f < num_filters; f++) {
+      const double* g = grad_out.plane(f);
+      for (int e = 0; e < grad_out.height * grad_out.width; e++) {
+        dbiases[f] += g[e];
+      }
+      for (int c = 0; c < in.channels; c++) {
+        vector<vector<double>>& dkernel = dfilters[f * in.channels + c];
+        const vector<vector<double>>& kernel = filters[f * in.channels + c];
+        for (int i = 0; i < grad_out.height; i++) {
+          const double* g_row = g + i * grad_out.width;
+          for (int x = 0; x < k; x++) {
+            int r = i * stride + x - pad[0];
+            if (r < 0 || r >= in.height) {
+              continue;  // Zero padding
+            }
+            const double* in_row = in.plane(c) + r * in.width;
+            double* g_in_row = grad_in ? grad_in->plane(c) + r * in.width : nullptr;
+            for (int y = 0; y < k; y++) {
+              int offset = y - pad[1];
+              int j1 = min(grad_out.width, _inside_end(offset, stride, in.width));
+              double w = kernel[x][y];
+              double dw = 0;
+              for (int j = _inside_begin(offset, stride); j < j1; j++) {
+                dw += g_row[j] * in_row[j * stride + offset];
+                if (g_in_row) {
+                  g_in_row[j * stride + offset] += g_row[j] * w;
+                }
+              }
+              dkernel[x][y] += dw;
+            }
+          }
+        }
       }
-      vector<vector<double>> num = {{z}};
-      zs.push_back(num);
     }
+  }
 
-    return zs;
+  void _backward_hwc(const Tensor& in, const Tensor& grad_out, Tensor* grad_in,
+                     vector<vector<vector<double>>>& dfilters, vector<double>& dbiases, array<int, 4> pad) const {
+    int k = size_per_filter[0];
+    int stride = stride_per_filter[0];
+    int num_channels = in.channels;
+
+    for (int i = 0; i < grad_out.height; i++) {
+      int x0 = max(0, pad[0] - i * stride);
+      int x1 = min(k, in.height + pad[0] - i * stride);
+      for (int j = 0; j < grad_out.width; j++) {
+        const double* g = grad_out.data.data() + ((size_t)i * grad_out.width + j) * num_filters;
+        for (int f = 0; f < num_filters; f++) {
+          dbiases[f] += g[f];
+        }
+        int y0 = max(0, pad[1] - j * stride);
+        int y1 = min(k, in.width + pad[1] - j * stride);
+        for (int x = x0; x < x1; x++) {
+          for (int y = y0; y < y1; y++) {
+            size_t pixel = ((size_t)(i * stride + x - pad[0]) * in.width + j * stride + y - pad[1]) * num_channels;
+            const double* w = packed_hwc.data() + (size_t)(x * k + y) * num_channels * num_filters;
+            for (int c = 0; c < num_channels; c++) {
+              double v = in.data[pixel + c];
+              const double* w_c = w + c * num_filters;
+              double g_in = 0;
+              for (int f = 0; f < num_filters; f++) {
+                dfilters[f * num_channels + c][x][y] += g[f] * v;
+                g_in += g[f] * w_c[f];
+              }
+              if (grad_in) {
+                grad_in->data[pixel + c] += g_in;
+              }
+            }
+          }
+        }
+      }
+    }
   }
 
-  void static h_test() {
-    vector<vector<vector<double>>> a{{{1}}, {{2}}, {{3}}};  // e.g. a[0] = {{1}};
+  bool supports(ConvAlgorithm algorithm) const {
+    if (algorithm == ConvAlgorithm::Winograd) {
+      return size_per_filter[0] == 3 && stride_per_filter[0] == 1;
+    }
+    return algorithm != ConvAlgorithm::Auto;
+  }
 
-    Dense d = Dense(5, 3);
-    d.weights = {{{1}, {0}, {0}}, {{0}, {1}, {0}}, {{0}, {0}, {1}}, {{0}, {0}, {0}}, {{0}, {0}, {0}}};
+  // Channels-last direct convolution. For one tap and input channel, the weights of all filters are
+  // contiguous in packed_hwc, so the innermost loop runs across filters with unit stride and the
+  // output pixel's channel vector stays in registers or L1.
+  void _forward_hwc(const Tensor& in, Tensor& out, array<int, 4> pad) const {
+    int k = size_per_filter[0];
+    int stride = stride_per_filter[0];
+    int num_channels = in.channels;
+
+    for (int i = 0; i < out.height; i++) {
+      // Filter rows that read inside the input for this output row
+      int x0 = max(0, pad[0] - i * stride);
+      int x1 = min(k, in.height + pad[0] - i * stride);
+      for (int j = 0; j < out.width; j++) {
+        double* o = out.data.data() + ((size_t)i * out.width + j) * num_filters;
+        copy(biases.begin(), biases.end(), o);
+        int y0 = max(0, pad[1] - j * stride);
+        int y1 = min(k, in.width + pad[1] - j * stride);
+        for (int x = x0; x < x1; x++) {
+          const double* in_row = in.data.data() + (size_t)(i * stride + x - pad[0]) * in.width * num_channels;
+          for (int y = y0; y < y1; y++) {
+            const double* pixel = in_row + (size_t)(j * stride + y - pad[1]) * num_channels;
+            const double* w = packed_hwc.data() + (size_t)(x * k + y) * num_channels * num_filters;
+            for (int c = 0; c < num_channels; c++) {
+              double v = pixel[c];
+              const double* w_c = w + c * num_filters;
+              for (int f = 0; f < num_filters; f++) {
+                o[f] += v * w_c[f];
+              }
+            }
+          }
+        }
+      }
+    }
+  }
+
+  // Lowers the input to a (channels * k * k) x (out_h * out_w) matrix (im2col) and multiplies the
+  // filter matrix with it. Every filter then streams through the same contiguous rows.
+  void _forward_gemm(const Tensor& in, Tensor& out, array<int, 4> pad) const {
+    int k = size_per_filter[0];
+    int stride = stride_per_filter[0];
+    int n = out.height * out.width;
+    int depth = in.channels * k * k;
+
+    thread_local vector<double> cols;
+    cols.assign((size_t)depth * n, 0.0);  // Entries that fall in the padding stay zero
+    for (int c = 0; c < in.channels; c++) {
+      for (int x = 0; x < k; x++) {
+        for (int y = 0; y < k; y++) {
+          double* col = cols.data() + (size_t)((c * k + x) * k + y) * n;
+          int offset = y - pad[1];
+          int j0 = _inside_begin(offset, stride);
+          int j1 = min(out.width, _inside_end(offset, stride, in.width));
+          for (int i = 0; i < out.height; i++) {
+            int r = i * stride + x - pad[0];
+            if (r < 0 || r >= in.height) {
+              continue;
+            }
+            const double* src = in.plane(c) + r * in.width;
+            for (int j = j0; j < j1; j++) {
+              col[i * out.width + j] = src[j * stride + offset];
+            }
+          }
+        }
+      }
+    }
+
+    // Columns are blocked so that one block of every row of cols stays in cache across filters, and
+    // each row is read once per block of filters. The packed weights are the rows of the filter matrix.
+    int block = max(1, tiling.tile_rows * tiling.tile_cols);
+    for (int j0 = 0; j0 < n; j0 += block) {
+      int j1 = min(n, j0 + block);
+      for (int f0 = 0; f0 < num_filters; f0 += filter_block) {
+        int nf = min(filter_block, num_filters - f0);
+        const double* w = packed.data() + (size_t)(f0 / filter_block) * depth * filter_block;
+        for (int p = 0; p < depth; p++) {
+          const double* col = cols.data() + (size_t)p * n;
+          for (int b = 0; b < nf; b++) {
+            double w_b = w[p * filter_block + b];
+            double* out_row = out.plane(f0 + b);
+            for (int j = j0; j < j1; j++) {
+              out_row[j] += w_b * col[j];
+            }
+          }
+        }
+      }
+    }
+  }
+
+  // Direct convolution, tile by tile over the output. For each block of filter_block filters every
+  // input channel is streamed through the tile once, while the tile of each of those output planes
+  // stays in cache: each input value is loaded once per tap and added to all of them. Rows a filter
+  // row would read from the padding are skipped, and every tap only runs over the columns it reads
+  // inside the input, so the unrolled inner loop has no bounds checks.
+  template <int U>
+  void _forward_direct(const double* in, int in_height, int in_width, double* out, int out_height, int out_width,
+                       array<int, 4> pad) const {
+    int k = size_per_filter[0];
+    int stride = stride_per_filter[0];
+    int tile_rows = max(1, tiling.tile_rows);
+    int tile_cols = max(1, tiling.tile_cols);
+    size_t block_size = (size_t)num_input_channels * k * k * filter_block;
+    size_t in_plane = (size_t)in_height * in_width;
+    size_t out_plane = (size_t)out_height * out_width;
+
+    for (int i0 = 0; i0 < out_height; i0 += tile_rows) {
+      int i1 = min(out_height, i0 + tile_rows);
+      for (int j0 = 0; j0 < out_width; j0 += tile_cols) {
+        int j1 = min(out_width, j0 + tile_cols);
+
+        for (int f0 = 0; f0 < num_filters; f0 += filter_block) {
+          int nf = min(filter_block, num_filters - f0);
+          const double* block = packed.data() + (f0 / filter_block) * block_size;
+          for (int c = 0; c < num_input_channels; c++) {
+            const double* plane = in + c * in_plane;
+            for (int i = i0; i < i1; i++) {
+              for (int x = 0; x < k; x++) {
+                int r = i * stride + x - pad[0];
+                if (r < 0 || r >= in_height) {
+                  continue;
+                }
+                const double* in_row = plane + r * in_width;
+                const double* w = block + (c * k + x) * k * filter_block;
+                for (int y = 0; y < k; y++) {
+                  int offset = y - pad[1];
+                  int j_begin = max(j0, _inside_begin(offset, stride));
+                  int j_end = min(j1, _inside_end(offset, stride, in_width));
+                  const double* w_y = w + y * filter_block;
+                  double* out_row = out + f0 * out_plane + i * out_width;
+                  int j = j_begin;
+                  for (; j + U <= j_end; j += U) {
+                    double v[U];
+                    for (int u = 0; u < U; u++) {
+                      v[u] = in_row[(j + u) * stride + offset];
+                    }
+                    for (int b = 0; b < nf; b++) {
+                      for (int u = 0; u < U; u++) {
+                        out_row[b * out_plane + j + u] += v[u] * w_y[b];
+                      }
+                    }
+                  }
+                  for (; j < j_end; j++) {
+                    double v = in_row[j * stride + offset];
+                    for (int b = 0; b < nf; b++) {
+                      out_row[b * out_plane + j] += v * w_y[b];
+                    }
+                  }
+                }
+              }
+            }
+          }
+        }
+      }
+    }
+  }
+
+  // Winograd F(2x2, 3x3): each 2x2 output tile costs 16 multiplications per channel instead of 36.
+  // Only for 3x3 filters with stride 1.
+  void _forward_winograd(const Tensor& in, Tensor& out, array<int, 4> pad) const {
+    int tiles_h = (out.height + 1) / 2;
+    int tiles_w = (out.width + 1) / 2;
+
+    const vector<array<double, 16>>& u = winograd_weights;  // U = G g G^T, from pack()
+    thread_local vector<array<double, 16>> m;
+    m.resize(num_filters);
+    for (int ti = 0; ti < tiles_h; ti++) {
+      for (int tj = 0; tj < tiles_w; tj++) {
+        for (auto& mf : m) {
+          mf.fill(0);
+        }
+        for (int c = 0; c < in.channels; c++) {
+          // 4x4 input tile, zero in the padding and beyond the edge when the output size is odd.
+          double d[4][4];
+          for (int x = 0; x < 4; x++) {
+            for (int y = 0; y < 4; y++) {
+              int i = 2 * ti + x - pad[0];
+              int j = 2 * tj + y - pad[1];
+              d[x][y] = i >= 0 && i < in.height && j >= 0 && j < in.width ? in.at(c, i, j) : 0;
+            }
+          }
+          // V = B^T d B
+          double bd[4][4];
+          for (int y = 0; y < 4; y++) {
+            bd[0][y] = d[0][y] - d[2][y];
+            bd[1][y] = d[1][y] + d[2][y];
+            bd[2][y] = d[2][y] - d[1][y];
+            bd[3][y] = d[1][y] - d[3][y];
+          }
+          double v[16];
+          for (int x = 0; x < 4; x++) {
+            v[x * 4 + 0] = bd[x][0] - bd[x][2];
+            v[x * 4 + 1] = bd[x][1] + bd[x][2];
+            v[x * 4 + 2] = bd[x][2] - bd[x][1];
+            v[x * 4 + 3] = bd[x][1] - bd[x][3];
+          }
+          for (int f = 0; f < num_filters; f++) {
+            const array<double, 16>& u_fc = u[f * in.channels + c];
+            for (int e = 0; e < 16; e++) {
+              m[f][e] += u_fc[e] * v[e];
+            }
+          }
+        }
+        // Y = A^T M A
+        for (int f = 0; f < num_filters; f++) {
+          const array<double, 16>& mf = m[f];
+          double am[2][4];
+          for (int y = 0; y < 4; y++) {
+            am[0][y] = mf[0 * 4 + y] + mf[1 * 4 + y] + mf[2 * 4 + y];
+            am[1][y] = mf[1 * 4 + y] - mf[2 * 4 + y] - mf[3 * 4 + y];
+          }
+          for (int x = 0; x < 2; x++) {
+            int i = 2 * ti + x;
+            double y0 = am[x][0] + am[x][1] + am[x][2];
+            double y1 = am[x][1] - am[x][2] - am[x][3];
+            if (i < out.height) {
+              out.at(f, i, 2 * tj) += y0;
+              if (2 * tj + 1 < out.width) {
+                out.at(f, i, 2 * tj + 1) += y1;
+              }
+            }
+          }
+        }
+      }
+    }
+  }
+
+  // Cross-correlation as a pointwise product in the frequency domain, accumulated over channels
+  // before one inverse transform per filter. Cost barely depends on the filter size.
+  void _forward_fft(const Tensor& in, Tensor& out, array<int, 4> pad) const {
+    int k = size_per_filter[0];
+    int stride = stride_per_filter[0];
+    int n_rows = 1;
+    while (n_rows < in.height + pad[0] + pad[2]) {
+      n_rows *= 2;
+    }
+    int n_cols = 1;
+    while (n_cols < in.width + pad[1] + pad[3]) {
+      n_cols *= 2;
+    }
+    size_t n = (size_t)n_rows * n_cols;
+
+    // The input sits at (top, left) of a zero grid, which provides the padding.
+    thread_local vector<vector<complex<double>>> spectra;
+    spectra.resize(in.channels);
+    for (int c = 0; c < in.channels; c++) {
+      spectra[c].assign(n, 0.0);
+      for (int i = 0; i < in.height; i++) {
+        for (int j = 0; j < in.width; j++) {
+          spectra[c][(i + pad[0]) * n_cols + j + pad[1]] = in.at(c, i, j);
+        }
+      }
+      fft_2d(spectra[c], n_rows, n_cols, false);
+    }
+
+    thread_local vector<complex<double>> filter_spectrum;
+    thread_local vector<complex<double>> acc;
+    filter_spectrum.resize(n);
+    acc.resize(n);
+    for (int f = 0; f < num_filters; f++) {
+      fill(acc.begin(), acc.end(), 0.0);
+      for (int c = 0; c < in.channels; c++) {
+        fill(filter_spectrum.begin(), filter_spectrum.end(), 0.0);
+        for (int x = 0; x < k; x++) {
+          for (int y = 0; y < k; y++) {
+            filter_spectrum[x * n_cols + y] = filters[f * in.channels + c][x][y];
+          }
+        }
+        fft_2d(filter_spectrum, n_rows, n_cols, false);
+        for (size_t e = 0; e < n; e++) {
+          acc[e] += spectra[c][e] * conj(filter_spectrum[e]);
+        }
+      }
+      fft_2d(acc, n_rows, n_cols, true);
+
+      // The circular correlation equals the valid one wherever the filter does not wrap around.
+      for (int i = 0; i < out.height; i++) {
+        for (int j = 0; j < out.width; j++) {
+          out.at(f, i, j) += acc[(i * stride) * n_cols + j * stride].real();
+        }
+      }
+    }
+  }
+
+  // In-place radix-2 transform of a row-major n_rows x n_cols grid (both powers of two).
+  void static fft_2d(vector<complex<double>>& grid, int n_rows, int n_cols, bool inverse) {
+    thread_local vector<complex<double>> line;
+    line.resize(max(n_rows, n_cols));
+    for (int i = 0; i < n_rows; i++) {
+      _fft(grid.data() + (size_t)i * n_cols, n_cols, inverse);
+    }
+    for (int j = 0; j < n_cols; j++) {
+      for (int i = 0; i < n_rows; i++) {
+        line[i] = grid[(size_t)i * n_cols + j];
+      }
+      _fft(line.data(), n_rows, inverse);
+      for (int i = 0; i < n_rows; i++) {
+        grid[(size_t)i * n_cols + j] = line[i];
+      }
+    }
+  }
+
+  void static _fft(complex<double>* a, int n, bool inverse) {
+    for (int i = 1, j = 0; i < n; i++) {
+      int bit = n >> 1;
+      for (; j & bit; bit >>= 1) {
+        j ^= bit;
+      }
+      j ^= bit;
+      if (i < j) {
+        swap(a[i], a[j]);
+      }
+    }
+    for (int len = 2; len <= n; len <<= 1) {
+      double angle = 2 * M_PI / len * (inverse ? 1 : -1);
+      complex<double> root(cos(angle), sin(angle));
+      for (int i = 0; i < n; i += len) {
+        complex<double> w(1);
+        for (int j = 0; j < len / 2; j++) {
+          complex<double> even = a[i + j];
+          complex<double> odd = a[i + j + len / 2] * w;
+          a[i + j] = even + odd;
+          a[i + j + len / 2] = even - odd;
+          w *= root;
+        }
+      }
+    }
+    if (inverse) {
+      for (int i = 0; i < n; i++) {
+        a[i] /= n;
+      }
+    }
+  }
+
+  void static h_tiling_test() {
+    Conv conv = Conv(3, 2, {3, 3}, {2, 2});
+    vector<vector<vector<double>>> a(3, vector<vector<double>>(9, vector<double>(11, 0)));
+    for (int c = 0; c < 3; c++) {
+      Layer::rand_init(a[c], 9, 11);
+    }
+
+    for (ConvTiling tiling : {ConvTiling{1, 1, 1}, ConvTiling{2, 3, 2}, ConvTiling{3, 64, 8}, ConvTiling{}}) {
+      conv.tiling = tiling;
+      vector<vector<vector<double>>> output = conv.h(a);
+      for (int f = 0; f < conv.num_filters; f++) {
+        vector<vector<double>> expected = convolve(a, conv.filter(f), conv.stride_per_filter[f]);
+        for (int i = 0; i < expected.size(); i++) {
+          for (int j = 0; j < expected[0].size(); j++) {
+            if (abs(output[f][i][j] - expected[i][j] - conv.biases[f]) > 1e-12) {
+              throw(string) "Test failed! " + (string) __FUNCTION__;
+            }
+          }
+        }
+      }
+    }
+  }
+
+  // Every algorithm against convolve() on an explicitly padded copy, and the backward pass against
+  // central differences of sum(out * g).
+  void static padding_test() {
+    vector<vector<vector<double>>> a(2, vector<vector<double>>(7, vector<double>(9, 0)));
+    for (int c = 0; c < 2; c++) {
+      Layer::rand_init(a[c], 7, 9);
+    }
+    Tensor in = Tensor::from_nested(a);
+
+    for (int padding : {1, 2, same}) {
+      for (int stride : {1, 2}) {
+        Conv conv = Conv(2, 2, {3, 3}, {stride, stride}, padding);
+        array<int, 4> pad = conv.pads(in.shape());
+        vector<int> shape = conv.output_shape(in.shape());
+        if (padding == same && (shape[1] != (7 + stride - 1) / stride || shape[2] != (9 + stride - 1) / stride)) {
+          throw(string) "Test failed! " + (string) __FUNCTION__;
+        }
+
+        vector<vector<vector<double>>> padded(
+            2, vector<vector<double>>(7 + pad[0] + pad[2], vector<double>(9 + pad[1] + pad[3], 0)));
+        for (int c = 0; c < 2; c++) {
+          for (int i = 0; i < 7; i++) {
+            for (int j = 0; j < 9; j++) {
+              padded[c][i + pad[0]][j + pad[1]] = a[c][i][j];
+            }
+          }
+        }
+
+        for (ConvAlgorithm algorithm : {ConvAlgorithm::Direct, ConvAlgorithm::Gemm, ConvAlgorithm::Winograd,
+                                        ConvAlgorithm::Fft}) {
+          if (!conv.supports(algorithm)) {
+            continue;
+          }
+          conv.algorithm = algorithm;
+          for (ConvTiling tiling : {ConvTiling{1, 1, 1}, ConvTiling{2, 3, 2}, ConvTiling{}}) {
+            conv.tiling = tiling;
+            vector<vector<vector<double>>> output = conv.h(a);
+            for (int f = 0; f < conv.num_filters; f++) {
+              vector<vector<double>> expected = convolve(padded, conv.filter(f), stride);
+              if (output[f].size() != expected.size() || output[f][0].size() != expected[0].size()) {
+                throw(string) "Test failed! " + (string) __FUNCTION__;
+              }
+              for (int i = 0; i < expected.size(); i++) {
+                for (int j = 0; j < expected[0].size(); j++) {
+                  if (abs(output[f][i][j] - expected[i][j] - conv.biases[f]) > 1e-9) {
+                    throw(string) "Test failed! " + (string) __FUNCTION__;
+                  }
+                }
+              }
+            }
+          }
+        }
+
+        conv.algorithm = ConvAlgorithm::Direct;
+        Tensor g(shape[0], shape[1], shape[2]);
+        for (int i = 0; i < g.size(); i++) {
+          g.data[i] = (double)(i % 5) - 2;
+        }
+        auto loss = [&](const Tensor& x) {
+          Tensor out;
+          conv.forward(x, out);
+          double sum = 0;
+          for (int i = 0; i < out.size(); i++) {
+            sum += out.data[i] * g.data[i];
+          }
+          return sum;
+        };
+        vector<vector<vector<double>>> dfilters(4, vector<vector<double>>(3, vector<double>(3, 0)));
+        vector<double> dbiases(2, 0);
+        Tensor grad_in;
+        conv.backward(in, g, &grad_in, dfilters, dbiases);
+
+        double epsilon = 1e-6;
+        for (int e = 0; e < in.size(); e += 5) {
+          Tensor x = in;
+          x.data[e] += epsilon;
+          double loss1 = loss(x);
+          x.data[e] -= 2 * epsilon;
+          double numeric = (loss1 - loss(x)) / (2 * epsilon);
+          if (abs(numeric - grad_in.data[e]) > 1e-6) {
+            throw(string) "Test failed! " + (string) __FUNCTION__;
+          }
+        }
+        // Filter 1 on both channels, and its bias.
+        vector<pair<double*, double>> params = {{&conv.biases[1], dbiases[1]}};
+        for (int x = 0; x < 3; x++) {
+          params.push_back({&conv.filters[2 + x % 2][x][2 - x], dfilters[2 + x % 2][x][2 - x]});
+        }
+        for (auto [param, analytic] : params) {
+          double saved = *param;
+          *param = saved + epsilon;
+          conv.pack();
+          double loss1 = loss(in);
+          *param = saved - epsilon;
+          conv.pack();
+          double numeric = (loss1 - loss(in)) / (2 * epsilon);
+          *param = saved;
+          conv.pack();
+          if (abs(numeric - analytic) > 1e-6) {
+            throw(string) "Test failed! " + (string) __FUNCTION__;
+          }
+        }
+      }
+    }
+  }
+
+  // static because this is a self-contained method
+  vector<vector<double>> static convolve(vector<vector<vector<double>>> a, vector<vector<vector<double>>> filter,
+                                         int stride) {
+    // a is num_channels x height x width, filter is num_channels x k x k
+    // Reference:
+    // https://stats.stackexchange.com/questions/335321/in-a-convolutional-neural-network-cnn-when-convolving-the-image-is-the-opera
+
+    int depth = a.size();
+    int height = a[0].size();
+    int width = a[0][0].size();
+    int k = filter[0].size();
+
+    // Every channel accumulates into the same feature map.
+    vector<vector<double>> feature_map((height - k) / stride + 1, vector<double>((width - k) / stride + 1, 0));
+    for (int c = 0; c < depth; c++) {
+      for (int i = 0; i < feature_map.size(); i++) {
+        for (int j = 0; j < feature_map[0].size(); j++) {
+          for (int x = 0; x < k; x++) {
+            for (int y = 0; y < k; y++) {
+              feature_map[i][j] += a[c][i * stride + x][j * stride + y] * filter[c][x][y];
+            }
+          }
+        }
+      }
+    }
+
+    return feature_map;
+  }
+
+  // Need to take into account stride.
+  vector<vector<double>> static _convolve(vector<vector<double>> a, vector<vector<double>> filter, int stride) {
+    // Height and width of the convolution.
+    int c_width = (a.size() - filter.size()) / stride + 1;
+    int c_height = (a[0].size() - filter.size()) / stride + 1;
+
+    vector<vector<double>> convolved(c_width, (vector<double>(c_height, 0)));
+    for (int i = 0; i < c_width; ++i) {
+      for (int j = 0; j < c_height; ++j) {
+        for (int x = 0; x < filter.size(); ++x) {
+          for (int y = 0; y < filter[0].size(); ++y) {
+            convolved[i][j] = convolved[i][j] + a[i * stride + x][j * stride + y] * filter[x][y];
+          }
+        }
+      }
+    }
+
+    return convolved;
+  }
+
+  void static _convolve_test() {
+    vector<vector<double>> a = {{1.0, 1.0, 1.0, 0.0, 0.0},
+                                {0.0, 1.0, 1.0, 1.0, 0.0},
+                                {0.0, 0.0, 1.0, 1.0, 1.0},
+                                {0.0, 0.0, 1.0, 1.0, 0.0},
+                                {0.0, 1.0, 1.0, 0.0, 0.0}};
+    vector<vector<double>> filter = {{1.0, 0.0, 1.0}, {0.0, 1.0, 0.0}, {1.0, 0.0, 1.0}};
+
+    vector<vector<double>> actual_output = _convolve(a, filter, 2);
+    vector<vector<double>> expected_output = {{4.0, 4.0}, {2.0, 4.0}};
+
+    for (int i = 0; i < actual_output.size(); i++) {
+      for (int j = 0; j < actual_output[i].size(); j++) {
+        cout << actual_output[i][j] << ",";
+        if (actual_output[i][j] != expected_output[i][j]) {
+          throw(string) "Test failed! " + (string) __FUNCTION__;
+        }
+      }
+      cout << endl;
+    }
+
+    vector<vector<double>> a2 = {{1.0, 1.0, 1.0, 0.0, 0.0},
+                                 {0.0, 1.0, 1.0, 1.0, 0.0},
+                                 {0.0, 0.0, 1.0, 1.0, 1.0},
+                                 {0.0, 0.0, 1.0, 1.0, 0.0},
+                                 {0.0, 1.0, 1.0, 0.0, 0.0}};
+    vector<vector<double>> filter2 = {{1.0}};
+
+    vector<vector<double>> actual_output2 = _convolve(a2, filter2, 1);
+    vector<vector<double>> expected_output2 = {{1.0, 1.0, 1.0, 0.0, 0.0},
+                                               {0.0, 1.0, 1.0, 1.0, 0.0},
+                                               {0.0, 0.0, 1.0, 1.0, 1.0},
+                                               {0.0, 0.0, 1.0, 1.0, 0.0},
+                                               {0.0, 1.0, 1.0, 0.0, 0.0}};
+
+    for (int i = 0; i < actual_output2.size(); i++) {
+      for (int j = 0; j < actual_output2[i].size(); j++) {
+        cout << actual_output2[i][j] << ",";
+        if (actual_output2[i][j] != expected_output2[i][j]) {
+          throw(string) "Test failed! " + (string) __FUNCTION__;
+        }
+      }
+      cout << endl;
+    }
+  }
+
+  void static convolve_test() {
+    vector<vector<vector<double>>> a = {{{1.0, 1.0, 1.0, 0.0, 0.0},
+                                         {0.0, 1.0, 1.0, 1.0, 0.0},
+                                         {0.0, 0.0, 1.0, 1.0, 1.0},
+                                         {0.0, 0.0, 1.0, 1.0, 0.0},
+                                         {0.0, 1.0, 1.0, 0.0, 0.0}},
+
+                                        {{0.0, 1.0, 0.0, 1.0, 0.0},
+                                         {0.0, 0.0, 1.0, 1.0, 1.0},
+                                         {0.0, 0.0, 1.0, 1.0, 0.0},
+                                         {0.0, 1.0, 1.0, 0.0, 1.0},
+                                         {0.0, 1.0, 1.0, 0.0, 0.0}},
+
+                                        {{1.0, 0.0, 0.0, 0.0, 0.0},
+                                         {0.0, 1.0, 0.0, 0.0, 0.0},
+                                         {0.0, 0.0, 1.0, 0.0, 0.0},
+                                         {0.0, 0.0, 0.0, 1.0, 0.0},
+                                         {0.0, 0.0, 0.0, 0.0, 1.0}}};
+    vector<vector<double>> filter = {{1, 0}, {1, 1}};
+
+    vector<vector<double>> actual_output = convolve(a, {filter, filter, filter}, 2);
+    vector<vector<double>> expected_output = {{4.0, 5.0}, {1.0, 7.0}};
+
+    for (int i = 0; i < actual_output.size(); i++) {
+      for (int j = 0; j < actual_output[i].size(); j++) {
+        cout << actual_output[i][j] << ",";
+        if (actual_output[i][j] != expected_output[i][j]) {
+          throw(string) "Test failed! " + (string) __FUNCTION__;
+        }
+      }
+      cout << endl;
+    }
+
+    vector<vector<vector<double>>> a2 = {{{9.0, 1.0, 9.0, 0.0, 9.0},
+                                          {0.0, 1.0, 9.0, 1.0, 0.0},
+                                          {9.0, 0.0, 9.0, 1.0, 9.0},
+                                          {0.0, 0.0, 9.0, 0.0, 0.0},
+                                          {9.0, 1.0, 9.0, 0.0, 9.0}}};
+    vector<vector<double>> filter2 = {{1.0}};
+
+    vector<vector<double>> actual_output2 = convolve(a2, {filter2}, 2);
+    vector<vector<double>> expected_output2 = {{9.0, 9.0, 9.0}, {9.0, 9.0, 9.0}, {9.0, 9.0, 9.0}};
+
+    for (int i = 0; i < actual_output2.size(); i++) {
+      for (int j = 0; j < actual_output2[0].size(); j++) {
+        cout << actual_output2[i][j] << ",";
+        if (actual_output2[i][j] != expected_output2[i][j]) {
+          throw(string) "Test failed! " + (string) __FUNCTION__;
+        }
+      }
+      cout << endl;
+    }
+  }
+};
+
+// Pooling over height x width windows that move by stride in both directions, without padding. The
+// kernels write into preallocated outputs and run over whole output rows: for each tap of the
+// window, one pass updates every output of the row, so the inner loop is a plain elementwise max or
+// sum that the compiler vectorizes. Channels-last inputs run the same loop over the channels of a
+// pixel instead.
+class Pool : public Layer {
+ public:
+  int height;
+  int width;
+  int stride;
+
+  // No num_input_channels variable is necessary because no weights are
+  // allocated for Pooling
+  Pool(int height, int width, int stride) {
+    if (height < 1 || width < 1 || stride < 1) {
+      throw(string) "Pool windows and strides must be positive!";
+    }
+    this->height = height;
+    this->width = width;
+    this->stride = stride;
+  }
+
+  vector<int> output_shape(const vector<int>& in_shape) const {
+    if (in_shape[1] < height || in_shape[2] < width) {
+      throw(string) "Pool window is larger than its input!";
+    }
+    return {in_shape[0], (in_shape[1] - height) / stride + 1, (in_shape[2] - width) / stride + 1};
+  }
+
+  vector<vector<vector<double>>> h(const vector<vector<vector<double>>>& a) {
+    Tensor out;
+    forward(Tensor::from_nested(a), out);
+    return out.to_nested();
+  }
+
+  virtual void forward(const Tensor& a, Tensor& out) const = 0;
+  virtual void backward(const Tensor& a, const Tensor& grad_out, Tensor& grad_in) const = 0;
+
+ protected:
+  // Sizes out for a and returns whether a is channel-major.
+  bool _prepare(const Tensor& a, Tensor& out) const {
+    if (a.height < height || a.width < width) {
+      throw(string) "Pool window is larger than its input!";
+    }
+    out.resize(a.channels, (a.height - height) / stride + 1, (a.width - width) / stride + 1);
+    out.layout = a.layout;
+    return a.layout == Layout::CHW;
+  }
+};
+
+class MaxPool : public Pool {
+ public:
+  MaxPool(int size) : Pool(size, size, size) {}
+  MaxPool(int height, int width, int stride) : Pool(height, width, stride) {}
+
+  vector<vector<vector<double>>> h(const vector<vector<vector<double>>>& a) {
+    vector<vector<vector<double>>> output_block;
+    for (const vector<vector<double>>& channel : a) {  // Should be embarrassingly parallel
+      output_block.push_back(_max_pool(channel, height, width, stride));
+    }
+    return output_block;
+  }
+
+  void forward(const Tensor& a, Tensor& out) const override { forward(a, out, nullptr); }
+
+  // Also stores in argmax, if given, the index into a.data of every output's maximum: the first one
+  // in the window, row by row, which is where backward() sends the gradient. The indices are size_t,
+  // since the tensors StripStream pools may have more than 2^31 elements.
+  void forward(const Tensor& a, Tensor& out, vector<size_t>* argmax) const {
+    bool chw = _prepare(a, out);
+    size_t* arg = nullptr;
+    if (argmax) {
+      argmax->resize(out.size());
+      arg = argmax->data();
+    }
+    if (!chw) {
+      _forward_hwc(a, out, arg);
+      return;
+    }
+    size_t in_plane = (size_t)a.height * a.width;
+    size_t out_plane = (size_t)out.height * out.width;
+    for (int c = 0; c < a.channels; c++) {
+      _max_pool_plane(a.plane(c), a.width, out.plane(c), out.height, out.width, height, width, stride,
+                      arg ? arg + c * out_plane : nullptr, c * in_plane);
+    }
+  }
+
+  // One channel of a channel-major input whose rows are in_width long. argmax, if given, receives
+  // each maximum's index in the plane plus base.
+  void static _max_pool_plane(const double* plane, int in_width, double* pool_map, int out_h, int out_w, int height,
+                              int width, int stride, size_t* argmax = nullptr, size_t base = 0) {
+    switch (stride) {
+      case 1:
+        _max_pool_plane<1>(plane, in_width, pool_map, out_h, out_w, height, width, 1, argmax, base);
+        break;
+      case 2:
+        _max_pool_plane<2>(plane, in_width, pool_map, out_h, out_w, height, width, 2, argmax, base);
+        break;
+      default:
+        _max_pool_plane<0>(plane, in_width, pool_map, out_h, out_w, height, width, stride, argmax, base);
+    }
+  }
+
+  // S is the stride when it is known at compile time, which lets the taps be loaded as vectors, or 0.
+  template <int S>
+  void static _max_pool_plane(const double* plane, int in_width, double* pool_map, int out_h, int out_w, int height,
+                              int width, int stride, size_t* argmax, size_t base) {
+    if (S > 0) {
+      stride = S;
+    }
+    for (int i = 0; i < out_h; i++) {
+      double* __restrict o = pool_map + (size_t)i * out_w;
+      size_t* __restrict arg = argmax ? argmax + (size_t)i * out_w : nullptr;
+      for (int x = 0; x < height; x++) {
+        for (int y = 0; y < width; y++) {
+          size_t first = (size_t)(i * stride + x) * in_width + y;
+          const double* __restrict r = plane + first;
+          if (x == 0 && y == 0) {
+            for (int j = 0; j < out_w; j++) {
+              o[j] = r[j * stride];
+            }
+            for (int j = 0; arg && j < out_w; j++) {
+              arg[j] = base + first + j * stride;
+            }
+          } else if (arg) {
+            for (int j = 0; j < out_w; j++) {
+              bool greater = r[j * stride] > o[j];
+              o[j] = greater ? r[j * stride] : o[j];
+              arg[j] = greater ? base + first + j * stride : arg[j];
+            }
+          } else {
+            for (int j = 0; j < out_w; j++) {
+              o[j] = o[j] < r[j * stride] ? r[j * stride] : o[j];
+            }
+          }
+        }
+      }
+    }
+  }
+
+  // Channels-last: the window's pixels are channel vectors, compared for all channels at once.
+  void _forward_hwc(const Tensor& a, Tensor& out, size_t* argmax) const {
+    int num_channels = a.channels;
+    for (int i = 0; i < out.height; i++) {
+      for (int j = 0; j < out.width; j++) {
+        double* __restrict o = out.data.data() + ((size_t)i * out.width + j) * num_channels;
+        size_t* __restrict arg = argmax ? argmax + ((size_t)i * out.width + j) * num_channels : nullptr;
+        for (int x = 0; x < height; x++) {
+          for (int y = 0; y < width; y++) {
+            size_t first = ((size_t)(i * stride + x) * a.width + j * stride + y) * num_channels;
+            const double* __restrict pixel = a.data.data() + first;
+            if (x == 0 && y == 0) {
+              copy(pixel, pixel + num_channels, o);
+              for (int c = 0; arg && c < num_channels; c++) {
+                arg[c] = first + c;
+              }
+            } else if (arg) {
+              for (int c = 0; c < num_channels; c++) {
+                bool greater = pixel[c] > o[c];
+                o[c] = greater ? pixel[c] : o[c];
+                arg[c] = greater ? first + c : arg[c];
+              }
+            } else {
+              for (int c = 0; c < num_channels; c++) {
+                o[c] = o[c] < pixel[c] ? pixel[c] : o[c];
+              }
+            }
+          }
+        }
+      }
+    }
+  }
+
+  // Routes each output gradient to the (first) maximum of its window.
+  void backward(const Tensor& a, const Tensor& grad_out, Tensor& grad_in) const override {
+    thread_local vector<size_t> argmax;
+    thread_local Tensor out;
+    forward(a, out, &argmax);
+    backward(a, argmax, grad_out, grad_in);
+  }
+
+  // The same, given the argmax a forward pass stored.
+  void static backward(const Tensor& a, const vector<size_t>& argmax, const Tensor& grad_out, Tensor& grad_in) {
+    grad_in.resize(a.channels, a.height, a.width);
+    grad_in.layout = a.layout;
+    fill(grad_in.data.begin(), grad_in.data.end(), 0.0);
+    for (size_t k = 0; k < argmax.size(); k++) {
+      grad_in.data[argmax[k]] += grad_out.data[k];
+    }
+  }
+
+  vector<vector<double>> static _max_pool(const vector<vector<double>>& a, int height, int width, int stride) {
+    int in_h = a.size();
+    int in_w = a.empty() ? 0 : a[0].size();
+    if (in_h < height || in_w < width) {
+      return {};
+    }
+    int out_h = (in_h - height) / stride + 1;
+    int out_w = (in_w - width) / stride + 1;
+    vector<vector<double>> pool_map(out_h, vector<double>(out_w));
+    for (int i = 0; i < out_h; i++) {
+      for (int j = 0; j < out_w; j++) {
+        double max_value = a[i * stride][j * stride];
+        for (int x = 0; x < height; x++) {
+          for (int y = 0; y < width; y++) {
+            max_value = max(max_value, a[i * stride + x][j * stride + y]);
+          }
+        }
+        pool_map[i][j] = max_value;
+      }
+    }
+    return pool_map;
+  }
+
+  void static _max_pool_test() {
+    vector<vector<double>> a = {{0, 1, 2, 3}, {4, 5, 6, 7}, {1, 1, 1, 1}, {9, 0, 6, 3}};
+
+    vector<vector<double>> test_val = _max_pool(a, 2, 2, 2);
+    vector<vector<double>> expected_val = {{5, 7}, {9, 6}};
+    for (int i = 0; i < test_val.size(); ++i) {
+      for (int j = 0; j < test_val[0].size(); ++j) {
+        cout << test_val[i][j] << ",";
+        if (test_val[i][j] != expected_val[i][j]) {
+          throw(string) "Test failed! " + (string) __FUNCTION__;
+        }
+      }
+      cout << endl;
+    }
+
+    vector<vector<double>> a2 = {{0, 1, 2, 3}, {4, 5, 6, 7}, {1, 1, 1, 1}, {9, 0, 6, 3}};
+
+    vector<vector<double>> test_val2 = _max_pool(a2, 1, 2, 3);
+    vector<vector<double>> expected_val2 = {{1}, {9}};
+    for (int i = 0; i < test_val2.size(); ++i) {
+      for (int j = 0; j < test_val2[0].size(); ++j) {
+        cout << test_val2[i][j] << ",";
+        if (test_val2[i][j] != expected_val2[i][j]) {
+          throw(string) "Test failed! " + (string) __FUNCTION__;
+        }
+      }
+      cout << endl;
+    }
+  }
+};
+
+// Averages every window. Every output counts height * width inputs, since nothing is padded.
+class AvgPool : public Pool {
+ public:
+  AvgPool(int size) : Pool(size, size, size) {}
+  AvgPool(int height, int width, int stride) : Pool(height, width, stride) {}
+
+  void forward(const Tensor& a, Tensor& out) const override {
+    bool chw = _prepare(a, out);
+    fill(out.data.begin(), out.data.end(), 0.0);
+    double scale = 1.0 / (height * width);
+    if (chw) {
+      for (int c = 0; c < a.channels; c++) {
+        for (int i = 0; i < out.height; i++) {
+          double* __restrict o = out.plane(c) + i * out.width;
+          for (int x = 0; x < height; x++) {
+            for (int y = 0; y < width; y++) {
+              const double* __restrict r = a.plane(c) + (i * stride + x) * a.width + y;
+              for (int j = 0; j < out.width; j++) {
+                o[j] += r[j * stride];
+              }
+            }
+          }
+        }
+      }
+    } else {
+      int num_channels = a.channels;
+      for (int i = 0; i < out.height; i++) {
+        for (int j = 0; j < out.width; j++) {
+          double* __restrict o = out.data.data() + ((size_t)i * out.width + j) * num_channels;
+          for (int x = 0; x < height; x++) {
+            for (int y = 0; y < width; y++) {
+              const double* __restrict pixel =
+                  a.data.data() + ((size_t)(i * stride + x) * a.width + j * stride + y) * num_channels;
+              for (int c = 0; c < num_channels; c++) {
+                o[c] += pixel[c];
+              }
+            }
+          }
+        }
+      }
+    }
+    for (double& value : out.data) {
+      value *= scale;
+    }
+  }
+
+  // Spreads each output gradient evenly over its window.
+  void backward(const Tensor& a, const Tensor& grad_out, Tensor& grad_in) const override {
+    grad_in.resize(a.channels, a.height, a.width);
+    grad_in.layout = a.layout;
+    fill(grad_in.data.begin(), grad_in.data.end(), 0.0);
+    double scale = 1.0 / (height * width);
+    for (int c = 0; c < a.channels; c++) {
+      for (int i = 0; i < grad_out.height; i++) {
+        for (int j = 0; j < grad_out.width; j++) {
+          double g = grad_out.at(c, i, j) * scale;
+          for (int x = 0; x < height; x++) {
+            for (int y = 0; y < width; y++) {
+              grad_in.at(c, i * stride + x, j * stride + y) += g;
+            }
+          }
+        }
+      }
+    }
+  }
+
+  // Both pools against a direct evaluation of every window, for several windows and strides, in
+  // both layouts.
+  void static pool_test() {
+    Tensor a;
+    a.resize(3, 11, 9);
+    for (double& value : a.data) {
+      value = rand() % 7;  // Ties, to check which maximum the argmax picks
+    }
+
+    for (array<int, 3> shape : vector<array<int, 3>>{{2, 2, 2}, {3, 3, 2}, {2, 3, 1}, {3, 2, 3}, {1, 1, 1}}) {
+      MaxPool max_pool = MaxPool(shape[0], shape[1], shape[2]);
+      AvgPool avg_pool = AvgPool(shape[0], shape[1], shape[2]);
+      Tensor max_out, avg_out;
+      vector<size_t> argmax;
+      max_pool.forward(a, max_out, &argmax);
+      avg_pool.forward(a, avg_out);
+      if (max_out.shape() != max_pool.output_shape(a.shape()) || avg_out.shape() != max_out.shape()) {
+        throw(string) "Test failed! " + (string) __FUNCTION__;
+      }
+
+      for (int c = 0; c < a.channels; c++) {
+        for (int i = 0; i < max_out.height; i++) {
+          for (int j = 0; j < max_out.width; j++) {
+            size_t first = a.offset(c, i * shape[2], j * shape[2]);
+            double sum = 0;
+            for (int x = 0; x < shape[0]; x++) {
+              for (int y = 0; y < shape[1]; y++) {
+                size_t index = a.offset(c, i * shape[2] + x, j * shape[2] + y);
+                first = a.data[index] > a.data[first] ? index : first;
+                sum += a.data[index];
+              }
+            }
+            size_t k = max_out.offset(c, i, j);
+            if (max_out.data[k] != a.data[first] || argmax[k] != first ||
+                abs(avg_out.data[k] - sum / (shape[0] * shape[1])) > 1e-12) {
+              throw(string) "Test failed! " + (string) __FUNCTION__;
+            }
+          }
+        }
+      }
+
+      // Channels-last gives the same values, with argmax indices into the channels-last input.
+      Tensor a_hwc, max_hwc, avg_hwc, back;
+      vector<size_t> argmax_hwc;
+      a.convert(Layout::HWC, a_hwc);
+      max_pool.forward(a_hwc, max_hwc, &argmax_hwc);
+      avg_pool.forward(a_hwc, avg_hwc);
+      max_hwc.convert(Layout::CHW, back);
+      if (back.data != max_out.data) {
+        throw(string) "Test failed! " + (string) __FUNCTION__;
+      }
+      avg_hwc.convert(Layout::CHW, back);
+      for (int k = 0; k < back.size(); k++) {
+        if (abs(back.data[k] - avg_out.data[k]) > 1e-12 || a_hwc.data[argmax_hwc[k]] != max_hwc.data[k]) {
+          throw(string) "Test failed! " + (string) __FUNCTION__;
+        }
+      }
+
+      // Backward passes: the max gradient goes where argmax points, and the average one is the
+      // transpose of the forward map, so <grad_out, pool(a)> = <backward(grad_out), a>.
+      Tensor grad_out, grad_max, grad_from_argmax, grad_avg;
+      grad_out.resize(max_out.channels, max_out.height, max_out.width);
+      for (double& value : grad_out.data) {
+        value = (double)rand() / RAND_MAX;
+      }
+      max_pool.backward(a, grad_out, grad_max);
+      MaxPool::backward(a, argmax, grad_out, grad_from_argmax);
+      avg_pool.backward(a, grad_out, grad_avg);
+      double forward_dot = 0;
+      double backward_dot = 0;
+      for (int k = 0; k < grad_out.size(); k++) {
+        forward_dot += grad_out.data[k] * avg_out.data[k];
+      }
+      for (int k = 0; k < a.size(); k++) {
+        backward_dot += grad_avg.data[k] * a.data[k];
+      }
+      if (grad_max.data != grad_from_argmax.data || abs(forward_dot - backward_dot) > 1e-9 * abs(forward_dot)) {
+        throw(string) "Test failed! " + (string) __FUNCTION__;
+      }
+    }
+
+    // Windows larger than the input have no output, and the nested version says so.
+    if (!MaxPool::_max_pool({{1, 2}}, 3, 3, 1).empty()) {
+      throw(string) "Test failed! " + (string) __FUNCTION__;
+    }
+  }
+};
+
+class Act : public Layer {
+ public:
+  vector<vector<vector<double>>> h(vector<vector<vector<double>>> z) {
+    // Applied the sigmoid element wise.
+    vector<vector<vector<double>>> output_block;
+    for (int i = 0; i < z.size(); i++) {
+      vector<vector<double>> depth_output;
+      for (int j = 0; j < z[0].size(); j++) {
+        vector<double> row_output;
+        for (int k = 0; k < z[0][0].size(); k++) {
+          double activation = activation_func(z[i][j][k]);
+          row_output.push_back(activation);
+        }
+        depth_output.push_back(row_output);
+      }
+      output_block.push_back(depth_output);
+    }
+    return output_block;
+  }
+
+  vector<vector<vector<double>>> da_dz(vector<vector<vector<double>>> z) {
+    // Applied the sigmoid element wise.
+    vector<vector<vector<double>>> output_block_partials;
+    for (int i = 0; i < z.size(); i++) {
+      vector<vector<double>> depth_output;
+      for (int j = 0; j < z[0].size(); j++) {
+        vector<double> row_output;
+        for (int k = 0; k < z[0][0].size(); k++) {
+          double activation = activation_func_derivative(z[i][j][k]);
+          row_output.push_back(activation);
+        }
+        depth_output.push_back(row_output);
+      }
+      output_block_partials.push_back(depth_output);
+    }
+    return output_block_partials;
+  }
+
+  // Same as h, on contiguous tensors.
+  void forward(const Tensor& z, Tensor& out) const {
+    out.resize(z.channels, z.height, z.width);
+    out.layout = z.layout;
+    for (int i = 0; i < z.size(); i++) {
+      out.data[i] = activation_func(z.data[i]);
+    }
+  }
+
+  // grad_in = grad_out * g'(z), elementwise.
+  void backward(const Tensor& z, const Tensor& grad_out, Tensor& grad_in) const {
+    grad_in.resize(z.channels, z.height, z.width);
+    grad_in.layout = z.layout;
+    for (int i = 0; i < z.size(); i++) {
+      grad_in.data[i] = grad_out.data[i] * activation_func_derivative(z.data[i]);
+    }
+  }
+
+  virtual double activation_func(double z) const = 0;
+  virtual double activation_func_derivative(double z) const = 0;
+
+  // Non-decreasing activations commute with max, so ConvNet may move them after a MaxPool.
+  virtual bool monotonic() const { return false; }
+};
+
+class Sigmoid : public Act {
+ public:
+  double activation_func(double z) const { return 1 / (1 + exp(-z)); }
+
+  double activation_func_derivative(double z) const { return activation_func(z) * (1 - activation_func(z)); };
+
+  bool monotonic() const override { return true; }
+
+  void static sigmoid_test() {
+    vector<vector<vector<double>>> z = {{{1, 1}, {2, 2}, {3, 3}}, {{1, 0}, {0, 1}, {1, -1}}};
+    vector<vector<vector<double>>> val = Sigmoid().h(z);
+    vector<vector<vector<double>>> expected = {{{0.731059, 0.731059}, {0.880797, 0.880797}, {0.952574, 0.952574}},
+                                               {{0.731059, 0.5}, {0.5, 0.731059}, {0.731059, 0.268941}}};
+
+    for (int i = 0; i < z.size(); i++) {
+      for (int j = 0; j < z[0].size(); j++) {
+        for (int k = 0; k < z[0][0].size(); k++) {
+          cout << val[i][j][k] << ", ";
+          if (abs(val[i][j][k] - expected[i][j][k]) > 0.0001) {
+            throw(string) "Test failed! " + (string) __FUNCTION__;
+          }
+        }
+      }
+    }
+
+    cout << endl;
+  }
+};
+
+class Relu : public Act {
+ public:
+  double activation_func(double z) const { return max(0.0, z); }
+
+  double activation_func_derivative(double z) const {
+    if (z > 0) {
+      return 1;
+    } else {
+      return 0;
+    }
+  };
+
+  bool monotonic() const override { return true; }
+
+  void static relu_test() {
+    vector<vector<vector<double>>> z = {{{1, 1}, {2, -2}, {3, -3}}, {{1, 0}, {0, 1}, {1, -1}}};
+    vector<vector<vector<double>>> val = Relu().h(z);
+    vector<vector<vector<double>>> expected = {{{1, 1}, {2, 0}, {3, 0}}, {{1, 0}, {0, 1}, {1, 0}}};
+
+    for (int i = 0; i < z.size(); i++) {
+      for (int j = 0; j < z[0].size(); j++) {
+        for (int k = 0; k < z[0][0].size(); k++) {
+          cout << val[i][j][k] << ", ";
+          if (val[i][j][k] != expected[i][j][k]) {
+            throw(string) "Test failed! " + (string) __FUNCTION__;
+          }
+        }
+      }
+    }
+
+    cout << endl;
+  }
+};
+
+class Flatten : public Layer {
+  // Flattens to a column vector
+ public:
+  vector<vector<vector<double>>> static f(vector<vector<vector<double>>> a) {
+    vector<vector<vector<double>>> flattened;
+    for (int i = 0; i < a.size(); i++) {
+      for (int j = 0; j < a[0].size(); j++) {
+        for (int k = 0; k < a[0][0].size(); k++) {
+          vector<vector<double>> num = {{a[i][j][k]}};
+          flattened.push_back(num);  // Add a one element row vector to the column
+        }
+      }
+    }
+    return flattened;
+  }
+
+  // Flatten without copying: out takes over a's buffer, and a gets out's previous one, so that
+  // neither is reallocated in steady state. a is left empty, with that buffer as its capacity, so
+  // that nothing reads it as the input it no longer holds. CHW only.
+  void static reshape(Tensor& a, Tensor& out) {
+    swap(a.data, out.data);
+    out.resize(a.size(), 1, 1);
+    out.layout = Layout::CHW;
+    a.resize(0, 0, 0);
+  }
+
+  // The reverse of reshape, for the gradient: grad_in takes over grad_out's buffer. shape is the
+  // shape of the input reshape consumed.
+  void static reshape_backward(const vector<int>& shape, Tensor& grad_out, Tensor& grad_in) {
+    swap(grad_out.data, grad_in.data);
+    grad_in.resize(shape[0], shape[1], shape[2]);
+    grad_in.layout = Layout::CHW;
+  }
+
+  // Copying version. The vector is always in channel-major order, so Dense weights do not depend
+  // on the layout.
+  void static forward(const Tensor& a, Tensor& out) {
+    out.resize(a.size(), 1, 1);
+    out.layout = Layout::CHW;
+    if (a.layout == Layout::HWC) {
+      Tensor::transpose(a.data.data(), out.data.data(), a.height * a.width, a.channels);
+    } else {
+      copy(a.data.begin(), a.data.end(), out.data.begin());
+    }
+  }
+
+  void static backward(const Tensor& a, const Tensor& grad_out, Tensor& grad_in) {
+    grad_in.resize(a.channels, a.height, a.width);
+    grad_in.layout = a.layout;
+    if (a.layout == Layout::HWC) {
+      Tensor::transpose(grad_out.data.data(), grad_in.data.data(), a.channels, a.height * a.width);
+    } else {
+      copy(grad_out.data.begin(), grad_out.data.end(), grad_in.data.begin());
+    }
+  }
+};
+
+// Blocking of the Dense matrix-vector kernel, chosen per layer shape by the Autotuner.
+struct DenseTiling {
+  int block_out = 16;  // Outputs sharing one pass over an input block
+  int block_in = 256;  // Inputs per block
+  int unroll = 4;      // Independent partial sums per output (1, 2, 4 or 8)
+};
+
+class Dense : public Layer {
+ public:
+  // Inputs with at most this fraction nonzero (typically the output of a Relu) are multiplied by
+  // gathering the nonzero entries only.
+  static constexpr double max_gather_density = 0.5;
+
+  int num_out;
+  int num_in;
+
+  vector<vector<vector<double>>> weights;
+  vector<double> biases;
+  DenseTiling tiling;
+
+  Dense(int num_out, int num_in) {
+    this->num_out = num_out;
+    this->num_in = num_in;
+
+    // Initialize weights with all values zero, then set all weights to a random value
+    this->weights = vector<vector<vector<double>>>(num_out, vector<vector<double>>(num_in, vector<double>(1, 0)));
+    rand_init(weights, num_out, num_in);
+
+    // Initialize biases with all values zero, then set all biases to a random value
+    this->biases = vector<double>(num_out, 0);
+    rand_init(biases, num_out);
+  }
+
+  vector<vector<vector<double>>> h(vector<vector<vector<double>>> a) {
+    if (a.size() != num_in) {
+      throw(string) "Mismatch between Dense parameters and incoming vector!";
+    }
+
+    vector<double> in(num_in);
+    for (int j = 0; j < num_in; j++) {
+      in[j] = a[j][0][0];
+    }
+    vector<double> z(num_out);
+    forward(in.data(), z.data());
+
+    vector<vector<vector<double>>> zs;
+    for (int i = 0; i < num_out; i++) {
+      vector<vector<double>> num = {{z[i]}};
+      zs.push_back(num);
+    }
+
+    return zs;
+  }
+
+  void forward(const Tensor& a, Tensor& z) const {
+    if (a.size() != num_in) {
+      throw(string) "Mismatch between Dense parameters and incoming vector!";
+    }
+    if (a.layout == Layout::HWC && a.height * a.width > 1) {
+      throw(string) "Dense needs a Flatten in front of it in a channels-last model!";
+    }
+    z.resize(num_out, 1, 1);
+    z.layout = Layout::CHW;
+    forward(a.data.data(), z.data.data());
+  }
+
+  // Adds dLoss/dweights and dLoss/dbiases to dW and dB and, if grad_in is given, writes dLoss/da
+  // into it, given the forward input a and dLoss/dz. With relu_input, a is the output of a Relu,
+  // which zeroes the gradient wherever a is zero, so grad_in is only computed where a is nonzero.
+  // Zero inputs and zero entries of grad_z are skipped when there are enough of them.
+  virtual void backward(const Tensor& a, const Tensor& grad_z, Tensor* grad_in, vector<vector<vector<double>>>& dW,
+                        vector<double>& dB, bool relu_input = false) const {
+    if (grad_in) {
+      grad_in->resize(a.channels, a.height, a.width);
+      fill(grad_in->data.begin(), grad_in->data.end(), 0.0);
+    }
+    thread_local vector<int> nonzeros;
+    bool gather = _nonzero_inputs(a.data.data(), nonzeros);
+    for (int i = 0; i < num_out; i++) {
+      double g = grad_z.data[i];
+      if (g == 0) {
+        continue;  // Adds nothing, e.g. where a Relu after this layer was inactive
+      }
+      dB[i] += g;
+      vector<vector<double>>& dw = dW[i];
+      const vector<vector<double>>& w = weights[i];
+      if (gather) {
+        for (int j : nonzeros) {
+          dw[j][0] += g * a.data[j];
+        }
+      } else {
+        for (int j = 0; j < num_in; j++) {
+          dw[j][0] += g * a.data[j];
+        }
+      }
+      if (grad_in && gather && relu_input) {
+        for (int j : nonzeros) {
+          grad_in->data[j] += w[j][0] * g;
+        }
+      } else if (grad_in) {
+        for (int j = 0; j < num_in; j++) {
+          grad_in->data[j] += w[j][0] * g;
+        }
+      }
+    }
+  }
+
+  // Collects the indices of the nonzero entries of a, and returns whether there are few enough of
+  // them for the gather kernels to pay off.
+  bool _nonzero_inputs(const double* a, vector<int>& nonzeros) const {
+    int limit = max_gather_density * num_in;
+    nonzeros.clear();
+    for (int j = 0; j < num_in; j++) {
+      if (a[j] != 0) {
+        if (nonzeros.size() == limit) {
+          return false;
+        }
+        nonzeros.push_back(j);
+      }
+    }
+    return true;
+  }
+
+  // z = weights * a + biases. Outputs are processed in blocks that share each block of inputs, so
+  // the inputs are read from cache rather than memory once per output. Sparse inputs only visit
+  // their nonzero entries.
+  virtual void forward(const double* a, double* z) const {
+    thread_local vector<int> nonzeros;
+    if (_nonzero_inputs(a, nonzeros)) {
+      switch (tiling.unroll) {
+        case 8:
+          _forward_gather<8>(a, nonzeros, z);
+          break;
+        case 4:
+          _forward_gather<4>(a, nonzeros, z);
+          break;
+        case 2:
+          _forward_gather<2>(a, nonzeros, z);
+          break;
+        default:
+          _forward_gather<1>(a, nonzeros, z);
+      }
+      return;
+    }
+    switch (tiling.unroll) {
+      case 8:
+        _forward<8>(a, z);
+        break;
+      case 4:
+        _forward<4>(a, z);
+        break;
+      case 2:
+        _forward<2>(a, z);
+        break;
+      default:
+        _forward<1>(a, z);
+    }
+  }
+
+  // forward() for n inputs at once: each block of weights is loaded once and applied to every input,
+  // in the same order as forward() so the results are identical.
+  virtual void forward_batch(const double* const* a, double* const* z, int n) const {
+    switch (tiling.unroll) {
+      case 8:
+        _forward_batch<8>(a, z, n);
+        break;
+      case 4:
+        _forward_batch<4>(a, z, n);
+        break;
+      case 2:
+        _forward_batch<2>(a, z, n);
+        break;
+      default:
+        _forward_batch<1>(a, z, n);
+    }
+  }
+
+  template <int U>
+  void _forward(const double* a, double* z) const {
+    _forward_batch<U>(&a, &z, 1);
+  }
+
+  // _forward<U> with the zero terms left out: every other term goes to the same partial sum in the
+  // same order, so the results are identical to the dense kernel's.
+  template <int U>
+  void _forward_gather(const double* a, const vector<int>& nonzeros, double* z) const {
+    int block_out = max(1, tiling.block_out);
+    int block_in = max(1, tiling.block_in);
+
+    for (int i0 = 0; i0 < num_out; i0 += block_out) {
+      int i1 = min(num_out, i0 + block_out);
+      for (int i = i0; i < i1; i++) {
+        z[i] = biases[i];
+      }
+
+      int k0 = 0;  // First nonzero in the block of inputs
+      for (int j0 = 0; j0 < num_in; j0 += block_in) {
+        int j1 = min(num_in, j0 + block_in);
+        int tail = j1 - (j1 - j0) % U;  // Inputs from here on are added after the partial sums
+        int k1 = k0;
+        while (k1 < nonzeros.size() && nonzeros[k1] < j1) {
+          k1++;
+        }
+        for (int i = i0; i < i1; i++) {
+          const vector<vector<double>>& w = weights[i];
+          double acc[U] = {0};
+          int k = k0;
+          for (; k < k1 && nonzeros[k] < tail; k++) {
+            int j = nonzeros[k];
+            acc[(j - j0) % U] += w[j][0] * a[j];
+          }
+          double sum = 0;
+          for (int u = 0; u < U; u++) {
+            sum += acc[u];
+          }
+          for (; k < k1; k++) {
+            int j = nonzeros[k];
+            sum += w[j][0] * a[j];
+          }
+          z[i] += sum;
+        }
+        k0 = k1;
+      }
+    }
+  }
+
+  // Magnitude pruning: zeroes the smallest weights until at least the fraction sparsity of them is
+  // zero, and returns how many are left. Ties at the threshold are all pruned. SparseDense then
+  // skips the zeros.
+  int prune(double sparsity) {
+    vector<double> magnitudes;
+    magnitudes.reserve(num_out * num_in);
+    for (auto& row : weights) {
+      for (auto& w : row) {
+        magnitudes.push_back(abs(w[0]));
+      }
+    }
+    int k = min((int)magnitudes.size(), max(0, (int)round(sparsity * magnitudes.size())));
+
+    int nonzeros = 0;
+    double threshold = -1;
+    if (k > 0) {
+      nth_element(magnitudes.begin(), magnitudes.begin() + k - 1, magnitudes.end());
+      threshold = magnitudes[k - 1];
+    }
+    for (auto& row : weights) {
+      for (auto& w : row) {
+        if (abs(w[0]) <= threshold) {
+          w[0] = 0;
+        } else if (w[0] != 0) {
+          nonzeros++;
+        }
+      }
+    }
+    return nonzeros;
+  }
+
+  template <int U>
+  void _forward_batch(const double* const* a, double* const* z, int n) const {
+    int block_out = max(1, tiling.block_out);
+    int block_in = max(1, tiling.block_in);
+
+    for (int i0 = 0; i0 < num_out; i0 += block_out) {
+      int i1 = min(num_out, i0 + block_out);
+      for (int b = 0; b < n; b++) {
+        for (int i = i0; i < i1; i++) {
+          z[b][i] = biases[i];
+        }
+      }
+
+      for (int j0 = 0; j0 < num_in; j0 += block_in) {
+        int j1 = min(num_in, j0 + block_in);
+        for (int i = i0; i < i1; i++) {
+          const vector<vector<double>>& w = weights[i];
+          for (int b = 0; b < n; b++) {
+            const double* x = a[b];
+            double acc[U] = {0};
+            int j = j0;
+            for (; j + U <= j1; j += U) {
+              for (int u = 0; u < U; u++) {
+                acc[u] += w[j + u][0] * x[j + u];
+              }
+            }
+            double sum = 0;
+            for (int u = 0; u < U; u++) {
+              sum += acc[u];
+            }
+            for (; j < j1; j++) {
+              sum += w[j][0] * x[j];
+            }
+            z[b][i] += sum;
+          }
+        }
+      }
+    }
+  }
+
+  // A Relu output skips its zeros: the forward pass gives exactly the dense kernel's results for
+  // every tiling, and the backward pass the same gradients once the Relu has masked them.
+  void static gather_test() {
+    Dense dense = Dense(37, 300);
+    Tensor z, a, grad_z;
+    z.resize(300, 1, 1);
+    grad_z.resize(37, 1, 1);
+    rand_init(z.data, 300);
+    rand_init(grad_z.data, 37);
+    for (int j = 0; j < 300; j++) {
+      if (j % 3 != 0) {
+        z.data[j] = -abs(z.data[j]);  // At least 2 in 3 inputs are inactive
+      }
+    }
+    for (int i = 0; i < 37; i += 4) {
+      grad_z.data[i] = 0;
+    }
+    Relu relu = Relu();
+    relu.forward(z, a);
+    vector<int> nonzeros;
+    if (!dense._nonzero_inputs(a.data.data(), nonzeros) || nonzeros.empty()) {
+      throw(string) "Test failed! " + (string) __FUNCTION__;
+    }
+
+    for (DenseTiling tiling : {DenseTiling{16, 256, 4}, DenseTiling{5, 64, 8}, DenseTiling{37, 300, 1}}) {
+      dense.tiling = tiling;
+      vector<double> expected(37), output(37);
+      const double* in = a.data.data();
+      double* out = expected.data();
+      dense.forward_batch(&in, &out, 1);  // Always dense
+      dense.forward(in, output.data());
+      if (output != expected) {
+        throw(string) "Test failed! " + (string) __FUNCTION__;
+      }
+    }
+
+    vector<vector<vector<double>>> dW(37, vector<vector<double>>(300, vector<double>(1, 0)));
+    vector<vector<vector<double>>> dW_masked = dW;
+    vector<double> dB(37, 0), dB_masked(37, 0);
+    Tensor grad_a, grad_a_masked, grad_in, grad_in_masked;
+    dense.backward(a, grad_z, &grad_a, dW, dB);
+    dense.backward(a, grad_z, &grad_a_masked, dW_masked, dB_masked, true);
+    relu.backward(z, grad_a, grad_in);
+    relu.backward(z, grad_a_masked, grad_in_masked);
+    if (dW_masked != dW || dB_masked != dB || grad_in_masked.data != grad_in.data) {
+      throw(string) "Test failed! " + (string) __FUNCTION__;
+    }
+  }
+
+  void static h_test() {
+    vector<vector<vector<double>>> a{{{1}}, {{2}}, {{3}}};  // e.g. a[0] = {{1}};
+
+    Dense d = Dense(5, 3);
+    d.weights = {{{1}, {0}, {0}}, {{0}, {1}, {0}}, {{0}, {0}, {1}}, {{0}, {0}, {0}}, {{0}, {0}, {0}}};
     d.biases = {0, 0, 0, 0, 0};
 
-    vector<vector<vector<double>>> output = d.h(a);
-    vector<vector<vector<double>>> expected_output = {{{1}}, {{2}}, {{3}}, {{0}}, {{0}}};
-    for (int i = 0; i < output.size(); i++) {
-      if (output[i][0][0] != expected_output[i][0][0]) {
+    vector<vector<vector<double>>> output = d.h(a);
+    vector<vector<vector<double>>> expected_output = {{{1}}, {{2}}, {{3}}, {{0}}, {{0}}};
+    for (int i = 0; i < output.size(); i++) {
+      if (output[i][0][0] != expected_output[i][0][0]) {
+        throw(string) "Test failed! " + (string) __FUNCTION__;
+      }
+    }
+
+    vector<vector<vector<double>>> a2{{{1}}, {{2}}, {{3}}};
+
+    Dense d2 = Dense(5, 3);
+    d2.weights = {{{1}, {1}, {0}}, {{0}, {1}, {3}}, {{0}, {0}, {1}}, {{1}, {0}, {0}}, {{0}, {2}, {0}}};
+    d2.biases = {0, 0, 0, 0, 0};
+
+    vector<vector<vector<double>>> output2 = d2.h(a2);
+    vector<vector<vector<double>>> expected_output2 = {{{3}}, {{11}}, {{3}}, {{1}}, {{4}}};
+    for (int i = 0; i < output2.size(); i++) {
+      if (output2[i][0][0] != expected_output2[i][0][0]) {
+        throw(string) "Test failed! " + (string) __FUNCTION__;
+      }
+    }
+
+    vector<vector<vector<double>>> a3{{{1}}, {{2}}, {{3}}};
+
+    Dense d3 = Dense(5, 3);
+    d3.weights = {{{1}, {1}, {0}}, {{0}, {1}, {3}}, {{0}, {0}, {1}}, {{1}, {0}, {0}}, {{0}, {2}, {0}}};
+    d3.biases = {1, 1, 1, 2, -1};
+
+    vector<vector<vector<double>>> output3 = d3.h(a3);
+    vector<vector<vector<double>>> expected_output3 = {{{4}}, {{12}}, {{4}}, {{3}}, {{3}}};
+    for (int i = 0; i < output2.size(); i++) {
+      cout << output3[i][0][0] << endl;
+      if (output3[i][0][0] != expected_output3[i][0][0]) {
+        throw(string) "Test failed! " + (string) __FUNCTION__;
+      }
+    }
+  }
+};
+
+// A Dense layer that stores only its nonzero weights, in compressed sparse row (CSR) form: the
+// weights of output i are values[row_start[i]] up to values[row_start[i + 1]], for the inputs in
+// the same range of columns. Memory and work are proportional to the number of nonzeros, which pays
+// off for layers pruned with Dense::prune. It can take a Dense layer's place in a ConvNet. The
+// sparsity pattern is fixed: training updates values only, and the weight gradient is kept as a
+// 1 x 1 x nnz tensor matching values. weights stays empty.
+class SparseDense : public Dense {
+ public:
+  vector<int> row_start;
+  vector<int> columns;
+  vector<double> values;
+
+  SparseDense(const Dense& dense) : Dense(dense) {
+    row_start.reserve(num_out + 1);
+    for (int i = 0; i < num_out; i++) {
+      row_start.push_back(values.size());
+      for (int j = 0; j < num_in; j++) {
+        if (weights[i][j][0] != 0) {
+          columns.push_back(j);
+          values.push_back(weights[i][j][0]);
+        }
+      }
+    }
+    row_start.push_back(values.size());
+    weights = vector<vector<vector<double>>>();
+  }
+
+  int nnz() const { return values.size(); }
+
+  vector<vector<vector<double>>> to_dense() const {
+    vector<vector<vector<double>>> dense(num_out, vector<vector<double>>(num_in, vector<double>(1, 0)));
+    for (int i = 0; i < num_out; i++) {
+      for (int k = row_start[i]; k < row_start[i + 1]; k++) {
+        dense[i][columns[k]][0] = values[k];
+      }
+    }
+    return dense;
+  }
+
+  using Dense::forward;
+
+  void forward(const double* a, double* z) const override { forward_batch(&a, &z, 1); }
+
+  // Each row of weights is read once for all n inputs.
+  void forward_batch(const double* const* a, double* const* z, int n) const override {
+    for (int i = 0; i < num_out; i++) {
+      int k0 = row_start[i];
+      int k1 = row_start[i + 1];
+      for (int b = 0; b < n; b++) {
+        const double* x = a[b];
+        double sum = biases[i];
+        for (int k = k0; k < k1; k++) {
+          sum += values[k] * x[columns[k]];
+        }
+        z[b][i] = sum;
+      }
+    }
+  }
+
+  // As Dense::backward, with dW[0][0][k] the gradient of values[k]. The weights are sparse already,
+  // so relu_input is not needed to skip work.
+  void backward(const Tensor& a, const Tensor& grad_z, Tensor* grad_in, vector<vector<vector<double>>>& dW,
+                vector<double>& dB, bool /*relu_input*/ = false) const override {
+    if (grad_in) {
+      grad_in->resize(a.channels, a.height, a.width);
+      fill(grad_in->data.begin(), grad_in->data.end(), 0.0);
+    }
+    vector<double>& dValues = dW[0][0];
+    for (int i = 0; i < num_out; i++) {
+      double g = grad_z.data[i];
+      dB[i] += g;
+      for (int k = row_start[i]; k < row_start[i + 1]; k++) {
+        dValues[k] += g * a.data[columns[k]];
+        if (grad_in) {
+          grad_in->data[columns[k]] += values[k] * g;
+        }
+      }
+    }
+  }
+
+  void static sparse_test() {
+    Dense dense = Dense(40, 100);
+    if (dense.prune(0.9) != 400) {
+      throw(string) "Test failed! " + (string) __FUNCTION__;
+    }
+    SparseDense sparse = SparseDense(dense);
+    if (sparse.nnz() != 400 || sparse.to_dense() != dense.weights || !sparse.weights.empty()) {
+      throw(string) "Test failed! " + (string) __FUNCTION__;
+    }
+
+    Tensor a, grad_z;
+    a.resize(100, 1, 1);
+    grad_z.resize(40, 1, 1);
+    rand_init(a.data, 100);
+    rand_init(grad_z.data, 40);
+
+    Tensor z_dense, z_sparse;
+    dense.forward(a, z_dense);
+    sparse.forward(a, z_sparse);
+    const double* in = a.data.data();
+    vector<double> z_batch(40);
+    double* out = z_batch.data();
+    sparse.forward_batch(&in, &out, 1);
+    for (int i = 0; i < 40; i++) {
+      if (abs(z_sparse.data[i] - z_dense.data[i]) > 1e-12 || z_batch[i] != z_sparse.data[i]) {
+        throw(string) "Test failed! " + (string) __FUNCTION__;
+      }
+    }
+
+    vector<vector<vector<double>>> dW_dense(40, vector<vector<double>>(100, vector<double>(1, 0)));
+    vector<vector<vector<double>>> dW_sparse = {{vector<double>(sparse.nnz(), 0)}};
+    vector<double> dB_dense(40, 0), dB_sparse(40, 0);
+    Tensor grad_dense, grad_sparse;
+    dense.backward(a, grad_z, &grad_dense, dW_dense, dB_dense);
+    sparse.backward(a, grad_z, &grad_sparse, dW_sparse, dB_sparse);
+    if (dB_sparse != dB_dense) {
+      throw(string) "Test failed! " + (string) __FUNCTION__;
+    }
+    for (int i = 0; i < 40; i++) {
+      for (int k = sparse.row_start[i]; k < sparse.row_start[i + 1]; k++) {
+        if (dW_sparse[0][0][k] != dW_dense[i][sparse.columns[k]][0]) {
+          throw(string) "Test failed! " + (string) __FUNCTION__;
+        }
+      }
+    }
+    for (int j = 0; j < 100; j++) {
+      if (abs(grad_sparse.data[j] - grad_dense.data[j]) > 1e-12) {
+        throw(string) "Test failed! " + (string) __FUNCTION__;
+      }
+    }
+  }
+};
+
+// Chooses kernel tilings per layer shape by timing candidates on this machine. Choices are cached in
+// a text file keyed by CPU model and shape, so only the first compile of a shape pays for tuning.
+// The file is $CNN_TUNING_CACHE if set, otherwise cache_path; with neither, choices are only kept in
+// memory and nothing is read or written.
+class Autotuner {
+ public:
+  inline static string cache_path;
+  inline static int benchmarks_run = 0;  // Candidates timed so far
+
+  static string cpu_model() {
+    ifstream cpuinfo("/proc/cpuinfo");
+    string line;
+    while (getline(cpuinfo, line)) {
+      if (line.rfind("model name", 0) == 0) {
+        return line.substr(line.find(':') + 2);
+      }
+    }
+    return "unknown cpu";
+  }
+
+  // Size in bytes of the level 1 data or level 2 cache of cpu0, from sysfs.
+  static int cache_size(int level) {
+    for (int index = 0; index < 8; index++) {
+      string dir = "/sys/devices/system/cpu/cpu0/cache/index" + to_string(index) + "/";
+      ifstream level_file(dir + "level"), type_file(dir + "type"), size_file(dir + "size");
+      int l;
+      string type, size;
+      if (!(level_file >> l) || !(type_file >> type) || !(size_file >> size)) {
+        break;
+      }
+      if (l == level && type != "Instruction") {
+        return stoi(size) * (size.back() == 'M' ? 1024 * 1024 : size.back() == 'K' ? 1024 : 1);
+      }
+    }
+    return level == 1 ? 32 * 1024 : 1024 * 1024;
+  }
+
+  static string path() {
+    const char* env = getenv("CNN_TUNING_CACHE");
+    return env ? string(env) : cache_path;
+  }
+
+  // Forgets the in-memory copy of the cache file so it is read again on next use.
+  static void reload() { loaded_from = ""; }
+
+  static void tune(Conv& conv, vector<int> in_shape, bool benchmark) {
+    vector<int> out_shape = conv.output_shape(in_shape);
+    int k = conv.size_per_filter[0];
+    int stride = conv.stride_per_filter[0];
+    string key = "conv " + shape_key(in_shape) + " k" + to_string(k) + " s" + to_string(stride) + " f" +
+                 to_string(conv.num_filters) + padding_key(conv);
+
+    vector<int> cached = lookup(key);
+    if (cached.size() == 3) {
+      conv.tiling = ConvTiling{cached[0], cached[1], cached[2]};
+      return;
+    }
+    if (!benchmark) {
+      return;
+    }
+
+    Tensor in(in_shape[0], in_shape[1], in_shape[2]);
+    for (int i = 0; i < in.size(); i++) {
+      in.data[i] = (double)(i % 7) - 3;
+    }
+    Tensor out;
+    int l2 = cache_size(2);
+
+    ConvTiling best = conv.tiling;
+    double best_time = numeric_limits<double>::max();
+    for (int rows : candidates({1, 2, 4, 8, 16, 32}, out_shape[1])) {
+      for (int cols : candidates({8, 16, 32, 64, 128}, out_shape[2])) {
+        // Input rows and output tile touched by one tile, over all channels.
+        double working_set = sizeof(double) * (in_shape[0] * ((rows - 1) * stride + k) * ((cols - 1) * stride + k) +
+                                               rows * cols);
+        bool whole_output = rows == out_shape[1] && cols == out_shape[2];
+        if (working_set > l2 && !whole_output) {
+          continue;
+        }
+        for (int unroll : {1, 2, 4, 8}) {
+          conv.tiling = ConvTiling{rows, cols, unroll};
+          double t = time_kernel([&]() { conv.forward(in, out); });
+          if (t < best_time) {
+            best_time = t;
+            best = conv.tiling;
+          }
+        }
+      }
+    }
+
+    conv.tiling = best;
+    store(key, {best.tile_rows, best.tile_cols, best.unroll});
+  }
+
+  static void tune(Dense& dense, bool benchmark) {
+    string key = "dense " + to_string(dense.num_out) + "x" + to_string(dense.num_in);
+
+    vector<int> cached = lookup(key);
+    if (cached.size() == 3) {
+      dense.tiling = DenseTiling{cached[0], cached[1], cached[2]};
+      return;
+    }
+    if (!benchmark) {
+      return;
+    }
+
+    vector<double> a(dense.num_in, 0.5);
+    vector<double> z(dense.num_out);
+    int l1 = cache_size(1);
+
+    DenseTiling best = dense.tiling;
+    double best_time = numeric_limits<double>::max();
+    for (int block_in : candidates({64, 128, 256, 512, 1024, 2048}, dense.num_in)) {
+      if (block_in * sizeof(double) > l1 && block_in != dense.num_in) {
+        continue;
+      }
+      for (int block_out : candidates({4, 8, 16, 32, 64}, dense.num_out)) {
+        for (int unroll : {1, 2, 4, 8}) {
+          dense.tiling = DenseTiling{block_out, block_in, unroll};
+          double t = time_kernel([&]() { dense.forward(a.data(), z.data()); });
+          if (t < best_time) {
+            best_time = t;
+            best = dense.tiling;
+          }
+        }
+      }
+    }
+
+    dense.tiling = best;
+    store(key, {best.block_out, best.block_in, best.unroll});
+  }
+
+  // The sizes below limit, plus limit itself (the untiled case).
+  static vector<int> candidates(vector<int> sizes, int limit) {
+    vector<int> out;
+    for (int size : sizes) {
+      if (size < limit) {
+        out.push_back(size);
+      }
+    }
+    out.push_back(limit);
+    return out;
+  }
+
+  // Empty without padding, so that cache entries from before padding existed stay valid.
+  static string padding_key(const Conv& conv) {
+    if (conv.padding == 0) {
+      return "";
+    }
+    return conv.padding == Conv::same ? " same" : " p" + to_string(conv.padding);
+  }
+
+  static string shape_key(vector<int> shape) {
+    return to_string(shape[0]) + "x" + to_string(shape[1]) + "x" + to_string(shape[2]);
+  }
+
+  // Best time in seconds over repeated runs, after one warm-up run.
+  template <class F>
+  static double time_kernel(F run) {
+    benchmarks_run++;
+    run();
+    double best = numeric_limits<double>::max();
+    double total = 0;
+    for (int rep = 0; rep < 50 && (rep < 3 || total < 1e-3); rep++) {
+      chrono::steady_clock::time_point start = chrono::steady_clock::now();
+      run();
+      double t = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+      best = min(best, t);
+      total += t;
+    }
+    return best;
+  }
+
+  // Lines are "<cpu model>\t<key>\t<values...>"; entries for other CPUs are ignored.
+  static vector<int> lookup(string key) {
+    if (loaded_from != path()) {
+      entries.clear();
+      loaded_from = path();
+      ifstream file;
+      if (!loaded_from.empty()) {
+        file.open(loaded_from);
+      }
+      string line;
+      string cpu = file.is_open() ? cpu_model() : "";
+      while (getline(file, line)) {
+        stringstream fields(line);
+        string line_cpu, line_key, values;
+        if (getline(fields, line_cpu, '\t') && getline(fields, line_key, '\t') && getline(fields, values) &&
+            line_cpu == cpu) {
+          stringstream numbers(values);
+          vector<int> parsed;
+          int v;
+          while (numbers >> v) {
+            parsed.push_back(v);
+          }
+          entries[line_key] = parsed;
+        }
+      }
+    }
+    auto it = entries.find(key);
+    return it == entries.end() ? vector<int>() : it->second;
+  }
+
+  static void store(string key, vector<int> values) {
+    entries[key] = values;
+    if (path().empty()) {
+      return;
+    }
+    ofstream file(path(), ios::app);
+    file << cpu_model() << '\t' << key << '\t';
+    for (int v : values) {
+      file << v << ' ';
+    }
+    file << '\n';
+  }
+
+ private:
+  inline static map<string, vector<int>> entries;
+  inline static string loaded_from;
+};
+
+// Binds a convolution algorithm to every Conv layer for its actual input shape: the fastest one
+// measured on this machine when benchmarking (cached by the Autotuner), otherwise the cheapest one
+// under a cost model. Conv::forced_algorithm, or $CNN_CONV_ALGORITHM (direct, gemm, winograd or fft)
+// for all layers, overrides the choice for debugging.
+class ConvPlanner {
+ public:
+  static vector<ConvAlgorithm> algorithms() {
+    return {ConvAlgorithm::Direct, ConvAlgorithm::Gemm, ConvAlgorithm::Winograd, ConvAlgorithm::Fft};
+  }
+
+  static string name(ConvAlgorithm algorithm) {
+    switch (algorithm) {
+      case ConvAlgorithm::Direct:
+        return "direct";
+      case ConvAlgorithm::Gemm:
+        return "gemm";
+      case ConvAlgorithm::Winograd:
+        return "winograd";
+      case ConvAlgorithm::Fft:
+        return "fft";
+      default:
+        return "auto";
+    }
+  }
+
+  static ConvAlgorithm parse(string name) {
+    for (ConvAlgorithm algorithm : algorithms()) {
+      if (ConvPlanner::name(algorithm) == name) {
+        return algorithm;
+      }
+    }
+    throw(string) "Unknown convolution algorithm " + name;
+  }
+
+  // Approximate floating point operations, with memory passes counted as one operation per element.
+  static double estimate_cost(const Conv& conv, vector<int> in_shape, ConvAlgorithm algorithm) {
+    double c = in_shape[0];
+    double f = conv.num_filters;
+    double k = conv.size_per_filter[0];
+    vector<int> out_shape = conv.output_shape(in_shape);
+    double outputs = (double)out_shape[1] * out_shape[2];
+    double direct = 2 * f * c * outputs * k * k;
+
+    switch (algorithm) {
+      case ConvAlgorithm::Gemm:
+        // Regular inner loop, plus writing and reading the lowered input once.
+        return 0.75 * direct + 2 * c * k * k * outputs;
+      case ConvAlgorithm::Winograd: {
+        double tiles = ((out_shape[1] + 1) / 2) * ((out_shape[2] + 1) / 2);
+        return 2 * 16 * f * c * tiles + 64 * c * tiles + 24 * f * tiles + 60 * f * c;
+      }
+      case ConvAlgorithm::Fft: {
+        array<int, 4> pad = conv.pads(in_shape);
+        double rows = 1, cols = 1;
+        while (rows < in_shape[1] + pad[0] + pad[2]) {
+          rows *= 2;
+        }
+        while (cols < in_shape[2] + pad[1] + pad[3]) {
+          cols *= 2;
+        }
+        double transform = 5 * rows * cols * log2(rows * cols);
+        return transform * (c + f * c + f) + 8 * f * c * rows * cols;
+      }
+      default:
+        return direct;
+    }
+  }
+
+  static void plan(Conv& conv, vector<int> in_shape, bool measure) {
+    ConvAlgorithm forced = conv.forced_algorithm;
+    const char* env = getenv("CNN_CONV_ALGORITHM");
+    if (forced == ConvAlgorithm::Auto && env) {
+      forced = parse(env);
+    }
+    if (forced != ConvAlgorithm::Auto) {
+      if (!conv.supports(forced)) {
+        throw(string) "Forced convolution algorithm " + name(forced) + " does not support this Conv layer!";
+      }
+      conv.algorithm = forced;
+      return;
+    }
+
+    string key = "conv-algorithm " + Autotuner::shape_key(in_shape) + " k" + to_string(conv.size_per_filter[0]) +
+                 " s" + to_string(conv.stride_per_filter[0]) + " f" + to_string(conv.num_filters) +
+                 Autotuner::padding_key(conv);
+    vector<int> cached = Autotuner::lookup(key);
+    if (cached.size() == 1 && conv.supports((ConvAlgorithm)cached[0])) {
+      conv.algorithm = (ConvAlgorithm)cached[0];
+      return;
+    }
+
+    ConvAlgorithm best = ConvAlgorithm::Direct;
+    double best_cost = numeric_limits<double>::max();
+    Tensor in(in_shape[0], in_shape[1], in_shape[2]);
+    for (int i = 0; i < in.size(); i++) {
+      in.data[i] = (double)(i % 5) - 2;
+    }
+    Tensor out;
+    for (ConvAlgorithm algorithm : algorithms()) {
+      if (!conv.supports(algorithm)) {
+        continue;
+      }
+      conv.algorithm = algorithm;
+      double cost = measure ? Autotuner::time_kernel([&]() { conv.forward(in, out); })
+                            : estimate_cost(conv, in_shape, algorithm);
+      if (cost < best_cost) {
+        best_cost = cost;
+        best = algorithm;
+      }
+    }
+
+    conv.algorithm = best;
+    if (measure) {
+      Autotuner::store(key, {(int)best});
+    }
+  }
+
+  void static plan_test() {
+    // Every algorithm against the reference convolve(), including odd output sizes for Winograd.
+    for (vector<int> shape : {vector<int>{2, 9, 10}, vector<int>{1, 6, 6}, vector<int>{3, 13, 7}}) {
+      for (vector<int> k_s : {vector<int>{3, 1}, vector<int>{5, 2}, vector<int>{1, 1}}) {
+        Conv conv = Conv(shape[0], 2, {k_s[0], k_s[0]}, {k_s[1], k_s[1]});
+        vector<vector<vector<double>>> a(shape[0], vector<vector<double>>(shape[1], vector<double>(shape[2], 0)));
+        for (int c = 0; c < shape[0]; c++) {
+          Layer::rand_init(a[c], shape[1], shape[2]);
+        }
+
+        for (ConvAlgorithm algorithm : algorithms()) {
+          if (!conv.supports(algorithm)) {
+            continue;
+          }
+          conv.algorithm = algorithm;
+          vector<vector<vector<double>>> output = conv.h(a);
+          for (int f = 0; f < conv.num_filters; f++) {
+            vector<vector<double>> expected = Conv::convolve(a, conv.filter(f), k_s[1]);
+            for (int i = 0; i < expected.size(); i++) {
+              for (int j = 0; j < expected[0].size(); j++) {
+                if (abs(output[f][i][j] - expected[i][j] - conv.biases[f]) > 1e-9) {
+                  throw(string) "Test failed! " + (string) __FUNCTION__ + " " + name(algorithm);
+                }
+              }
+            }
+          }
+        }
+      }
+    }
+
+    // The cost model prefers FFT for large filters and never picks an unsupported algorithm.
+    Conv large = Conv(8, 8, vector<int>(8, 15), vector<int>(8, 1));
+    plan(large, {8, 64, 64}, false);
+    Conv strided = Conv(4, 4, vector<int>(4, 3), vector<int>(4, 2));
+    plan(strided, {4, 32, 32}, false);
+    if (large.algorithm != ConvAlgorithm::Fft || !strided.supports(strided.algorithm)) {
+      throw(string) "Test failed! " + (string) __FUNCTION__;
+    }
+
+    // The override wins, and an impossible override is an error.
+    strided.forced_algorithm = ConvAlgorithm::Gemm;
+    plan(strided, {4, 32, 32}, false);
+    if (strided.algorithm != ConvAlgorithm::Gemm) {
+      throw(string) "Test failed! " + (string) __FUNCTION__;
+    }
+    strided.forced_algorithm = ConvAlgorithm::Winograd;
+    try {
+      plan(strided, {4, 32, 32}, false);
+      throw(string) "Test failed! " + (string) __FUNCTION__;
+    } catch (string e) {
+      if (e.find("does not support") == string::npos) {
+        throw e;
+      }
+    }
+  }
+};
+
+// Sum-allreduce between processes on one host through a POSIX shared memory segment, for
+// data-parallel training without any network or MPI. Every rank owns one slot of the segment; the
+// ring algorithm (reduce-scatter, then allgather) has each rank read only from its predecessor's
+// slot, one chunk per step, with a barrier between steps. launch() forks the ranks and pins each
+// one to a NUMA node so that its slot and its copy of the model are allocated on local memory.
+class ShmAllreduce {
+ public:
+  int rank;
+  int world;
+  size_t capacity;  // Doubles per slot
+
+  // Creates the segment (create = true) or attaches to one created by another process under the
+  // same name, waiting for it to be initialized.
+  ShmAllreduce(string name, int rank, int world, size_t capacity, bool create) {
+    this->name = name;
+    this->rank = rank;
+    this->world = world;
+    this->capacity = capacity;
+    size_t bytes = _slot_offset(world);
+
+    int fd;
+    if (create) {
+      fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+      if (fd < 0 || ftruncate(fd, bytes) != 0) {
+        throw(string) "Could not create shared memory segment " + name;
+      }
+    } else {
+      while ((fd = shm_open(name.c_str(), O_RDWR, 0600)) < 0) {
+        this_thread::sleep_for(chrono::milliseconds(1));
+      }
+      struct stat st;
+      while (fstat(fd, &st) == 0 && (size_t)st.st_size < bytes) {
+        this_thread::sleep_for(chrono::milliseconds(1));
+      }
+    }
+    void* memory = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED) {
+      throw(string) "Could not map shared memory segment " + name;
+    }
+    segment = (char*)memory;
+    segment_bytes = bytes;
+    header = (Header*)segment;
+
+    if (create) {
+      new (header) Header();
+      header->world = world;
+      header->seed = be_random ? random_device{}() : 2021;
+      header->magic.store(magic, memory_order_release);
+    } else {
+      while (header->magic.load(memory_order_acquire) != magic) {
+        this_thread::yield();
+      }
+    }
+    this->owner = create;
+  }
+
+  ShmAllreduce(const ShmAllreduce&) = delete;
+
+  ~ShmAllreduce() {
+    munmap(segment, segment_bytes);
+    if (owner && owner_pid == getpid()) {
+      shm_unlink(name.c_str());
+    }
+  }
+
+  // Shared by all ranks, e.g. to draw the same minibatches everywhere.
+  unsigned seed() const { return header->seed; }
+
+  // Throws if launch() reports that a rank died, since the barrier could then never complete.
+  void barrier() {
+    int generation = header->generation.load(memory_order_acquire);
+    if (header->arrived.fetch_add(1, memory_order_acq_rel) == world - 1) {
+      header->arrived.store(0, memory_order_relaxed);
+      header->generation.fetch_add(1, memory_order_release);
+    } else {
+      while (header->generation.load(memory_order_acquire) == generation) {
+        if (int failed = header->failed.load(memory_order_acquire)) {
+          throw(string) "Rank " + to_string(failed - 1) + " died during the allreduce!";
+        }
+        this_thread::yield();
+      }
+    }
+  }
+
+  // Replaces data with its elementwise sum over all ranks. Every rank must call this with the same
+  // number of elements.
+  void allreduce(vector<double>& data) {
+    size_t n = data.size();
+    if (n > capacity) {
+      throw(string) "Allreduce buffer is larger than the shared memory slots!";
+    }
+    double* own = _slot(rank);
+    double* prev = _slot((rank + world - 1) % world);
+    copy(data.begin(), data.end(), own);
+    barrier();
+
+    // Reduce-scatter: after world - 1 steps this rank holds the full sum of chunk rank + 1.
+    for (int step = 0; step < world - 1; step++) {
+      int c = ((rank - 1 - step) % world + world) % world;
+      for (size_t i = _chunk_begin(c, n); i < _chunk_begin(c + 1, n); i++) {
+        own[i] += prev[i];
+      }
+      barrier();
+    }
+    // Allgather: pass the finished chunks around the ring.
+    for (int step = 0; step < world - 1; step++) {
+      int c = ((rank - step) % world + world) % world;
+      for (size_t i = _chunk_begin(c, n); i < _chunk_begin(c + 1, n); i++) {
+        own[i] = prev[i];
+      }
+      barrier();
+    }
+
+    copy(own, own + n, data.begin());
+    // Nobody may overwrite its slot for the next call while a neighbour still reads it.
+    barrier();
+  }
+
+  // Restricts this process to the CPUs of NUMA node (rank mod number of nodes), if the host reports
+  // its NUMA layout. Memory first touched afterwards is then allocated on that node.
+  void static bind_to_numa_node(int rank) {
+    int num_nodes = 0;
+    while (filesystem::exists("/sys/devices/system/node/node" + to_string(num_nodes))) {
+      num_nodes++;
+    }
+    if (num_nodes == 0) {
+      return;
+    }
+    ifstream cpulist("/sys/devices/system/node/node" + to_string(rank % num_nodes) + "/cpulist");
+    string ranges;
+    if (!getline(cpulist, ranges) || ranges.empty()) {
+      return;
+    }
+
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    stringstream list(ranges);
+    string range;
+    while (getline(list, range, ',')) {
+      size_t dash = range.find('-');
+      int first = stoi(range.substr(0, dash));
+      int last = dash == string::npos ? first : stoi(range.substr(dash + 1));
+      for (int cpu = first; cpu <= last; cpu++) {
+        CPU_SET(cpu, &cpus);
+      }
+    }
+    sched_setaffinity(0, sizeof(cpus), &cpus);
+  }
+
+  // Forks num_procs ranks sharing one segment of `capacity` doubles per rank and runs fn in each,
+  // after pinning it to its NUMA node. fn's return value is the rank's exit status. Returns the
+  // number of ranks that failed. The first rank to fail is marked in the segment, so that the
+  // others leave their barriers instead of waiting for it forever.
+  int static launch(int num_procs, size_t capacity, function<int(ShmAllreduce&)> fn) {
+    string name = "/cnn_allreduce_" + to_string(getpid()) + "_" + to_string(launches++);
+    ShmAllreduce parent = ShmAllreduce(name, -1, num_procs, capacity, true);
+
+    cout.flush();
+    vector<pid_t> children;
+    for (int rank = 0; rank < num_procs; rank++) {
+      pid_t pid = fork();
+      if (pid == 0) {
+        int status = 1;
+        try {
+          bind_to_numa_node(rank);
+          ShmAllreduce comm = ShmAllreduce(name, rank, num_procs, capacity, false);
+          status = fn(comm);
+        } catch (string error) {
+          cout << "Rank " << rank << ": " << error << endl;
+        }
+        cout.flush();
+        _exit(status);
+      }
+      children.push_back(pid);
+    }
+
+    int failures = 0;
+    vector<bool> exited(num_procs, false);
+    for (int remaining = num_procs; remaining > 0;) {
+      bool reaped = false;
+      for (int rank = 0; rank < num_procs; rank++) {
+        int status = 0;
+        pid_t pid = exited[rank] ? 0 : waitpid(children[rank], &status, WNOHANG);
+        if (pid == 0) {
+          continue;
+        }
+        exited[rank] = true;
+        remaining--;
+        reaped = true;
+        if (pid < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+          failures++;
+          int none = 0;
+          parent.header->failed.compare_exchange_strong(none, rank + 1, memory_order_acq_rel);
+        }
+      }
+      if (!reaped) {
+        this_thread::sleep_for(chrono::milliseconds(1));
+      }
+    }
+    return failures;
+  }
+
+  void static allreduce_test() {
+    // 10 elements over 3 ranks: uneven chunks.
+    int failures = launch(3, 10, [](ShmAllreduce& comm) {
+      for (int round = 0; round < 5; round++) {
+        vector<double> data(10);
+        for (int i = 0; i < 10; i++) {
+          data[i] = (comm.rank + 1) * (i + round);
+        }
+        comm.allreduce(data);
+        for (int i = 0; i < 10; i++) {
+          if (data[i] != 6 * (i + round)) {
+            return 1;
+          }
+        }
+      }
+      return 0;
+    });
+    if (failures != 0) {
+      throw(string) "Test failed! " + (string) __FUNCTION__;
+    }
+
+    // A rank that dies makes the others' allreduce throw rather than hang.
+    failures = launch(3, 10, [](ShmAllreduce& comm) {
+      if (comm.rank == 1) {
+        _exit(3);
+      }
+      vector<double> data(10, 1);
+      try {
+        comm.allreduce(data);
+      } catch (string error) {
+        return error.find("Rank 1 died") == string::npos ? 1 : 0;
+      }
+      return 1;
+    });
+    if (failures != 1) {
+      throw(string) "Test failed! " + (string) __FUNCTION__;
+    }
+  }
+
+ private:
+  struct Header {
+    atomic<unsigned> magic{0};
+    atomic<int> arrived{0};
+    atomic<int> generation{0};
+    atomic<int> failed{0};  // 1 + the first rank launch() saw fail, or 0
+    int world = 0;
+    unsigned seed = 0;
+  };
+  static constexpr unsigned magic = 0x414c4c52;
+  inline static int launches = 0;
+
+  string name;
+  bool owner;
+  pid_t owner_pid = getpid();
+  char* segment;
+  size_t segment_bytes;
+  Header* header;
+
+  // Slots start on their own cache lines, after the header.
+  size_t _slot_offset(int r) const {
+    size_t slot_bytes = (capacity * sizeof(double) + 63) / 64 * 64;
+    return 64 * ((sizeof(Header) + 63) / 64) + r * slot_bytes;
+  }
+
+  double* _slot(int r) { return (double*)(segment + _slot_offset(r)); }
+
+  size_t _chunk_begin(int c, size_t n) const { return n * c / world; }
+};
+
+// Parameter update rules for ConvNet::fit. Every optimizer updates a parameter buffer in place in a
+// single pass that reads the parameter, its (unscaled) gradient and the optimizer state for that
+// buffer. grad_scale is applied on the fly, so averaging over the minibatch costs no extra pass.
+// State is kept per slot, one slot per parameter buffer, and allocated on the first step.
+class Optimizer {
+ public:
+  virtual ~Optimizer() = default;
+
+  // Call once per training step, before the update() calls for that step.
+  virtual void begin_step() { t++; }
+
+  virtual void update(int slot, vector<double>& param, const vector<double>& grad, double grad_scale) = 0;
+  virtual void update(int slot, vector<vector<vector<double>>>& param, const vector<vector<vector<double>>>& grad,
+                      double grad_scale) = 0;
+
+ protected:
+  int t = 0;  // Number of steps taken
+  vector<vector<double>> state;
+
+  // num_buffers state arrays of n doubles each, laid out back to back.
+  double* state_for(int slot, int num_buffers, int n) {
+    if (num_buffers == 0) {
+      return nullptr;
+    }
+    if (slot >= state.size()) {
+      state.resize(slot + 1);
+    }
+    if (state[slot].size() != num_buffers * n) {
+      state[slot] = vector<double>(num_buffers * n, 0);
+    }
+    return state[slot].data();
+  }
+};
+
+// Shares the loops between the update rules. Rule provides num_state (state doubles per parameter),
+// prepare() (per-step constants) and apply(param, scaled_grad, s0, s1) for a single element.
+template <class Rule>
+class ElementwiseOptimizer : public Optimizer {
+ public:
+  void update(int slot, vector<double>& param, const vector<double>& grad, double grad_scale) override {
+    int n = param.size();
+    double* s = state_for(slot, Rule::num_state, n);
+    Rule& rule = static_cast<Rule&>(*this);
+    rule.prepare();
+    _update(rule, param.data(), grad.data(), s, Rule::num_state > 1 ? s + n : nullptr, n, grad_scale);
+  }
+
+  void update(int slot, vector<vector<vector<double>>>& param, const vector<vector<vector<double>>>& grad,
+              double grad_scale) override {
+    int n = 0;
+    for (auto& matrix : param) {
+      for (auto& row : matrix) {
+        n += row.size();
+      }
+    }
+    double* s = state_for(slot, Rule::num_state, n);
+    Rule& rule = static_cast<Rule&>(*this);
+    rule.prepare();
+
+    // Row by row, with the state in the same order. Only filter rows are longer than one element:
+    // Dense weights are stored as [out][in][1], so their update is one call per weight, not a loop
+    // the compiler can vectorize.
+    int offset = 0;
+    for (int i = 0; i < param.size(); i++) {
+      for (int j = 0; j < param[i].size(); j++) {
+        int len = param[i][j].size();
+        double* s0 = s ? s + offset : nullptr;
+        double* s1 = Rule::num_state > 1 ? s + n + offset : nullptr;
+        _update(rule, param[i][j].data(), grad[i][j].data(), s0, s1, len, grad_scale);
+        offset += len;
+      }
+    }
+  }
+
+ private:
+  void static _update(Rule& rule, double* __restrict p, const double* __restrict g, double* __restrict s0,
+                      double* __restrict s1, int n, double grad_scale) {
+    double unused = 0;
+    for (int i = 0; i < n; i++) {
+      rule.apply(p[i], g[i] * grad_scale, Rule::num_state > 0 ? s0[i] : unused, Rule::num_state > 1 ? s1[i] : unused);
+    }
+  }
+};
+
+class SGD : public ElementwiseOptimizer<SGD> {
+ public:
+  static const int num_state = 0;
+  double learning_rate;
+
+  SGD(double learning_rate) { this->learning_rate = learning_rate; }
+
+  void prepare() {}
+
+  void apply(double& p, double g, double&, double&) { p -= learning_rate * g; }
+};
+
+class Momentum : public ElementwiseOptimizer<Momentum> {
+ public:
+  static const int num_state = 1;
+  double learning_rate;
+  double momentum;
+  bool nesterov;
+
+  Momentum(double learning_rate, double momentum = 0.9, bool nesterov = false) {
+    this->learning_rate = learning_rate;
+    this->momentum = momentum;
+    this->nesterov = nesterov;
+  }
+
+  void prepare() {}
+
+  void apply(double& p, double g, double& velocity, double&) {
+    velocity = momentum * velocity + g;
+    // Nesterov evaluates the step at the look-ahead point p - learning_rate * momentum * velocity.
+    p -= learning_rate * (nesterov ? g + momentum * velocity : velocity);
+  }
+};
+
+class Adam : public ElementwiseOptimizer<Adam> {
+ public:
+  static const int num_state = 2;
+  double learning_rate;
+  double beta1;
+  double beta2;
+  double epsilon;
+
+  Adam(double learning_rate = 0.001, double beta1 = 0.9, double beta2 = 0.999, double epsilon = 1e-8) {
+    this->learning_rate = learning_rate;
+    this->beta1 = beta1;
+    this->beta2 = beta2;
+    this->epsilon = epsilon;
+  }
+
+  void prepare() {
+    // Bias corrections are folded into the step size and epsilon once per buffer.
+    double correction1 = 1 - pow(beta1, max(t, 1));
+    double correction2 = 1 - pow(beta2, max(t, 1));
+    step_size = learning_rate * sqrt(correction2) / correction1;
+    epsilon_hat = epsilon * sqrt(correction2);
+  }
+
+  void apply(double& p, double g, double& m, double& v) {
+    m = beta1 * m + (1 - beta1) * g;
+    v = beta2 * v + (1 - beta2) * g * g;
+    p -= step_size * m / (sqrt(v) + epsilon_hat);
+  }
+
+ private:
+  double step_size = 0;
+  double epsilon_hat = 0;
+};
+
+// Heap allocations made by this thread while an AllocationScope is alive anywhere. The counts come
+// from the global operator new below, which replaces the standard one only when compiled with
+// -DCNN_ALLOCATION_HOOK; otherwise nothing is counted. Until a scope is opened, counting costs one
+// relaxed load per allocation.
+struct AllocationStats {
+  long allocations = 0;
+  long bytes = 0;
+};
+
+class AllocationTracker {
+ public:
+  inline static atomic<int> scopes{0};
+  inline static thread_local AllocationStats counts;
+
+  static void record(size_t size) {
+    if (scopes.load(memory_order_relaxed) > 0) {
+      counts.allocations++;
+      counts.bytes += size;
+    }
+  }
+};
+
+// Measures the allocations of the calling thread from construction on. Scopes may nest.
+class AllocationScope {
+ public:
+  AllocationScope() {
+    AllocationTracker::scopes++;
+    start = AllocationTracker::counts;
+  }
+  ~AllocationScope() { AllocationTracker::scopes--; }
+
+  AllocationScope(const AllocationScope&) = delete;
+  AllocationScope& operator=(const AllocationScope&) = delete;
+
+  long allocations() const { return AllocationTracker::counts.allocations - start.allocations; }
+  long bytes() const { return AllocationTracker::counts.bytes - start.bytes; }
+
+ private:
+  AllocationStats start;
+};
+
+#ifdef CNN_ALLOCATION_HOOK
+// new[] and the nothrow forms call this one, and delete[] the delete below. Not inlined, so that the
+// compiler does not pair a standard new with the free() below.
+__attribute__((noinline)) void* operator new(size_t size) {
+  AllocationTracker::record(size);
+  if (void* p = malloc(size > 0 ? size : 1)) {
+    return p;
+  }
+  throw bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept { free(p); }
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept { free(p); }
+#endif
+
+// Per-layer instrumentation for ConvNet::h and the backward pass.
+// Compile with -DCNN_NO_PROFILING to remove it entirely. Otherwise it costs a
+// single branch per layer call until Profiler::enabled is set.
+struct ProfileRecord {
+  string layer;  // Layer type, e.g. "Dense"
+  int layer_index;
+  string phase;  // "forward" or "backward"
+  size_t thread;
+  double start_us;
+  double duration_us;
+  double flops;
+  double bytes_read;
+  double bytes_written;
+  double bytes_allocated;
+};
+
+class Profiler {
+ public:
+  inline static atomic<bool> enabled{false};
+  inline static vector<ProfileRecord> records;
+  inline static mutex records_mutex;
+
+  static double now_us() {
+    static const chrono::steady_clock::time_point origin = chrono::steady_clock::now();
+    return chrono::duration<double, micro>(chrono::steady_clock::now() - origin).count();
+  }
+
+  static void clear() {
+    lock_guard<mutex> lock(records_mutex);
+    records.clear();
+  }
+
+  static void add(ProfileRecord record) {
+    lock_guard<mutex> lock(records_mutex);
+    records.push_back(record);
+  }
+
+  static string layer_name(Layer* layer) {
+    if (dynamic_cast<Conv*>(layer)) {
+      return "Conv";
+    } else if (dynamic_cast<MaxPool*>(layer)) {
+      return "MaxPool";
+    } else if (dynamic_cast<AvgPool*>(layer)) {
+      return "AvgPool";
+    } else if (dynamic_cast<Sigmoid*>(layer)) {
+      return "Sigmoid";
+    } else if (dynamic_cast<Relu*>(layer)) {
+      return "Relu";
+    } else if (dynamic_cast<Flatten*>(layer)) {
+      return "Flatten";
+    } else if (dynamic_cast<SparseDense*>(layer)) {
+      return "SparseDense";
+    } else if (dynamic_cast<Dense*>(layer)) {
+      return "Dense";
+    }
+    return "Layer";
+  }
+
+  // Analytical cost of one layer call given the tensors going in and out of it. In the backward
+  // pass `in` is the layer's forward input and `out` its forward output. Allocations are measured
+  // by the caller; without the allocation hook, backward ones are estimated as the gradient buffers.
+  static void estimate_cost(ProfileRecord& r, Layer* layer, const Tensor& in, const Tensor& out) {
+    double n_in = in.size();
+    double n_out = out.size();
+    double flops = 0;
+    double params = 0;
+
+    if (Conv* conv = dynamic_cast<Conv*>(layer)) {
+      for (int f = 0; f < conv->num_filters; f++) {
+        double k = conv->size_per_filter[f];
+        params += in.channels * k * k + 1;
+        flops += 2 * k * k * in.channels * (n_out / max(1, conv->num_filters));
+      }
+    } else if (Pool* pool = dynamic_cast<Pool*>(layer)) {
+      flops = n_out * pool->height * pool->width;
+    } else if (dynamic_cast<Sigmoid*>(layer)) {
+      flops = 4 * n_in;
+    } else if (dynamic_cast<Act*>(layer)) {
+      flops = n_in;
+    } else if (SparseDense* sparse = dynamic_cast<SparseDense*>(layer)) {
+      // A column index is read with every value.
+      params = 1.5 * sparse->nnz() + sparse->num_out;
+      flops = 2.0 * sparse->nnz();
+    } else if (Dense* dense = dynamic_cast<Dense*>(layer)) {
+      params = (double)dense->num_out * dense->num_in + dense->num_out;
+      flops = 2.0 * dense->num_out * dense->num_in;
+    }
+
+    if (r.phase == "backward") {
+      // Gradients w.r.t. the input and the parameters each cost about one forward pass.
+      flops *= 2;
+      r.bytes_read = (n_in + n_out + params) * sizeof(double);
+      r.bytes_written = (n_in + params) * sizeof(double);
+#ifndef CNN_ALLOCATION_HOOK
+      r.bytes_allocated = (n_in + params) * sizeof(double);
+#endif
+    } else {
+      r.bytes_read = (n_in + params) * sizeof(double);
+      r.bytes_written = n_out * sizeof(double);
+    }
+    r.flops = flops;
+  }
+
+  // One row per (layer, phase), in execution order.
+  static void summary(ostream& out = cout) {
+    lock_guard<mutex> lock(records_mutex);
+
+    vector<tuple<int, string>> keys;
+    map<tuple<int, string>, vector<const ProfileRecord*>> groups;
+    double total_us = 0;
+    for (const ProfileRecord& r : records) {
+      tuple<int, string> key = make_tuple(r.layer_index, r.phase);
+      if (groups.find(key) == groups.end()) {
+        keys.push_back(key);
+      }
+      groups[key].push_back(&r);
+      total_us += r.duration_us;
+    }
+
+    out << left << setw(6) << "layer" << setw(10) << "type" << setw(10) << "phase" << right << setw(8) << "calls"
+        << setw(12) << "total ms" << setw(12) << "mean us" << setw(8) << "%" << setw(10) << "GFLOP/s" << setw(12)
+        << "MB read" << setw(12) << "MB written" << setw(12) << "MB alloc" << endl;
+
+    for (auto& key : keys) {
+      vector<const ProfileRecord*>& group = groups[key];
+      double us = 0, flops = 0, read = 0, written = 0, allocated = 0;
+      for (const ProfileRecord* r : group) {
+        us += r->duration_us;
+        flops += r->flops;
+        read += r->bytes_read;
+        written += r->bytes_written;
+        allocated += r->bytes_allocated;
+      }
+      out << left << setw(6) << get<0>(key) << setw(10) << group[0]->layer << setw(10) << get<1>(key) << right
+          << setw(8) << group.size() << fixed << setprecision(3) << setw(12) << us / 1e3 << setw(12)
+          << us / group.size() << setprecision(1) << setw(8) << (total_us > 0 ? 100 * us / total_us : 0)
+          << setprecision(3) << setw(10) << (us > 0 ? flops / us / 1e3 : 0) << setw(12) << read / 1e6 << setw(12)
+          << written / 1e6 << setw(12) << allocated / 1e6 << defaultfloat << endl;
+    }
+  }
+
+  // Chrome trace-event format, loadable in chrome://tracing or Perfetto.
+  static void write_chrome_trace(ostream& out) {
+    lock_guard<mutex> lock(records_mutex);
+
+    out << "{\"traceEvents\":[";
+    for (int i = 0; i < records.size(); i++) {
+      const ProfileRecord& r = records[i];
+      out << (i == 0 ? "" : ",") << "\n{\"name\":\"" << r.layer << "[" << r.layer_index << "]\",\"cat\":\""
+          << r.phase << "\",\"ph\":\"X\",\"pid\":0,\"tid\":" << r.thread << ",\"ts\":" << fixed << setprecision(3)
+          << r.start_us << ",\"dur\":" << r.duration_us << ",\"args\":{\"flops\":" << setprecision(0) << r.flops
+          << ",\"bytes_read\":" << r.bytes_read << ",\"bytes_written\":" << r.bytes_written
+          << ",\"bytes_allocated\":" << r.bytes_allocated << "}}" << defaultfloat;
+    }
+    out << "\n],\"displayTimeUnit\":\"ms\"}" << endl;
+  }
+
+  static void write_chrome_trace(string filename) {
+    ofstream file(filename);
+    if (!file) {
+      throw(string) "Could not open trace file " + filename;
+    }
+    write_chrome_trace(file);
+  }
+};
+
+// Times one layer call. Does nothing unless Profiler::enabled was set when it was created. When
+// given the output tensor, the call counts as allocating it if its storage had to grow.
+class LayerProfileScope {
+ public:
+  LayerProfileScope(Layer* layer, int layer_index, const char* phase, const Tensor* out) {
+    active = Profiler::enabled;
+    if (active) {
+      this->layer = layer;
+      record.layer_index = layer_index;
+      record.phase = phase;
+      record.bytes_allocated = 0;
+      capacity_before = out ? out->data.capacity() : 0;
+      AllocationTracker::scopes++;
+      bytes_before = AllocationTracker::counts.bytes;
+      record.start_us = Profiler::now_us();
+    }
+  }
+
+  ~LayerProfileScope() {
+    if (active) {
+      AllocationTracker::scopes--;
+    }
+  }
+
+  void finish(const Tensor& in, const Tensor& out) {
+    if (!active) {
+      return;
+    }
+    record.duration_us = Profiler::now_us() - record.start_us;
+#ifdef CNN_ALLOCATION_HOOK
+    record.bytes_allocated = AllocationTracker::counts.bytes - bytes_before;
+#else
+    if (record.phase == "forward" && out.data.capacity() > capacity_before) {
+      record.bytes_allocated = out.data.capacity() * sizeof(double);
+    }
+#endif
+    record.layer = Profiler::layer_name(layer);
+    record.thread = hash<thread::id>{}(this_thread::get_id()) % 100000;
+    Profiler::estimate_cost(record, layer, in, out);
+    Profiler::add(record);
+  }
+
+ private:
+  bool active;
+  Layer* layer;
+  size_t capacity_before;
+  long bytes_before;
+  ProfileRecord record;
+};
+
+#ifndef CNN_NO_PROFILING
+#define PROFILE_LAYER_BEGIN(layer, index, phase, out) LayerProfileScope profile_scope(layer, index, phase, out)
+#define PROFILE_LAYER_END(in, out) profile_scope.finish(in, out)
+#else
+#define PROFILE_LAYER_BEGIN(layer, index, phase, out)
+#define PROFILE_LAYER_END(in, out)
+#endif
+
+// Everything a forward pass writes: the input and the output of every layer, which the backward
+// pass reads back. The model itself is only read, so threads can run inference concurrently on one
+// ConvNet as long as each uses its own context.
+class ExecutionContext {
+ public:
+  Tensor input;
+  vector<Tensor> a;   // a[L] is the output of layers[L], unless keep drops it
+  vector<bool> keep;  // Layers whose output is stored in a; empty keeps all (see ConvNet::checkpoint)
+  Tensor scratch[2];  // Outputs of the layers that are not kept, alternating
+  Tensor staging;     // Layout conversions at the model boundaries
+  // Format of the kept outputs, except the last (see ConvNet::store_activations). In 16 bits,
+  // packed[L] holds the output of layers[L] and a[L] stays empty.
+  Precision precision = Precision::Double;
+  vector<PackedTensor> packed;
+
+  // The output of layers[L] as the forward pass stored it (the input for L = -1), widened into
+  // buffer if it was stored in 16 bits.
+  const Tensor& stored(int L, Tensor& buffer) const {
+    if (L < 0) {
+      return input;
+    }
+    if (L < packed.size() && !packed[L].empty()) {
+      packed[L].unpack(buffer);
+      return buffer;
+    }
+    return a[L];
+  }
+};
+
+// Reverse-mode differentiation of a ConvNet. record() resolves every layer's backward rule and the
+// shape of its parameter gradients once; backward() then replays the rules from the loss down to
+// the first layer with parameters, reading the activations a forward pass left in an
+// ExecutionContext. The activation gradients (two buffers, alternating between layers) and the
+// parameter gradient accumulators are sized on first use and reused by every later call.
+class GradientTape {
+ public:
+  enum class Op { Conv, Pool, Act, Flatten, Dense, Identity };
+
+  struct Entry {
+    Op op;
+    Layer* layer;
+    int param;               // Index into dParams, or -1 for layers without parameters
+    bool relu_input = false;  // The input is the output of a Relu, possibly flattened
+    // Shape of the layer's input, set by ConvNet::compile. A Flatten may have emptied its input
+    // tensor, so its backward pass takes the shape from here.
+    vector<int> input_shape;
+  };
+
+  vector<Entry> entries;  // One per layer, in forward order
+  // Gradients of the loss w.r.t. the parameters, summed over the backward() calls since zero_grad().
+  // One (weights, biases) tuple per layer with parameters, last layer first.
+  vector<tuple<vector<vector<vector<double>>>, vector<double>>> dParams;
+  Tensor grads[2];  // dLoss/da[L] is in grads[L % 2] while layer L is differentiated
+  Tensor staging;
+  Tensor widened;  // The input of the layer being differentiated, if it was stored in 16 bits
+
+  void record(const vector<Layer*>& layers) {
+    entries.clear();
+    int num_params = 0;
+    for (int L = layers.size() - 1; L >= 0; L--) {
+      if (dynamic_cast<Conv*>(layers[L]) || dynamic_cast<Dense*>(layers[L])) {
+        num_params++;
+      }
+    }
+    dParams.resize(num_params);
+
+    int param = num_params;
+    bool relu_output = false;
+    for (Layer* layer : layers) {
+      Entry entry;
+      entry.op = Op::Identity;
+      entry.layer = layer;
+      entry.param = -1;
+      entry.relu_input = relu_output;
+      relu_output = dynamic_cast<Relu*>(layer) || (relu_output && dynamic_cast<Flatten*>(layer));
+      if (Conv* conv = dynamic_cast<Conv*>(layer)) {
+        entry.op = Op::Conv;
+        entry.param = --param;
+        get<0>(dParams[param]) = conv->filters;
+        get<1>(dParams[param]) = conv->biases;
+      } else if (dynamic_cast<Pool*>(layer)) {
+        entry.op = Op::Pool;
+      } else if (dynamic_cast<Act*>(layer)) {
+        entry.op = Op::Act;
+      } else if (dynamic_cast<Flatten*>(layer)) {
+        entry.op = Op::Flatten;
+      } else if (SparseDense* sparse = dynamic_cast<SparseDense*>(layer)) {
+        entry.op = Op::Dense;
+        entry.param = --param;
+        get<0>(dParams[param]) = {{sparse->values}};
+        get<1>(dParams[param]) = sparse->biases;
+      } else if (Dense* dense = dynamic_cast<Dense*>(layer)) {
+        entry.op = Op::Dense;
+        entry.param = --param;
+        get<0>(dParams[param]) = dense->weights;
+        get<1>(dParams[param]) = dense->biases;
+      }
+      entries.push_back(entry);
+    }
+    zero_grad();
+  }
+
+  void zero_grad() {
+    for (auto& dParam : dParams) {
+      for (auto& matrix : get<0>(dParam)) {
+        for (auto& row : matrix) {
+          fill(row.begin(), row.end(), 0.0);
+        }
+      }
+      fill(get<1>(dParam).begin(), get<1>(dParam).end(), 0.0);
+    }
+  }
+
+  // Adds the gradient of the squared error loss for label y to dParams. ctx must hold the forward
+  // pass of the same layers, whose last layer wrote its output in output_layout.
+  void backward(const ExecutionContext& ctx, int y, Layout output_layout = Layout::CHW) {
+    seed(ctx.a.back(), y, output_layout);
+    backward_layers(0, entries.size(), [&](int L) -> const Tensor& { return ctx.stored(L - 1, widened); });
+  }
+
+  // Starts a backward pass from the model output, which ConvNet returns channel-major. layout is
+  // the layout the last layer produced it in.
+  void seed(const Tensor& output, int y, Layout layout = Layout::CHW) {
+    Tensor& grad_output = grads[(entries.size() - 1) % 2];
+    Tensor& chw = layout == Layout::CHW ? grad_output : staging;
+    chw.resize(output.channels, output.height, output.width);
+    chw.layout = Layout::CHW;
+    for (int i = 0; i < output.size(); i++) {
+      chw.data[i] = output.data[i] - (i == y ? 1 : 0);
+    }
+    if (layout != Layout::CHW) {
+      chw.convert(layout, grad_output);
+    }
+  }
+
+  // Differentiates layers end - 1 down to begin, given dLoss/da[end - 1] from seed() or from the
+  // previous call. input(L) returns the forward input of layer L. A template rather than a
+  // std::function, which may allocate for a lambda with several captures.
+  template <class Input>
+  void backward_layers(int begin, int end, const Input& input) {
+    int first = 0;  // Nothing below the first layer with parameters needs a gradient
+    while (first < entries.size() && entries[first].param < 0) {
+      first++;
+    }
+
+    for (int L = end - 1; L >= max(begin, first); L--) {
+      const Entry& entry = entries[L];
+      const Tensor& in = input(L);
+      const Tensor& grad_out = grads[L % 2];
+      Tensor* grad_in = L > first ? &grads[(L + 1) % 2] : nullptr;
+      PROFILE_LAYER_BEGIN(entry.layer, L, "backward", grad_in);
+      switch (entry.op) {
+        case Op::Conv:
+          static_cast<Conv*>(entry.layer)->backward(in, grad_out, grad_in, get<0>(dParams[entry.param]),
+                                                    get<1>(dParams[entry.param]));
+          break;
+        case Op::Dense:
+          static_cast<Dense*>(entry.layer)->backward(in, grad_out, grad_in, get<0>(dParams[entry.param]),
+                                                     get<1>(dParams[entry.param]), entry.relu_input);
+          break;
+        case Op::Pool:
+          static_cast<Pool*>(entry.layer)->backward(in, grad_out, *grad_in);
+          break;
+        case Op::Act:
+          static_cast<Act*>(entry.layer)->backward(in, grad_out, *grad_in);
+          break;
+        case Op::Flatten:
+          if (in.layout == Layout::CHW) {
+            Flatten::reshape_backward(entry.input_shape, grads[L % 2], *grad_in);  // grad_out is not needed again
+          } else {
+            Flatten::backward(in, grad_out, *grad_in);
+          }
+          break;
+        case Op::Identity:
+          *grad_in = grad_out;
+          break;
+      }
+      PROFILE_LAYER_END(in, grad_out);
+    }
+  }
+};
+
+class ConvNet {
+ public:
+  vector<Layer*> layers;         // The layers run, i.e. source_layers after compile()'s rewrites
+  vector<Layer*> source_layers;  // The layers as given
+  vector<shared_ptr<Layer>> folded_layers;  // Layers the rewrites created, owned by the model
+  bool optimize_graph = true;               // See optimize()
+  bool fold_linear = false;
+  ExecutionContext context;  // Used by h(x), predict(x) and the training methods
+  GradientTape tape;         // Backward pass of the training methods, over context
+  map<int, int> layer_map;   // Index among the layers with parameters -> index in layers
+  Optimizer* optimizer = nullptr;  // Plain SGD when not set
+  Sampler* sampler = nullptr;      // Minibatches of fit(); independent uniform ones when not set
+  vector<int> segment_starts;      // First layer of every checkpointed segment; empty stores everything
+  vector<Tensor> recomputed;       // Activations of the segment being differentiated
+  Tensor widened;                  // Input of the segment being differentiated, if stored in 16 bits
+  vector<double> flat_dParams;     // The gradient as exchanged by fit_step() in data parallel mode
+  vector<int> input_shape;         // num_channels x height x width the model is compiled for
+  // Storage order of the feature maps inside the model. Inputs and outputs are always CHW: the
+  // input is converted once on entry and a spatial output once on exit; Flatten emits CHW order.
+  Layout layout = Layout::CHW;
+
+  ConvNet(vector<Layer*> layers) {
+    this->layers = layers;
+    this->source_layers = layers;
+    tape.record(layers);
+  }
+
+  // Infers the input shape of every layer and binds tuned kernels to the Conv and Dense layers.
+  // With autotune, shapes missing from the tuning cache are benchmarked now; otherwise they keep
+  // their current tiling and ConvPlanner picks convolution algorithms from its cost model.
+  // h() compiles without autotuning when it sees a new input shape, so only explicit calls tune.
+  void compile(vector<int> input_shape, bool autotune = false) {
+    layers = optimize_graph ? optimize(input_shape) : source_layers;
+    if (layers != source_layers && !_equivalent(source_layers, layers, input_shape)) {
+      layers = source_layers;
+      folded_layers.clear();
+    }
+
+    vector<int> shape = input_shape;
+    for (int L = 0; L < layers.size(); L++) {
+      Layer* layer = layers[L];
+      if (Conv* conv = dynamic_cast<Conv*>(layer)) {
+        Autotuner::tune(*conv, shape, autotune);
+        ConvPlanner::plan(*conv, shape, autotune);
+      } else if (dynamic_cast<SparseDense*>(layer)) {
+        // The CSR kernels have no tiling
+      } else if (Dense* dense = dynamic_cast<Dense*>(layer)) {
+        Autotuner::tune(*dense, autotune);
+      }
+      shape = output_shape(layer, shape);
+    }
+
+    layer_map.clear();
+    int l = 0;
+    for (int L = 0; L < layers.size(); L++) {
+      if (dynamic_cast<Conv*>(layers[L]) || dynamic_cast<Dense*>(layers[L])) {
+        layer_map[l] = L;
+        l++;
+      }
+    }
+    tape.record(layers);
+    shape = input_shape;
+    for (int L = 0; L < layers.size(); L++) {
+      tape.entries[L].input_shape = shape;
+      shape = output_shape(layers[L], shape);
+    }
+    checkpoint(segment_starts);
+    this->input_shape = input_shape;
+  }
+
+  // Rewrites source_layers into a cheaper list of layers computing the same function:
+  //  - a monotonic activation followed by a MaxPool moves after it, to run on the smaller tensor;
+  //  - layers that do nothing are dropped: a Flatten of a vector, a 1x1 MaxPool of stride 1 and a
+  //    Relu of a Relu;
+  //  - with fold_linear, two consecutive Dense layers become one when that takes fewer
+  //    multiplications. The folded layer belongs to the model and is what fit() then trains, so
+  //    folding is meant for inference, and it is redone from the source layers on every compile.
+  // Moving and dropping leave every parameter in its layer, so the model trains exactly as before.
+  // Dropping and folding change the layer count, so checkpointed models only move layers.
+  vector<Layer*> optimize(const vector<int>& input_shape) {
+    vector<Layer*> graph = source_layers;
+    bool resize = segment_starts.empty();
+    folded_layers.clear();
+
+    for (bool changed = true; changed;) {
+      changed = false;
+      vector<int> shape = input_shape;
+      for (int L = 0; L < graph.size() && !changed; L++) {
+        Layer* next = L + 1 < graph.size() ? graph[L + 1] : nullptr;
+        Act* act = dynamic_cast<Act*>(graph[L]);
+        if (act && act->monotonic() && dynamic_cast<MaxPool*>(next)) {
+          swap(graph[L], graph[L + 1]);
+          changed = true;
+        } else if (resize && graph.size() > 1 && _is_noop(graph[L], L > 0 ? graph[L - 1] : nullptr, shape)) {
+          graph.erase(graph.begin() + L);
+          changed = true;
+        } else if (resize && fold_linear && next && _foldable(graph[L], next)) {
+          folded_layers.push_back(_fold(*static_cast<Dense*>(graph[L]), *static_cast<Dense*>(next)));
+          graph[L] = folded_layers.back().get();
+          graph.erase(graph.begin() + L + 1);
+          changed = true;
+        } else {
+          shape = output_shape(graph[L], shape);
+        }
+      }
+    }
+    return graph;
+  }
+
+  // Whether layer returns its input unchanged, given the layer before it and the input shape.
+  bool static _is_noop(Layer* layer, Layer* previous, const vector<int>& shape) {
+    if (dynamic_cast<Flatten*>(layer)) {
+      return shape[1] == 1 && shape[2] == 1;
+    } else if (Pool* pool = dynamic_cast<Pool*>(layer)) {
+      return pool->height == 1 && pool->width == 1 && pool->stride == 1;
+    } else if (dynamic_cast<Relu*>(layer)) {
+      return dynamic_cast<Relu*>(previous);
+    }
+    return false;
+  }
+
+  // Whether Dense layers a then b take more multiplications than their product. Sparse layers are
+  // left alone, since their product would be dense.
+  bool static _foldable(Layer* a, Layer* b) {
+    Dense* first = dynamic_cast<Dense*>(a);
+    Dense* second = dynamic_cast<Dense*>(b);
+    if (!first || !second || dynamic_cast<SparseDense*>(a) || dynamic_cast<SparseDense*>(b)) {
+      return false;
+    }
+    return (double)second->num_out * first->num_in < (double)first->num_out * (first->num_in + second->num_out);
+  }
+
+  // second(first(a)) as a single layer: W = W2 W1, b = W2 b1 + b2.
+  shared_ptr<Dense> static _fold(const Dense& first, const Dense& second) {
+    shared_ptr<Dense> folded = make_shared<Dense>(second.num_out, first.num_in);
+    for (int i = 0; i < second.num_out; i++) {
+      double bias = second.biases[i];
+      for (int k = 0; k < first.num_out; k++) {
+        bias += second.weights[i][k][0] * first.biases[k];
+      }
+      folded->biases[i] = bias;
+      for (int j = 0; j < first.num_in; j++) {
+        double w = 0;
+        for (int k = 0; k < first.num_out; k++) {
+          w += second.weights[i][k][0] * first.weights[k][j][0];
+        }
+        folded->weights[i][j][0] = w;
+      }
+    }
+    folded->tiling = second.tiling;
+    return folded;
+  }
+
+  // Whether two lists of layers agree on a few random inputs of the given shape, up to rounding.
+  bool static _equivalent(const vector<Layer*>& a, const vector<Layer*>& b, const vector<int>& input_shape) {
+    mt19937 rng(1);
+    uniform_real_distribution<double> uniform(-1, 1);
+    Tensor x, out_a, out_b;
+    x.resize(input_shape[0], input_shape[1], input_shape[2]);
+    for (int trial = 0; trial < 2; trial++) {
+      for (double& value : x.data) {
+        value = uniform(rng);
+      }
+      _run(a, x, out_a);
+      _run(b, x, out_b);
+      if (out_a.shape() != out_b.shape()) {
+        return false;
+      }
+      for (int i = 0; i < out_a.size(); i++) {
+        if (!(abs(out_a.data[i] - out_b.data[i]) <= 1e-9 * max(1.0, abs(out_a.data[i])))) {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  void static _run(const vector<Layer*>& layers, const Tensor& x, Tensor& out) {
+    Tensor feature_maps[2];
+    const Tensor* z = &x;
+    for (int L = 0; L < layers.size(); L++) {
+      _forward_layer(layers[L], *z, feature_maps[L % 2]);
+      z = &feature_maps[L % 2];
+    }
+    out = *z;
+  }
+
+  vector<int> static output_shape(Layer* layer, vector<int> shape) {
+    if (Conv* conv = dynamic_cast<Conv*>(layer)) {
+      return conv->output_shape(shape);
+    } else if (Pool* pool = dynamic_cast<Pool*>(layer)) {
+      return pool->output_shape(shape);
+    } else if (dynamic_cast<Flatten*>(layer)) {
+      return {shape[0] * shape[1] * shape[2], 1, 1};
+    } else if (Dense* dense = dynamic_cast<Dense*>(layer)) {
+      if (shape[0] * shape[1] * shape[2] != dense->num_in) {
+        throw(string) "Mismatch between Dense parameters and incoming vector!";
+      }
+      return {dense->num_out, 1, 1};
+    }
+    return shape;
+  }
+
+  vector<vector<vector<double>>> h(const vector<vector<vector<double>>>& x) {
+    _load(x);
+    return forward(context).to_nested();
+  }
+
+  // Puts x in context.input, compiling the model first if x has a new shape. Allocates nothing once
+  // the model has seen an input of this shape.
+  void _load(const vector<vector<vector<double>>>& x) {
+    if (input_shape.size() != 3 || x.size() != input_shape[0] || x[0].size() != input_shape[1] ||
+        x[0][0].size() != input_shape[2]) {
+      compile({(int)x.size(), (int)x[0].size(), (int)x[0][0].size()}, false);
+    }
+    context.input.load(x);
+  }
+
+  // Reentrant versions for concurrent inference: the model must already be compiled for x's shape.
+  vector<vector<vector<double>>> h(const vector<vector<vector<double>>>& x, ExecutionContext& ctx) const {
+    ctx.input.load(x);
+    return forward(ctx).to_nested();
+  }
+
+  int predict(const vector<vector<vector<double>>>& x, ExecutionContext& ctx) const {
+    ctx.input.load(x);
+    return argmax(forward(ctx));
+  }
+
+  // Runs every layer on ctx.input and leaves each layer's output in ctx.a, or only the outputs
+  // selected by ctx.keep. Only reads the model.
+  const Tensor& forward(ExecutionContext& ctx) const {
+    if (!ctx.input.has_shape(input_shape)) {
+      throw(string) "ConvNet is not compiled for this input shape!";
+    }
+    ctx.a.resize(layers.size());
+    if (ctx.precision != Precision::Double) {
+      ctx.packed.resize(layers.size());
+    }
+    _enter_layout(ctx);
+
+    Tensor* z = &ctx.input;
+    for (int L = 0; L < layers.size(); L++) {
+      Layer* layer = layers[L];
+      bool kept = ctx.keep.empty() || ctx.keep[L];
+      bool packed = kept && ctx.precision != Precision::Double && L + 1 < layers.size();
+      Tensor& feature_map = kept && !packed ? ctx.a[L] : ctx.scratch[L % 2];
+      // Checkpointed segments are recomputed from their stored input, so that cannot be consumed.
+      bool consumable = ctx.keep.empty() || (L > 0 && !ctx.keep[L - 1]);
+
+      PROFILE_LAYER_BEGIN(layer, L, "forward", &feature_map);
+      if (consumable) {
+        _forward_layer_consuming(layer, *z, feature_map);
+      } else {
+        _forward_layer(layer, *z, feature_map);
+      }
+      PROFILE_LAYER_END(*z, feature_map);
+      if (packed) {
+        ctx.packed[L].pack(feature_map, ctx.precision);
+      }
+
+      z = &feature_map;
+    }
+
+    _leave_layout(ctx.a.back(), ctx);
+    return *z;
+  }
+
+  // Stores ctx.input in the model layout, in place.
+  void _enter_layout(ExecutionContext& ctx) const {
+    if (ctx.input.layout != layout) {
+      ctx.input.convert(layout, ctx.staging);
+      swap(ctx.input, ctx.staging);
+    }
+  }
+
+  // Returns a model output to CHW, in place. Vectors (after Flatten or Dense) are the same in both.
+  void _leave_layout(Tensor& output, ExecutionContext& ctx) const {
+    if (output.layout != Layout::CHW) {
+      output.convert(Layout::CHW, ctx.staging);
+      swap(output, ctx.staging);
+    }
+  }
+
+  // Layout the last layer writes its output in, before _leave_layout.
+  Layout output_layout() const {
+    Layout result = layout;
+    for (Layer* layer : layers) {
+      if (dynamic_cast<Flatten*>(layer) || dynamic_cast<Dense*>(layer)) {
+        result = Layout::CHW;
+      }
+    }
+    return result;
+  }
+
+  void static _forward_layer(Layer* layer, const Tensor& z, Tensor& feature_map) {
+    if (Conv* conv = dynamic_cast<Conv*>(layer)) {
+      conv->forward(z, feature_map);
+    } else if (Pool* pool = dynamic_cast<Pool*>(layer)) {
+      pool->forward(z, feature_map);
+    } else if (Act* act = dynamic_cast<Act*>(layer)) {
+      act->forward(z, feature_map);
+    } else if (Flatten* flatten = dynamic_cast<Flatten*>(layer)) {
+      flatten->forward(z, feature_map);
+    } else if (Dense* dense = dynamic_cast<Dense*>(layer)) {
+      dense->forward(z, feature_map);
+    }
+  }
+
+  // Like _forward_layer, except that a Flatten of a CHW tensor is a reshape that takes over z's
+  // buffer and leaves z empty. The backward pass of the Flatten takes the shape from the tape.
+  void static _forward_layer_consuming(Layer* layer, Tensor& z, Tensor& feature_map) {
+    if (dynamic_cast<Flatten*>(layer) && z.layout == Layout::CHW) {
+      Flatten::reshape(z, feature_map);
+    } else {
+      _forward_layer(layer, z, feature_map);
+    }
+  }
+
+  // Forward pass for the first n contexts at once, layer by layer, so that every layer's parameters
+  // are fetched from memory once per batch. Dense layers run as one matrix product over the batch.
+  void forward_batch(vector<ExecutionContext>& ctxs, int n) const {
+    for (int b = 0; b < n; b++) {
+      if (!ctxs[b].input.has_shape(input_shape)) {
+        throw(string) "ConvNet is not compiled for this input shape!";
+      }
+      ctxs[b].a.resize(layers.size());
+      _enter_layout(ctxs[b]);
+    }
+
+    vector<const double*> ins(n);
+    vector<double*> outs(n);
+    for (int L = 0; L < layers.size(); L++) {
+      Layer* layer = layers[L];
+      PROFILE_LAYER_BEGIN(layer, L, "forward", &ctxs[0].a[L]);
+      Dense* dense = dynamic_cast<Dense*>(layer);
+      if (dense && n > 1) {
+        for (int b = 0; b < n; b++) {
+          const Tensor& z = L == 0 ? ctxs[b].input : ctxs[b].a[L - 1];
+          if (z.size() != dense->num_in) {
+            throw(string) "Mismatch between Dense parameters and incoming vector!";
+          }
+          ctxs[b].a[L].resize(dense->num_out, 1, 1);
+          ins[b] = z.data.data();
+          outs[b] = ctxs[b].a[L].data.data();
+        }
+        dense->forward_batch(ins.data(), outs.data(), n);
+      } else {
+        for (int b = 0; b < n; b++) {
+          _forward_layer_consuming(layer, L == 0 ? ctxs[b].input : ctxs[b].a[L - 1], ctxs[b].a[L]);
+        }
+      }
+      PROFILE_LAYER_END(L == 0 ? ctxs[0].input : ctxs[0].a[L - 1], ctxs[0].a[L]);
+    }
+    for (int b = 0; b < n; b++) {
+      _leave_layout(ctxs[b].a.back(), ctxs[b]);
+    }
+  }
+
+  int predict(const vector<vector<vector<double>>>& x) {
+    _load(x);
+    return argmax(forward(context));
+  }
+
+  int static argmax(const Tensor& feature_map) {
+    // Take argmax of the output
+    int label = 0;
+    for (int i = 1; i < feature_map.size(); i++) {
+      if (feature_map.data[label] < feature_map.data[i]) {
+        label = i;
+      }
+    }
+
+    return label;
+  }
+
+  void fit(const vector<vector<vector<vector<double>>>>& X, int Y[], ShmAllreduce* allreduce = nullptr) {
+    /* Fit function.
+
+    This is the gradient descent function.
+
+    (1) Take a minibatch of examples (20%)
+    (2) Run each example through _calc_dLoss_dParam and average out the gradient for the minibatch examples
+    (3) Take a step alpha from current weights and biases towards the directions of the gradient
+    (4) Repeat steps 2-4 until some convergence criteria
+    (5) Evaluate the Loss every so often
+
+    Data parallel mode (allreduce set): every rank draws the same minibatch from the shared seed,
+    computes the gradient of its share of the examples, and the summed gradient from the allreduce
+    gives every rank the same update, so the model copies stay identical. Only rank 0 logs.
+    */
+
+    int num_steps = 100;
+    double alpha = 1.0;
+    double minibatch_ratio = 0.1;
+
+    SGD default_optimizer = SGD(alpha);
+    Optimizer* optimizer = this->optimizer ? this->optimizer : &default_optimizer;
+    // Ranks seed their samplers alike, so that they draw the same minibatches.
+    MinibatchSampler default_sampler =
+        MinibatchSampler(X.size(), allreduce ? RngStream(allreduce->seed()) : RngStream::next_stream());
+    Sampler* sampler = this->sampler ? this->sampler : &default_sampler;
+    bool log = !allreduce || allreduce->rank == 0;
+
+    vector<int> batch;
+    for (int i = 0; i < num_steps; i++) {
+      sampler->next(floor(X.size() * minibatch_ratio), batch);
+
+      if (i % 10 == 0 && log) {
+        cout << "Step: " << i << ". Loss is " << TotalLoss(X, Y) << ". Accuracy is " << TotalAccuracy(X, Y) << endl;
+      }
+
+      fit_step(X, Y, batch, *optimizer, allreduce);
+    }
+    if (log) {
+      cout << "Step: " << num_steps - 1 << ". Loss is " << TotalLoss(X, Y) << ". Accuracy is " << TotalAccuracy(X, Y)
+           << endl;
+    }
+  }
+
+  // One step of fit() on the examples X[batch[j]]: with allreduce, on this rank's share of them
+  // followed by the exchange of gradients. Allocates nothing once the buffers have been sized by a
+  // first step.
+  void fit_step(const vector<vector<vector<vector<double>>>>& X, int Y[], const vector<int>& batch,
+                Optimizer& optimizer, ShmAllreduce* allreduce = nullptr) {
+    int first = allreduce ? allreduce->rank : 0;
+    int num_ranks = allreduce ? allreduce->world : 1;
+
+    tape.zero_grad();
+    for (int j = first; j < batch.size(); j += num_ranks) {
+      _load(X[batch[j]]);
+      forward(context);  // Saves a bunch of variables that we need for the backward pass
+      _backward(Y[batch[j]]);
+    }
+
+    if (allreduce) {
+      _pack_dParams(tape.dParams, flat_dParams);
+      allreduce->allreduce(flat_dParams);
+      _unpack_dParams(flat_dParams, tape.dParams);
+    }
+
+    // Add tensor to weights (first part of the tuple) and vector (second part of tuple) to biases
+    // Do this for each layer (that's why dParam is a vector). The optimizer averages over the batch.
+    optimizer.begin_step();
+
+    for (const GradientTape::Entry& entry : tape.entries) {
+      int k = entry.param;
+      if (SparseDense* sparse = dynamic_cast<SparseDense*>(entry.layer)) {
+        optimizer.update(2 * k, sparse->values, get<0>(tape.dParams[k])[0][0], 1.0 / batch.size());
+        optimizer.update(2 * k + 1, sparse->biases, get<1>(tape.dParams[k]), 1.0 / batch.size());
+      } else if (Dense* dense = dynamic_cast<Dense*>(entry.layer)) {
+        optimizer.update(2 * k, dense->weights, get<0>(tape.dParams[k]), 1.0 / batch.size());
+        optimizer.update(2 * k + 1, dense->biases, get<1>(tape.dParams[k]), 1.0 / batch.size());
+      } else if (Conv* conv = dynamic_cast<Conv*>(entry.layer)) {
+        optimizer.update(2 * k, conv->filters, get<0>(tape.dParams[k]), 1.0 / batch.size());
+        optimizer.update(2 * k + 1, conv->biases, get<1>(tape.dParams[k]), 1.0 / batch.size());
+        conv->pack();
+      }
+    }
+  }
+
+  // Number of trainable doubles, i.e. the size of the gradient exchanged in data parallel training.
+  int num_parameters() {
+    int n = 0;
+    for (Layer* layer : layers) {
+      if (SparseDense* sparse = dynamic_cast<SparseDense*>(layer)) {
+        n += sparse->nnz() + sparse->num_out;
+      } else if (Dense* dense = dynamic_cast<Dense*>(layer)) {
+        n += dense->num_out * dense->num_in + dense->num_out;
+      } else if (Conv* conv = dynamic_cast<Conv*>(layer)) {
+        for (int k : conv->size_per_filter) {
+          n += conv->num_input_channels * k * k + 1;
+        }
+      }
+    }
+    return n;
+  }
+
+  void static _pack_dParams(const vector<tuple<vector<vector<vector<double>>>, vector<double>>>& dParams,
+                            vector<double>& flat) {
+    flat.clear();
+    for (auto& dParam : dParams) {
+      for (auto& matrix : get<0>(dParam)) {
+        for (auto& row : matrix) {
+          flat.insert(flat.end(), row.begin(), row.end());
+        }
+      }
+      flat.insert(flat.end(), get<1>(dParam).begin(), get<1>(dParam).end());
+    }
+  }
+
+  void static _unpack_dParams(const vector<double>& flat,
+                              vector<tuple<vector<vector<vector<double>>>, vector<double>>>& dParams) {
+    const double* in = flat.data();
+    for (auto& dParam : dParams) {
+      for (auto& matrix : get<0>(dParam)) {
+        for (auto& row : matrix) {
+          copy(in, in + row.size(), row.begin());
+          in += row.size();
+        }
+      }
+      copy(in, in + get<1>(dParam).size(), get<1>(dParam).begin());
+      in += get<1>(dParam).size();
+    }
+  }
+
+  // Calculate the accuracy per example
+  double Accuracy(vector<vector<vector<double>>> x, int y) {
+    if (y == 10) {
+      throw(string) "Mismatch between label definition in Loss and incoming label!";
+    }
+    int label = predict(x);
+
+    if (label == y) {
+      return 1;
+    } else {
+      return 0;
+    }
+  }
+
+  // Calculate the accuracy
+  double TotalAccuracy(vector<vector<vector<vector<double>>>> X, int Y[]) {
+    double acc{0};
+
+    for (int i = 0; i < X.size(); i++) {
+      acc += Accuracy(X[i], Y[i]);
+    }
+    return acc;
+  }
+
+  // Calculate the loss function
+  double Loss(vector<vector<vector<double>>> x, int y) {
+    if (y == 10) {
+      throw(string) "Mismatch between label definition in Loss and incoming label!";
+    }
+    vector<double> y_vector(10, 0);
+    y_vector[y] = 1;
+
+    vector<vector<vector<double>>> feature_map = h(x);
+    double acc{0};
+
+    for (int i = 0; i < feature_map.size(); i++) {
+      acc += (feature_map[i][0][0] - y_vector[i]) * (feature_map[i][0][0] - y_vector[i]) / 2;
+    }
+    return acc;
+  }
+
+  // Calculate the loss function
+  double TotalLoss(vector<vector<vector<vector<double>>>> X, int Y[]) {
+    double acc{0};
+
+    for (int i = 0; i < X.size(); i++) {
+      acc += Loss(X[i], Y[i]);
+    }
+    return acc;
+  }
+
+  // Gradient checkpointing: the forward pass stores only the output of the last layer of each
+  // segment, and the backward pass recomputes the rest of a segment from the stored output before
+  // it, one segment at a time. segment_starts lists the first layer of every segment (0 is
+  // implied); an empty list turns checkpointing off.
+  void checkpoint(vector<int> segment_starts) {
+    sort(segment_starts.begin(), segment_starts.end());
+    segment_starts.erase(unique(segment_starts.begin(), segment_starts.end()), segment_starts.end());
+    if (!segment_starts.empty() && (segment_starts[0] < 0 || segment_starts.back() >= layers.size())) {
+      throw(string) "Checkpoint segments must start at a layer of the model!";
+    }
+    if (!segment_starts.empty() && segment_starts[0] != 0) {
+      segment_starts.insert(segment_starts.begin(), 0);
+    }
+    this->segment_starts = segment_starts;
+
+    context.keep.clear();
+    if (segment_starts.empty()) {
+      return;
+    }
+    context.keep.assign(layers.size(), false);
+    for (int start : segment_starts) {
+      if (start > 0) {
+        context.keep[start - 1] = true;
+      }
+    }
+    context.keep.back() = true;
+    context.a.resize(layers.size());
+    for (int L = 0; L < layers.size(); L++) {
+      if (!context.keep[L]) {
+        context.a[L] = Tensor();  // Release the dropped activations
+      }
+    }
+  }
+
+  // Stores the layer outputs the backward pass reads back, except the model output, in a 16-bit
+  // format: a quarter of the bytes of a double. The kernels still compute and accumulate in double,
+  // and the backward pass widens each stored output when it reaches the layer that reads it, so the
+  // gradient is that of the rounded activations. Precision::Double stores doubles again.
+  void store_activations(Precision precision) {
+    context.precision = precision;
+    context.packed.clear();
+    if (precision == Precision::Double) {
+      return;
+    }
+    context.a.resize(layers.size());
+    for (int L = 0; L + 1 < layers.size(); L++) {
+      context.a[L] = Tensor();  // Release the double copies
+    }
+  }
+
+  // About sqrt(number of layers) segments of about sqrt(number of layers) layers each, which keeps
+  // O(sqrt(N)) activations alive for one extra forward pass.
+  void checkpoint_sqrt() {
+    int length = ceil(sqrt((double)layers.size()));
+    vector<int> starts;
+    for (int L = 0; L < layers.size(); L += length) {
+      starts.push_back(L);
+    }
+    checkpoint(starts);
+  }
+
+  // Backward pass of the example last run through h(), adding its gradient to the tape.
+  void _backward(int y) {
+    if (segment_starts.empty()) {
+      tape.backward(context, y, output_layout());
+      return;
+    }
+
+    tape.seed(context.a.back(), y, output_layout());
+    for (int s = segment_starts.size() - 1; s >= 0; s--) {
+      int begin = segment_starts[s];
+      int end = s + 1 < segment_starts.size() ? segment_starts[s + 1] : layers.size();
+      const Tensor& segment_input = context.stored(begin - 1, widened);
+
+      // Only the outputs that feed another layer of the segment are needed.
+      if (recomputed.size() < end - begin) {
+        recomputed.resize(end - begin);
+      }
+      const Tensor* z = &segment_input;
+      for (int L = begin; L < end - 1; L++) {
+        PROFILE_LAYER_BEGIN(layers[L], L, "recompute", &recomputed[L - begin]);
+        _forward_layer(layers[L], *z, recomputed[L - begin]);
+        PROFILE_LAYER_END(*z, recomputed[L - begin]);
+        z = &recomputed[L - begin];
+      }
+
+      tape.backward_layers(begin, end, [&](int L) -> const Tensor& {
+        return L == begin ? segment_input : recomputed[L - 1 - begin];
+      });
+    }
+  }
+
+  const vector<tuple<vector<vector<vector<double>>>, vector<double>>>& _calc_dLoss_dParam(int y) {
+    /*
+    Return data type:
+    Vector of a tuple of gradients, one per layer with parameters, last layer first
+    First thing in the tuple is the tensor of weight derivatives (the filters for Conv layers)
+    Second thing in the tuple is the vector of bias derivatives.
+
+    Gradient of the example last run through h(). fit() accumulates on the tape directly. The result
+    is the tape's, overwritten by the next call.
+    */
+    tape.zero_grad();
+    _backward(y);
+    return tape.dParams;
+  }
+
+  void static h_test_1(vector<vector<vector<vector<double>>>> X, int Y[100]) {
+    Flatten flatten = Flatten();
+    Dense dense = Dense(3, 16);
+    Sigmoid sigmoid = Sigmoid();
+    ConvNet model = ConvNet(vector<Layer*>{&flatten, &dense, &sigmoid});
+    // Do a forward pass with the first "image"
+    int label = model.predict(X[0]);
+    cout << label << endl;
+
+    if (!(label >= 0 && 10 > label)) {
+      throw(string) "Test failed! " + (string) __FUNCTION__;
+    }
+
+    vector<tuple<vector<vector<vector<double>>>, vector<double>>> dParam_per_layer = model._calc_dLoss_dParam(Y[0]);
+    // (L(W+h) - L(W-h))/(2*h)
+
+    for (int i = 0; i < dense.num_out; i++) {
+      for (int j = 0; j < dense.num_out; j++) {
+        if (!(i == 0 && j == 0) && (rand() % 100) < 30) {
+          continue;
+        } else {
+          tuple<vector<vector<vector<double>>>, vector<double>> dParam = dParam_per_layer[0];
+          double epsilon{0.001};
+
+          // Might be better to loop over descreasing values of epsilon
+          dense.weights[i][j][0] += epsilon;
+          double loss1 = model.Loss(X[0], Y[0]);
+
+          dense.weights[i][j][0] -= 2 * epsilon;
+          double loss2 = model.Loss(X[0], Y[0]);
+
+          double num_dLoss_dWs = (loss1 - loss2) / (2 * epsilon);
+          cout << get<0>(dParam)[i][j][0] << endl;
+          cout << num_dLoss_dWs << endl;
+          cout << "Difference in derivatives: " << num_dLoss_dWs - get<0>(dParam)[i][j][0] << endl;
+
+          dense.weights[i][j][0] += epsilon;
+        }
+      }
+    }
+  }
+
+  void static h_test_1_bias(vector<vector<vector<vector<double>>>> X, int Y[100]) {
+    Flatten flatten = Flatten();
+    Dense dense = Dense(3, 16);
+    Sigmoid sigmoid = Sigmoid();
+    ConvNet model = ConvNet(vector<Layer*>{&flatten, &dense, &sigmoid});
+    // Do a forward pass with the first "image"
+    int label = model.predict(X[0]);
+    cout << label << endl;
+
+    if (!(label >= 0 && 10 > label)) {
+      throw(string) "Test failed! " + (string) __FUNCTION__;
+    }
+
+    vector<tuple<vector<vector<vector<double>>>, vector<double>>> dParam_per_layer = model._calc_dLoss_dParam(Y[0]);
+    // (L(b+h) - L(b-h))/(2*h)
+
+    for (int i = 0; i < dense.num_out; i++) {
+      if (!(i == 0) && (rand() % 100) < 30) {
+        continue;
+      } else {
+        tuple<vector<vector<vector<double>>>, vector<double>> dParam = dParam_per_layer[0];
+        double epsilon{0.001};
+
+        // Might be better to loop over descreasing values of epsilon
+        dense.biases[i] += epsilon;
+        double loss1 = model.Loss(X[0], Y[0]);
+
+        dense.biases[i] -= 2 * epsilon;
+        double loss2 = model.Loss(X[0], Y[0]);
+
+        double num_dLoss_dBs = (loss1 - loss2) / (2 * epsilon);
+        cout << get<1>(dParam)[i] << endl;
+        cout << num_dLoss_dBs << endl;
+        cout << "Difference in derivatives: " << num_dLoss_dBs - get<1>(dParam)[i] << endl;
+
+        dense.biases[i] += epsilon;
+      }
+    }
+  }
+
+  void static h_test_2(vector<vector<vector<vector<double>>>> X, int Y[100]) {
+    Flatten flatten = Flatten();
+    Dense dense1 = Dense(8, 16);
+    Sigmoid sigmoid1 = Sigmoid();
+    Dense dense2 = Dense(3, 8);
+    Sigmoid sigmoid2 = Sigmoid();
+    ConvNet model = ConvNet(vector<Layer*>{&flatten, &dense1, &sigmoid1, &dense2, &sigmoid2});
+    // Do a forward pass with the first "image"
+    int label = model.predict(X[0]);
+    cout << label << endl;
+
+    if (!(label >= 0 && 10 > label)) {
+      throw(string) "Test failed! " + (string) __FUNCTION__;
+    }
+
+    vector<tuple<vector<vector<vector<double>>>, vector<double>>> dParam_per_layer = model._calc_dLoss_dParam(Y[0]);
+    // (L(W+h) - L(W-h))/(2*h)
+
+    for (int i = 0; i < dense1.num_out; i++) {
+      for (int j = 0; j < dense1.num_out; j++) {
+        if (!(i == 0 && j == 0) && (rand() % 100) < 30) {
+          continue;
+        } else {
+          tuple<vector<vector<vector<double>>>, vector<double>> dParam = dParam_per_layer[1];
+          double epsilon{.001};
+
+          // Might be better to loop over descreasing values of epsilon
+          dense1.weights[i][j][0] += epsilon;
+          double loss1 = model.Loss(X[0], Y[0]);
+
+          dense1.weights[i][j][0] -= 2 * epsilon;
+          double loss2 = model.Loss(X[0], Y[0]);
+
+          double num_dLoss_dWs = (loss1 - loss2) / (2 * epsilon);
+          cout << get<0>(dParam)[i][j][0] << endl;
+          cout << num_dLoss_dWs << endl;
+          cout << "Difference in derivatives: " << num_dLoss_dWs - get<0>(dParam)[i][j][0] << endl;
+
+          dense1.weights[i][j][0] += epsilon;
+        }
+      }
+    }
+  }
+
+  void static h_test_2_bias(vector<vector<vector<vector<double>>>> X, int Y[100]) {
+    Flatten flatten = Flatten();
+    Dense dense1 = Dense(8, 16);
+    Sigmoid sigmoid1 = Sigmoid();
+    Dense dense2 = Dense(3, 8);
+    Sigmoid sigmoid2 = Sigmoid();
+    ConvNet model = ConvNet(vector<Layer*>{&flatten, &dense1, &sigmoid1, &dense2, &sigmoid2});
+    // Do a forward pass with the first "image"
+    int label = model.predict(X[0]);
+    cout << label << endl;
+
+    if (!(label >= 0 && 10 > label)) {
+      throw(string) "Test failed! " + (string) __FUNCTION__;
+    }
+
+    vector<tuple<vector<vector<vector<double>>>, vector<double>>> dParam_per_layer = model._calc_dLoss_dParam(Y[0]);
+    // (L(b+h) - L(b-h))/(2*h)
+
+    for (int i = 0; i < dense1.num_out; i++) {
+      if (!(i == 0) && (rand() % 100) < 30) {
+        continue;
+      } else {
+        tuple<vector<vector<vector<double>>>, vector<double>> dParam = dParam_per_layer[1];
+        double epsilon{0.001};
+
+        // Might be better to loop over descreasing values of epsilon
+        dense1.biases[i] += epsilon;
+        double loss1 = model.Loss(X[0], Y[0]);
+
+        dense1.biases[i] -= 2 * epsilon;
+        double loss2 = model.Loss(X[0], Y[0]);
+
+        double num_dLoss_dBs = (loss1 - loss2) / (2 * epsilon);
+        cout << get<1>(dParam)[i] << endl;
+        cout << num_dLoss_dBs << endl;
+        cout << "Difference in derivatives: " << num_dLoss_dBs - get<1>(dParam)[i] << endl;
+
+        dense1.biases[i] += epsilon;
+      }
+    }
+  }
+
+  void static fit_test_1(vector<vector<vector<vector<double>>>> X, int Y[100]) {
+    Flatten flatten = Flatten();
+    Dense dense = Dense(3, 16);
+    Sigmoid sigmoid = Sigmoid();
+    ConvNet model = ConvNet(vector<Layer*>{&flatten, &dense, &sigmoid});
+
+    model.fit(X, Y);
+  }
+
+  void static fit_test_2(vector<vector<vector<vector<double>>>> X, int Y[100]) {
+    Flatten flatten = Flatten();
+    Dense dense1 = Dense(8, 16);
+    Sigmoid sigmoid1 = Sigmoid();
+    Dense dense2 = Dense(3, 8);
+    Sigmoid sigmoid2 = Sigmoid();
+    ConvNet model = ConvNet(vector<Layer*>{&flatten, &dense1, &sigmoid1, &dense2, &sigmoid2});
+
+    model.fit(X, Y);
+  }
+
+  // Every optimizer lowers the loss. Data, weights and minibatches are fixed, so that this does not
+  // depend on the run.
+  void static fit_optimizers_test() {
+    vector<vector<vector<vector<double>>>> X;
+    int Y[100];
+    fixed_examples(X, Y, 27);
+    SGD sgd = SGD(1.0);
+    Momentum momentum = Momentum(0.2, 0.9);
+    Momentum nesterov = Momentum(0.2, 0.9, true);
+    Adam adam = Adam(0.02);
+
+    for (Optimizer* optimizer : vector<Optimizer*>{&sgd, &momentum, &nesterov, &adam}) {
+      RngStream saved = Layer::init_stream();
+      Layer::seed_init(27);
+      Flatten flatten = Flatten();
+      Dense dense1 = Dense(8, 16);
+      Sigmoid sigmoid1 = Sigmoid();
+      Dense dense2 = Dense(3, 8);
+      Sigmoid sigmoid2 = Sigmoid();
+      Layer::init_stream() = saved;
+      ConvNet model = ConvNet(vector<Layer*>{&flatten, &dense1, &sigmoid1, &dense2, &sigmoid2});
+      MinibatchSampler sampler = MinibatchSampler(100, RngStream(27));
+      model.optimizer = optimizer;
+      model.sampler = &sampler;
+
+      double loss_before = model.TotalLoss(X, Y);
+      model.fit(X, Y);
+      double loss_after = model.TotalLoss(X, Y);
+
+      if (!(loss_after < loss_before)) {
+        throw(string) "Test failed! " + (string) __FUNCTION__;
+      }
+    }
+  }
+
+  // Data parallel training lowers the loss and keeps the copies identical. Data, weights and
+  // minibatches are fixed, so that this does not depend on the run.
+  void static fit_data_parallel_test() {
+    vector<vector<vector<vector<double>>>> X;
+    int Y[100];
+    fixed_examples(X, Y, 33);
+    RngStream saved = Layer::init_stream();
+    Layer::seed_init(33);
+    Flatten flatten = Flatten();
+    Dense dense1 = Dense(8, 16);
+    Sigmoid sigmoid1 = Sigmoid();
+    Dense dense2 = Dense(3, 8);
+    Sigmoid sigmoid2 = Sigmoid();
+    Layer::init_stream() = saved;
+    ConvNet model = ConvNet(vector<Layer*>{&flatten, &dense1, &sigmoid1, &dense2, &sigmoid2});
+    MinibatchSampler sampler = MinibatchSampler(100, RngStream(33));
+    model.sampler = &sampler;  // Forked with the model, so both ranks draw the same minibatches
+    double loss_before = model.TotalLoss(X, Y);
+
+    // Each forked rank trains its own copy of the model on half of every minibatch.
+    int failures = ShmAllreduce::launch(2, model.num_parameters(), [&](ShmAllreduce& comm) {
+      model.fit(X, Y, &comm);
+      if (!(model.TotalLoss(X, Y) < loss_before)) {
+        return 1;
+      }
+
+      // The copies must have stayed identical: the sum of the weights is world times our own.
+      vector<double> weights;
+      for (Dense* dense : {&dense2, &dense1}) {
+        for (auto& row : dense->weights) {
+          for (auto& w : row) {
+            weights.push_back(w[0]);
+          }
+        }
+        weights.insert(weights.end(), dense->biases.begin(), dense->biases.end());
+      }
+      vector<double> summed = weights;
+      comm.allreduce(summed);
+      for (int i = 0; i < weights.size(); i++) {
+        if (summed[i] != comm.world * weights[i]) {
+          return 1;
+        }
+      }
+      return 0;
+    });
+    if (failures != 0) {
+      throw(string) "Test failed! " + (string) __FUNCTION__;
+    }
+  }
+
+  // Central differences against the tape on a topology _calc_dLoss_dParam used to reject: a Conv
+  // and MaxPool stack, and two Dense layers without an activation in between.
+  void static tape_gradient_test() {
+    Conv conv = Conv(2, 2, {3, 3}, {1, 1});
+    Relu relu = Relu();
+    MaxPool pool = MaxPool(2);
+    Flatten flatten = Flatten();
+    Dense dense1 = Dense(4, 2 * 3 * 3);
+    Dense dense2 = Dense(3, 4);
+    Sigmoid sigmoid = Sigmoid();
+    ConvNet model = ConvNet(vector<Layer*>{&conv, &relu, &pool, &flatten, &dense1, &dense2, &sigmoid});
+
+    vector<vector<vector<double>>> x(2, vector<vector<double>>(8, vector<double>(8, 0)));
+    Layer::rand_init(x[0], 8, 8);
+    Layer::rand_init(x[1], 8, 8);
+    int y = 1;
+
+    model.h(x);
+    vector<tuple<vector<vector<vector<double>>>, vector<double>>> dParams = model._calc_dLoss_dParam(y);
+    if (dParams.size() != 3) {
+      throw(string) "Test failed! " + (string) __FUNCTION__;
+    }
+
+    double epsilon = 1e-6;
+    auto check = [&](double& param, double analytic) {
+      double saved = param;
+      param = saved + epsilon;
+      conv.pack();
+      double loss1 = model.Loss(x, y);
+      param = saved - epsilon;
+      conv.pack();
+      double loss2 = model.Loss(x, y);
+      param = saved;
+      conv.pack();
+      double numeric = (loss1 - loss2) / (2 * epsilon);
+      if (abs(numeric - analytic) > 1e-5 * max(1.0, abs(numeric))) {
+        throw(string) "Test failed! " + (string) __FUNCTION__;
+      }
+    };
+
+    for (int f = 0; f < 2; f++) {
+      for (int c = 0; c < 2; c++) {
+        for (int i = 0; i < 3; i++) {
+          check(conv.filters[f * 2 + c][i][2 - i], get<0>(dParams[2])[f * 2 + c][i][2 - i]);
+        }
+      }
+      check(conv.biases[f], get<1>(dParams[2])[f]);
+    }
+    for (int i = 0; i < 4; i++) {
+      check(dense1.weights[i][3 * i][0], get<0>(dParams[1])[i][3 * i][0]);
+      check(dense1.biases[i], get<1>(dParams[1])[i]);
+    }
+    for (int i = 0; i < 3; i++) {
+      check(dense2.weights[i][i][0], get<0>(dParams[0])[i][i][0]);
+      check(dense2.biases[i], get<1>(dParams[0])[i]);
+    }
+
+    // The buffers are reused: a second call neither grows them nor keeps the first gradient.
+    const double* buffer = get<1>(model.tape.dParams[0]).data();
+    model.h(x);
+    if (model._calc_dLoss_dParam(y) != dParams || get<1>(model.tape.dParams[0]).data() != buffer) {
+      throw(string) "Test failed! " + (string) __FUNCTION__;
+    }
+  }
+
+  // 100 4x4 examples, the same on every run, labelled by which of their first three pixels is the
+  // largest: data a small model learns, for tests whose outcome must not depend on main()'s.
+  void static fixed_examples(vector<vector<vector<vector<double>>>>& X, int Y[100], uint64_t seed) {
+    RngStream rng = RngStream(seed);
+    X.assign(100, {vector<vector<double>>(4, vector<double>(4, 0))});
+    for (int i = 0; i < 100; i++) {
+      for (vector<double>& row : X[i][0]) {
+        for (double& pixel : row) {
+          pixel = rng.uniform();
+        }
+      }
+      vector<double>& first = X[i][0][0];
+      Y[i] = max_element(first.begin(), first.begin() + 3) - first.begin();
+    }
+  }
+
+  // A pruned layer swapped for its SparseDense computes the same model, differentiates and trains
+  // like it, and training leaves the pruned weights at zero. Data, weights and minibatches are
+  // fixed, so that whether the loss goes down does not depend on the run.
+  void static sparse_dense_test() {
+    vector<vector<vector<vector<double>>>> X;
+    int Y[100];
+    fixed_examples(X, Y, 40);
+    RngStream saved = Layer::init_stream();
+    Layer::seed_init(40);
+    Flatten flatten = Flatten();
+    Dense dense1 = Dense(8, 16);
+    Sigmoid sigmoid1 = Sigmoid();
+    Dense dense2 = Dense(3, 8);
+    Sigmoid sigmoid2 = Sigmoid();
+    Layer::init_stream() = saved;
+    dense1.prune(0.75);
+    SparseDense sparse1 = SparseDense(dense1);
+    ConvNet pruned = ConvNet(vector<Layer*>{&flatten, &dense1, &sigmoid1, &dense2, &sigmoid2});
+    ConvNet model = ConvNet(vector<Layer*>{&flatten, &sparse1, &sigmoid1, &dense2, &sigmoid2});
+
+    vector<vector<vector<double>>> output = model.h(X[0]);
+    vector<vector<vector<double>>> expected = pruned.h(X[0]);
+    for (int i = 0; i < 3; i++) {
+      if (abs(output[i][0][0] - expected[i][0][0]) > 1e-12) {
+        throw(string) "Test failed! " + (string) __FUNCTION__;
+      }
+    }
+    if (sparse1.nnz() != 32 || model.num_parameters() != pruned.num_parameters() - 16 * 8 + 32) {
+      throw(string) "Test failed! " + (string) __FUNCTION__;
+    }
+
+    vector<vector<double>> dValues = get<0>(model._calc_dLoss_dParam(Y[0])[1])[0];
+    vector<vector<vector<double>>> dWeights = get<0>(pruned._calc_dLoss_dParam(Y[0])[1]);
+    for (int i = 0; i < 8; i++) {
+      for (int k = sparse1.row_start[i]; k < sparse1.row_start[i + 1]; k++) {
+        if (abs(dValues[0][k] - dWeights[i][sparse1.columns[k]][0]) > 1e-12) {
+          throw(string) "Test failed! " + (string) __FUNCTION__;
+        }
+      }
+    }
+
+    vector<int> columns = sparse1.columns;
+    double loss_before = model.TotalLoss(X, Y);
+    MinibatchSampler sampler = MinibatchSampler(100, RngStream(40));
+    model.sampler = &sampler;
+    model.fit(X, Y);
+    if (!(model.TotalLoss(X, Y) < loss_before) || sparse1.columns != columns || sparse1.nnz() != 32) {
+      throw(string) "Test failed! " + (string) __FUNCTION__;
+    }
+  }
+
+  // The rewrites of compile(): what they produce, that it computes and trains like the layers as
+  // given, and that a rewrite changing the function is discarded.
+  void static optimize_test() {
+    Conv conv = Conv(2, 3, {3, 3, 3}, {1, 1, 1});
+    Relu relu1 = Relu();
+    Relu relu2 = Relu();
+    MaxPool pool = MaxPool(2);
+    MaxPool unit_pool = MaxPool(1);
+    Flatten flatten1 = Flatten();
+    Dense dense1 = Dense(8, 3 * 4 * 4);
+    Dense dense2 = Dense(3, 8);
+    Flatten flatten2 = Flatten();
+    Sigmoid sigmoid = Sigmoid();
+    vector<Layer*> layers = {&conv, &relu1, &relu2, &pool, &unit_pool, &flatten1, &dense1, &dense2, &flatten2};
+    layers.push_back(&sigmoid);
+
+    vector<vector<vector<double>>> x(2, vector<vector<double>>(10, vector<double>(10, 0)));
+    Layer::rand_init(x[0], 10, 10);
+    Layer::rand_init(x[1], 10, 10);
+
+    ConvNet reference = ConvNet(layers);
+    reference.optimize_graph = false;
+    vector<vector<vector<double>>> expected = reference.h(x);
+    auto expected_dParams = reference._calc_dLoss_dParam(1);
+
+    ConvNet model = ConvNet(layers);
+    vector<vector<vector<double>>> output = model.h(x);
+    if (model.layers != vector<Layer*>{&conv, &pool, &relu1, &flatten1, &dense1, &dense2, &sigmoid} ||
+        output != expected || model._calc_dLoss_dParam(1) != expected_dParams) {
+      throw(string) "Test failed! " + (string) __FUNCTION__;
+    }
+
+    ConvNet folded = ConvNet(layers);
+    folded.fold_linear = true;
+    output = folded.h(x);
+    if (folded.layers.size() != 6 || folded.folded_layers.size() != 1 ||
+        folded.layers[4] != folded.folded_layers[0].get()) {
+      throw(string) "Test failed! " + (string) __FUNCTION__;
+    }
+    for (int i = 0; i < 3; i++) {
+      if (abs(output[i][0][0] - expected[i][0][0]) > 1e-12) {
+        throw(string) "Test failed! " + (string) __FUNCTION__;
+      }
+    }
+
+    // Checkpointed models keep their layer count: the activations only move past both pools.
+    ConvNet checkpointed = ConvNet(layers);
+    checkpointed.checkpoint({5});
+    checkpointed.h(x);
+    if (checkpointed.layers !=
+        vector<Layer*>{&conv, &pool, &unit_pool, &relu1, &relu2, &flatten1, &dense1, &dense2, &flatten2, &sigmoid}) {
+      throw(string) "Test failed! " + (string) __FUNCTION__;
+    }
+
+    // An activation wrongly declared monotonic: moving it changes the output, so nothing is moved.
+    class Negate : public Act {
+     public:
+      double activation_func(double z) const { return -z; }
+      double activation_func_derivative(double /*z*/) const { return -1; }
+      bool monotonic() const override { return true; }
+    };
+    Negate negate = Negate();
+    ConvNet wrong = ConvNet(vector<Layer*>{&conv, &negate, &pool});
+    wrong.h(x);
+    if (wrong.layers != wrong.source_layers) {
+      throw(string) "Test failed! " + (string) __FUNCTION__;
+    }
+  }
+
+  void static checkpoint_test() {
+    Conv conv1 = Conv(1, 2, {3, 3}, {1, 1});
+    Relu relu1 = Relu();
+    Conv conv2 = Conv(2, 2, {3, 3}, {1, 1});
+    Relu relu2 = Relu();
+    MaxPool pool = MaxPool(2);
+    Flatten flatten = Flatten();
+    Dense dense1 = Dense(6, 2 * 3 * 3);
+    Sigmoid sigmoid1 = Sigmoid();
+    Dense dense2 = Dense(3, 6);
+    Sigmoid sigmoid2 = Sigmoid();
+    ConvNet model = ConvNet(
+        vector<Layer*>{&conv1, &relu1, &conv2, &relu2, &pool, &flatten, &dense1, &sigmoid1, &dense2, &sigmoid2});
+
+    vector<vector<vector<double>>> x(1, vector<vector<double>>(10, vector<double>(10, 0)));
+    Layer::rand_init(x[0], 10, 10);
+
+    model.h(x);
+    vector<tuple<vector<vector<vector<double>>>, vector<double>>> expected = model._calc_dLoss_dParam(2);
+
+    // 10 layers: segments of 4, 4 and 2 layers, so only 3 activations are stored.
+    model.checkpoint_sqrt();
+    if (model.segment_starts != vector<int>{0, 4, 8}) {
+      throw(string) "Test failed! " + (string) __FUNCTION__;
+    }
+    model.h(x);
+    int stored = 0;
+    for (Tensor& feature_map : model.context.a) {
+      stored += feature_map.size() > 0;
+    }
+    if (stored != 3 || model._calc_dLoss_dParam(2) != expected) {
+      throw(string) "Test failed! " + (string) __FUNCTION__;
+    }
+
+    model.checkpoint({5});
+    model.h(x);
+    if (model._calc_dLoss_dParam(2) != expected) {
+      throw(string) "Test failed! " + (string) __FUNCTION__;
+    }
+  }
+
+  // 16-bit activations: the same forward pass, a quarter of the stored bytes, and gradients that
+  // differ from the double ones only by the rounding of the activations. Weights and input are
+  // fixed, with input values 0.02 apart: random ones can let the rounding tie or reorder a MaxPool
+  // window, which moves its gradient to another input.
+  void static reduced_precision_test() {
+    RngStream saved = Layer::init_stream();
+    Layer::seed_init(46);
+    Conv conv = Conv(1, 3, {3, 3, 3}, {1, 1, 1});
+    Relu relu = Relu();
+    MaxPool pool = MaxPool(2);
+    Flatten flatten = Flatten();
+    Dense dense1 = Dense(8, 3 * 4 * 4);
+    Sigmoid sigmoid1 = Sigmoid();
+    Dense dense2 = Dense(3, 8);
+    Sigmoid sigmoid2 = Sigmoid();
+    ConvNet model =
+        ConvNet(vector<Layer*>{&conv, &relu, &pool, &flatten, &dense1, &sigmoid1, &dense2, &sigmoid2});
+
+    Layer::init_stream() = saved;
+
+    vector<vector<vector<double>>> x(1, vector<vector<double>>(10, vector<double>(10, 0)));
+    for (int i = 0; i < 10; i++) {
+      for (int j = 0; j < 10; j++) {
+        x[0][i][j] = (i * 10 + j) * 37 % 100 / 50.0 - 1;
+      }
+    }
+    vector<vector<vector<double>>> output = model.h(x);
+    vector<tuple<vector<vector<vector<double>>>, vector<double>>> expected = model._calc_dLoss_dParam(1);
+
+    for (Precision precision : {Precision::BF16, Precision::FP16}) {
+      model.store_activations(precision);
+      if (model.h(x) != output) {
+        throw(string) "Test failed! " + (string) __FUNCTION__;
+      }
+      vector<int> shape = model.input_shape;
+      for (int L = 0; L + 1 < model.layers.size(); L++) {
+        shape = output_shape(model.layers[L], shape);
+        if (model.context.a[L].data.capacity() != 0 ||
+            model.context.packed[L].data.size() != shape[0] * shape[1] * shape[2]) {
+          throw(string) "Test failed! " + (string) __FUNCTION__;
+        }
+      }
+
+      // Each layer's gradient, weights and biases together, within a relative L2 error.
+      double tolerance = precision == Precision::BF16 ? 2e-2 : 2e-3;
+      vector<tuple<vector<vector<vector<double>>>, vector<double>>> dParams = model._calc_dLoss_dParam(1);
+      for (int p = 0; p < dParams.size(); p++) {
+        double error = 0, norm = 0;
+        auto& weights = get<0>(dParams[p]);
+        auto& expected_weights = get<0>(expected[p]);
+        for (int i = 0; i < weights.size(); i++) {
+          for (int j = 0; j < weights[i].size(); j++) {
+            for (int k = 0; k < weights[i][j].size(); k++) {
+              error += pow(weights[i][j][k] - expected_weights[i][j][k], 2);
+              norm += pow(expected_weights[i][j][k], 2);
+            }
+          }
+        }
+        for (int i = 0; i < get<1>(dParams[p]).size(); i++) {
+          error += pow(get<1>(dParams[p])[i] - get<1>(expected[p])[i], 2);
+          norm += pow(get<1>(expected[p])[i], 2);
+        }
+        if (sqrt(error) > tolerance * sqrt(norm)) {
+          throw(string) "Test failed! " + (string) __FUNCTION__;
+        }
+      }
+    }
+
+    // With checkpointing, only the segment boundaries are stored, in 16 bits.
+    model.checkpoint({4});
+    model.store_activations(Precision::BF16);
+    model.h(x);
+    int packed = 0;
+    for (PackedTensor& stored : model.context.packed) {
+      packed += !stored.empty();
+    }
+    model._calc_dLoss_dParam(1);
+    model.store_activations(Precision::Double);
+    model.h(x);
+    if (packed != 1 || model._calc_dLoss_dParam(1) != expected) {
+      throw(string) "Test failed! " + (string) __FUNCTION__;
+    }
+  }
+
+  // The same model in both layouts: equal outputs and gradients, with and without a Flatten.
+  void static channels_last_test() {
+    Conv conv1 = Conv(3, 6, vector<int>(6, 3), vector<int>(6, 1), Conv::same);
+    Relu relu1 = Relu();
+    Conv conv2 = Conv(6, 5, vector<int>(5, 3), vector<int>(5, 2));
+    Relu relu2 = Relu();
+    MaxPool pool = MaxPool(2);
+    Flatten flatten = Flatten();
+    Dense dense = Dense(4, 5 * 2 * 2);
+    Sigmoid sigmoid = Sigmoid();
+
+    vector<vector<vector<double>>> x(3, vector<vector<double>>(11, vector<double>(10, 0)));
+    for (int c = 0; c < 3; c++) {
+      Layer::rand_init(x[c], 11, 10);
+    }
+
+    vector<vector<Layer*>> models = {{&conv1, &relu1, &conv2, &relu2, &pool, &flatten, &dense, &sigmoid},
+                                     {&conv1, &relu1, &conv2, &relu2, &pool}};
+    for (vector<Layer*>& layers : models) {
+      ConvNet model = ConvNet(layers);
+      vector<vector<vector<double>>> expected = model.h(x);
+      vector<tuple<vector<vector<vector<double>>>, vector<double>>> expected_dParams = model._calc_dLoss_dParam(1);
+
+      model.layout = Layout::HWC;
+      vector<vector<vector<double>>> output = model.h(x);
+      vector<tuple<vector<vector<vector<double>>>, vector<double>>> dParams = model._calc_dLoss_dParam(1);
+      if (model.context.a[0].layout != Layout::HWC || model.context.a.back().layout != Layout::CHW) {
+        throw(string) "Test failed! " + (string) __FUNCTION__;
+      }
+
+      vector<double> flat_expected, flat;
+      _pack_dParams(expected_dParams, flat_expected);
+      _pack_dParams(dParams, flat);
+      Tensor expected_output = Tensor::from_nested(expected);
+      Tensor actual_output = Tensor::from_nested(output);
+      flat_expected.insert(flat_expected.end(), expected_output.data.begin(), expected_output.data.end());
+      flat.insert(flat.end(), actual_output.data.begin(), actual_output.data.end());
+      for (int i = 0; i < flat.size(); i++) {
+        if (abs(flat[i] - flat_expected[i]) > 1e-9) {
+          throw(string) "Test failed! " + (string) __FUNCTION__;
+        }
+      }
+    }
+  }
+
+  // Flatten hands the producer's buffer to Dense: no copies, and no allocations after the first pass.
+  // The Conv output it consumed is left empty.
+  void static flatten_view_test() {
+    Conv conv = Conv(2, 3, vector<int>(3, 3), vector<int>(3, 1));
+    Flatten flatten = Flatten();
+    Dense dense = Dense(4, 3 * 6 * 6);
+    ConvNet model = ConvNet(vector<Layer*>{&conv, &flatten, &dense});
+
+    vector<vector<vector<double>>> x(2, vector<vector<double>>(8, vector<double>(8, 0)));
+    Layer::rand_init(x[0], 8, 8);
+    Layer::rand_init(x[1], 8, 8);
+    model.h(x);  // Compiles, which may change the convolution algorithm
+    vector<vector<vector<double>>> expected = dense.h(Flatten::f(conv.h(x)));
+    model.h(x);  // Conv and Flatten alternate between two buffers from the second pass on
+    vector<vector<double>> gradient = get<0>(model._calc_dLoss_dParam(0)[1])[1];
+    set<const double*> buffers = {model.context.a[0].data.data(), model.context.a[1].data.data()};
+    for (int i = 0; i < 3; i++) {
+      const double* conv_output = model.context.a[0].data.data();  // Conv writes into this buffer
+      vector<vector<vector<double>>> output = model.h(x);
+      const double* dense_input = model.context.a[1].data.data();
+      if (output != expected || model.context.a[1].shape() != vector<int>{3 * 6 * 6, 1, 1} ||
+          model.context.a[0].size() != 0 || dense_input != conv_output ||
+          set<const double*>{model.context.a[0].data.data(), dense_input} != buffers ||
+          get<0>(model._calc_dLoss_dParam(0)[1])[1] != gradient) {
+        throw(string) "Test failed! " + (string) __FUNCTION__;
+      }
+    }
+  }
+
+  void static autotune_test() {
+    string saved_path = Autotuner::cache_path;
+    Autotuner::cache_path = (filesystem::temp_directory_path() / "cnn_autotune_test_cache").string();
+    filesystem::remove(Autotuner::cache_path);
+    Autotuner::reload();
+
+    Conv conv = Conv(2, 3, {3, 3, 3}, {1, 1, 1});
+    Relu relu = Relu();
+    MaxPool pool = MaxPool(2);
+    Flatten flatten = Flatten();
+    Dense dense = Dense(4, 3 * 5 * 5);
+    ConvNet model = ConvNet(vector<Layer*>{&conv, &relu, &pool, &flatten, &dense});
+
+    vector<vector<vector<double>>> x(2, vector<vector<double>>(12, vector<double>(12, 0)));
+    Layer::rand_init(x[0], 12, 12);
+    Layer::rand_init(x[1], 12, 12);
+    vector<vector<vector<double>>> untuned = model.h(x);
+
+    int benchmarks_before = Autotuner::benchmarks_run;
+    model.compile({2, 12, 12}, true);
+    if (Autotuner::benchmarks_run == benchmarks_before) {
+      throw(string) "Test failed! " + (string) __FUNCTION__;
+    }
+    vector<vector<vector<double>>> tuned = model.h(x);
+    for (int i = 0; i < tuned.size(); i++) {
+      if (abs(tuned[i][0][0] - untuned[i][0][0]) > 1e-9) {
+        throw(string) "Test failed! " + (string) __FUNCTION__;
+      }
+    }
+
+    // A later run with the same shapes reads the choices back instead of benchmarking.
+    ConvTiling conv_tiling = conv.tiling;
+    DenseTiling dense_tiling = dense.tiling;
+    conv.tiling = ConvTiling();
+    dense.tiling = DenseTiling();
+    Autotuner::reload();
+    benchmarks_before = Autotuner::benchmarks_run;
+    model.compile({2, 12, 12}, true);
+    if (Autotuner::benchmarks_run != benchmarks_before || conv.tiling.tile_rows != conv_tiling.tile_rows ||
+        conv.tiling.tile_cols != conv_tiling.tile_cols || conv.tiling.unroll != conv_tiling.unroll ||
+        dense.tiling.block_in != dense_tiling.block_in || dense.tiling.unroll != dense_tiling.unroll) {
+      throw(string) "Test failed! " + (string) __FUNCTION__;
+    }
+
+    filesystem::remove(Autotuner::cache_path);
+    Autotuner::cache_path = saved_path;
+    Autotuner::reload();
+  }
+
+  void static concurrent_inference_test() {
+    Conv conv = Conv(1, 4, {3, 3, 3, 3}, {1, 1, 1, 1});
+    Relu relu = Relu();
+    MaxPool pool = MaxPool(2);
+    Flatten flatten = Flatten();
+    Dense dense = Dense(10, 4 * 5 * 5);
+    Sigmoid sigmoid = Sigmoid();
+    ConvNet model = ConvNet(vector<Layer*>{&conv, &relu, &pool, &flatten, &dense, &sigmoid});
+    model.compile({1, 12, 12}, false);
+
+    vector<vector<vector<vector<double>>>> images(16, {vector<vector<double>>(12, vector<double>(12, 0))});
+    vector<vector<vector<vector<double>>>> expected;
+    vector<int> expected_labels;
+    for (auto& image : images) {
+      Layer::rand_init(image[0], 12, 12);
+      expected.push_back(model.h(image));
+      expected_labels.push_back(model.predict(image));
+    }
+
+    // One shared model, one context per thread.
+    atomic<int> mismatches{0};
+    vector<thread> threads;
+    for (int t = 0; t < 4; t++) {
+      threads.emplace_back([&]() {
+        ExecutionContext ctx;
+        for (int rep = 0; rep < 25; rep++) {
+          for (int i = 0; i < images.size(); i++) {
+            if (model.h(images[i], ctx) != expected[i] || model.predict(images[i], ctx) != expected_labels[i]) {
+              mismatches++;
+            }
+          }
+        }
+      });
+    }
+    for (thread& t : threads) {
+      t.join();
+    }
+
+    if (mismatches != 0) {
+      throw(string) "Test failed! " + (string) __FUNCTION__;
+    }
+  }
+
+  // Once warmed up, inference and training steps allocate nothing, whatever the convolution
+  // algorithm, pooling, layout or checkpointing; h() allocates exactly the nested vectors it returns.
+  // Only counts with -DCNN_ALLOCATION_HOOK, and does nothing otherwise.
+  void static allocation_test() {
+#ifdef CNN_ALLOCATION_HOOK
+    {
+      AllocationScope scope;
+      vector<double>* v = new vector<double>(100);
+      delete v;
+      if (scope.allocations() != 2 || scope.bytes() != sizeof(vector<double>) + 100 * sizeof(double)) {
         throw(string) "Test failed! " + (string) __FUNCTION__;
       }
     }
 
-    vector<vector<vector<double>>> a2{{{1}}, {{2}}, {{3}}};
-
-    Dense d2 = Dense(5, 3);
-    d2.weights = {{{1}, {1}, {0}}, {{0}, {1}, {3}}, {{0}, {0}, {1}}, {{1}, {0}, {0}}, {{0}, {2}, {0}}};
-    d2.biases = {0, 0, 0, 0, 0};
+    vector<vector<vector<vector<double>>>> X(8, {vector<vector<double>>(10, vector<double>(10, 0))});
+    int Y[8];
+    for (int i = 0; i < 8; i++) {
+      Layer::rand_init(X[i][0], 10, 10);
+      Y[i] = i % 3;
+    }
+    vector<int> batch = {0, 3, 5};
+
+    for (int variant = 0; variant < 7; variant++) {
+      Conv conv = Conv(1, 4, vector<int>(4, 3), vector<int>(4, 1));
+      Relu relu = Relu();
+      MaxPool max_pool = MaxPool(2);
+      AvgPool avg_pool = AvgPool(2);
+      Pool* pool = variant == 6 ? (Pool*)&avg_pool : &max_pool;
+      Flatten flatten = Flatten();
+      Dense dense = Dense(3, 4 * 4 * 4);
+      Sigmoid sigmoid = Sigmoid();
+      ConvNet model = ConvNet(vector<Layer*>{&conv, &relu, pool, &flatten, &dense, &sigmoid});
+      vector<ConvAlgorithm> algorithms = {ConvAlgorithm::Direct, ConvAlgorithm::Gemm, ConvAlgorithm::Winograd,
+                                          ConvAlgorithm::Fft};
+      if (variant < algorithms.size()) {
+        conv.forced_algorithm = algorithms[variant];
+      } else if (variant == 4) {
+        model.layout = Layout::HWC;
+      } else if (variant == 5) {
+        model.checkpoint_sqrt();
+      }
+      Adam adam = Adam(0.01);  // The optimizer with the most state
+      ExecutionContext ctx;
+      model.compile({1, 10, 10}, false);
+
+      for (int warmup = 0; warmup < 2; warmup++) {
+        model.predict(X[0]);
+        model.predict(X[1], ctx);
+        model._calc_dLoss_dParam(Y[1]);
+        model.fit_step(X, Y, batch, adam);
+      }
 
-    vector<vector<vector<double>>> output2 = d2.h(a2);
-    vector<vector<vector<double>>> expected_output2 = {{{3}}, {{11}}, {{3}}, {{1}}, {{4}}};
-    for (int i = 0; i < output2.size(); i++) {
-      if (output2[i][0][0] != expected_output2[i][0][0]) {
+      long inference, gradient, step, nested;
+      {
+        AllocationScope scope;
+        model.predict(X[2]);
+        model.predict(X[3], ctx);
+        inference = scope.allocations();
+      }
+      {
+        AllocationScope scope;
+        model.predict(X[4]);
+        model._calc_dLoss_dParam(Y[4]);
+        gradient = scope.allocations();
+      }
+      {
+        AllocationScope scope;
+        model.fit_step(X, Y, batch, adam);
+        step = scope.allocations();
+      }
+      {
+        AllocationScope scope;
+        model.h(X[5]);
+        nested = scope.allocations();
+      }
+      if (inference != 0 || gradient != 0 || step != 0 || nested != 1 + 3 + 3) {
         throw(string) "Test failed! " + (string) __FUNCTION__;
       }
     }
 
-    vector<vector<vector<double>>> a3{{{1}}, {{2}}, {{3}}};
+    // Pooling with an argmax output into outputs that already have their size, and drawing a
+    // minibatch into a vector that does.
+    MaxPool pool = MaxPool(3, 3, 2);
+    Tensor in = Tensor::from_nested(X[0]), out;
+    vector<size_t> argmax;
+    pool.forward(in, out, &argmax);
+    MinibatchSampler sampler = MinibatchSampler(1000, RngStream(1));
+    vector<int> minibatch;
+    sampler.next(32, minibatch);
+    AllocationScope scope;
+    pool.forward(in, out, &argmax);
+    sampler.next(32, minibatch);
+    if (scope.allocations() != 0) {
+      throw(string) "Test failed! " + (string) __FUNCTION__;
+    }
+#endif
+  }
 
-    Dense d3 = Dense(5, 3);
-    d3.weights = {{{1}, {1}, {0}}, {{0}, {1}, {3}}, {{0}, {0}, {1}}, {{1}, {0}, {0}}, {{0}, {2}, {0}}};
-    d3.biases = {1, 1, 1, 2, -1};
+  void static profile_test(vector<vector<vector<vector<double>>>> X, int Y[100]) {
+    Flatten flatten = Flatten();
+    Dense dense = Dense(3, 16);
+    Sigmoid sigmoid = Sigmoid();
+    ConvNet model = ConvNet(vector<Layer*>{&flatten, &dense, &sigmoid});
 
-    vector<vector<vector<double>>> output3 = d3.h(a3);
-    vector<vector<vector<double>>> expected_output3 = {{{4}}, {{12}}, {{4}}, {{3}}, {{3}}};
-    for (int i = 0; i < output2.size(); i++) {
-      cout << output3[i][0][0] << endl;
-      if (output3[i][0][0] != expected_output3[i][0][0]) {
+    Profiler::clear();
+    model.predict(X[0]);  // Not recorded
+    Profiler::enabled = true;
+    model.predict(X[0]);
+    model.predict(X[1]);
+    model._calc_dLoss_dParam(Y[1]);
+    Profiler::enabled = false;
+
+#ifndef CNN_NO_PROFILING
+    // The backward pass stops at the first layer with parameters, so Flatten has no backward record.
+    if (Profiler::records.size() != 3 * 2 + 2) {
+      throw(string) "Test failed! " + (string) __FUNCTION__;
+    }
+    for (ProfileRecord& r : Profiler::records) {
+      if (r.layer == "Dense" && r.phase == "forward" && r.flops != 2 * 3 * 16) {
         throw(string) "Test failed! " + (string) __FUNCTION__;
       }
     }
+    if (Profiler::records.back().layer != "Dense" || Profiler::records.back().phase != "backward") {
+      throw(string) "Test failed! " + (string) __FUNCTION__;
+    }
+
+    Profiler::summary();
+    stringstream trace;
+    Profiler::write_chrome_trace(trace);
+    if (trace.str().find("\"traceEvents\"") == string::npos || trace.str().find("Dense[1]") == string::npos) {
+      throw(string) "Test failed! " + (string) __FUNCTION__;
+    }
+#else
+    if (!Profiler::records.empty()) {
+      throw(string) "Test failed! " + (string) __FUNCTION__;
+    }
+#endif
+    Profiler::clear();
   }
 };
 
-class ConvNet {
+// Runs a stack of Conv, Act and Pool layers over images too large to hold every layer's output
+// at once. The work goes in horizontal strips of strip_rows rows of the last layer's output. A
+// strip reads only the input rows it depends on, halo included, and every layer computes only the
+// rows the layer after it reads. Halo rows are recomputed by the neighbouring strips. Memory is one
+// strip per layer rather than one image per layer, and the input comes from a callback, so it does
+// not have to be in memory either. Conv layers run the Direct kernel on channel-major strips, so
+// the output is exactly that of a whole-image pass with the Direct kernel.
+class StripStream {
  public:
-  vector<Layer*> layers;
-  vector<vector<vector<vector<double>>>> a;
-  map<int, int> layer_map;
+  // read(begin, end, strip) fills strip with rows [begin, end) of every input channel, CHW.
+  using RowReader = function<void(int begin, int end, Tensor& strip)>;
+  // write(begin, strip) receives rows [begin, begin + strip.height) of the output.
+  using StripWriter = function<void(int begin, const Tensor& strip)>;
 
-  ConvNet(vector<Layer*> layers) { this->layers = layers; }
+  vector<Layer*> layers;
+  vector<vector<int>> shapes;  // shapes[L] is the input shape of layers[L]; shapes.back() the output
+  int strip_rows;
 
-  vector<vector<vector<double>>> h(vector<vector<vector<double>>> x) {
-    a.clear();  // Start with an empty vector of activations
+  StripStream(const vector<Layer*>& layers, const vector<int>& input_shape, int strip_rows) {
+    if (strip_rows < 1) {
+      throw(string) "Strips must have at least one row!";
+    }
+    this->layers = layers;
+    this->strip_rows = strip_rows;
+    shapes = {input_shape};
+    for (Layer* layer : layers) {
+      if (!dynamic_cast<Conv*>(layer) && !dynamic_cast<Act*>(layer) && !dynamic_cast<Pool*>(layer)) {
+        throw(string) "StripStream runs only Conv, Act and Pool layers!";
+      }
+      shapes.push_back(ConvNet::output_shape(layer, shapes.back()));
+    }
+    strips.resize(layers.size() + 1);
+  }
 
-    vector<vector<vector<double>>> feature_map = x;
-    // as.push_back(a);
+  const vector<int>& output_shape() const { return shapes.back(); }
 
-    int l = 0;
-    for (int L = 0; L < layers.size(); L++) {
-      Layer* layer = layers[L];
+  void run(const RowReader& read, const StripWriter& write) {
+    vector<pair<int, int>> rows(layers.size() + 1);  // Rows of every layer's input, and of the output
+    for (int begin = 0; begin < shapes.back()[1]; begin += strip_rows) {
+      rows.back() = {begin, min(shapes.back()[1], begin + strip_rows)};
+      for (int L = layers.size() - 1; L >= 0; L--) {
+        rows[L] = _input_rows(L, rows[L + 1]);
+      }
 
-      vector<vector<vector<double>>> z = feature_map;
-      if (Conv* conv = dynamic_cast<Conv*>(layer)) {
-        feature_map = conv->h(z);
-        layer_map[l] = L;
-        l++;
-      } else if (MaxPool* pool = dynamic_cast<MaxPool*>(layer)) {
-        feature_map = pool->h(z);
-      } else if (Act* act = dynamic_cast<Act*>(layer)) {
-        feature_map = act->h(z);
-      } else if (Flatten* flatten = dynamic_cast<Flatten*>(layer)) {
-        feature_map = flatten->f(z);
-      } else if (Dense* dense = dynamic_cast<Dense*>(layer)) {
-        feature_map = dense->h(z);
-        layer_map[l] = L;
-        l++;
+      read(rows[0].first, rows[0].second, strips[0]);
+      if (!strips[0].has_shape({shapes[0][0], rows[0].second - rows[0].first, shapes[0][2]}) ||
+          strips[0].layout != Layout::CHW) {
+        throw(string) "StripStream reader returned a strip of the wrong shape!";
       }
+      for (int L = 0; L < layers.size(); L++) {
+        _forward_strip(L, rows[L + 1], strips[L], strips[L + 1]);
+      }
+      write(begin, strips.back());
+    }
+  }
 
-      a.push_back(feature_map);
+  // The whole-image version, for inputs that fit in memory: output is written strip by strip.
+  void run(const Tensor& input, Tensor& output) {
+    if (!input.has_shape(shapes[0]) || input.layout != Layout::CHW) {
+      throw(string) "StripStream input has the wrong shape!";
     }
+    output.resize(shapes.back()[0], shapes.back()[1], shapes.back()[2]);
+    output.layout = Layout::CHW;
+    run([&](int begin, int end, Tensor& strip) { read_rows(input, begin, end, strip); },
+        [&](int begin, const Tensor& strip) { _copy_rows(strip, 0, output, begin, strip.height); });
+  }
 
-    return feature_map;
+  // A RowReader over a CHW tensor in memory.
+  void static read_rows(const Tensor& input, int begin, int end, Tensor& strip) {
+    strip.resize(input.channels, end - begin, input.width);
+    strip.layout = Layout::CHW;
+    _copy_rows(input, begin, strip, 0, end - begin);
   }
 
-  int predict(vector<vector<vector<double>>> x) {
-    vector<vector<vector<double>>> feature_map = h(x);
+  // Doubles held by the strip buffers, the input strip included.
+  size_t buffered() const {
+    size_t total = 0;
+    for (const Tensor& strip : strips) {
+      total += strip.data.capacity();
+    }
+    return total;
+  }
 
-    // Take argmax of the output
-    int label = 0;
-    // cout << feature_map[0][0][0] << ",";
-    for (int i = 1; i < feature_map.size(); i++) {
-      // cout << feature_map[i][0][0] << ",";
-      if (feature_map[label][0][0] < feature_map[i][0][0]) {
-        label = i;
+  void static strip_test() {
+    Conv conv1 = Conv(2, 3, {3, 3, 3}, {1, 1, 1}, Conv::same);
+    Relu relu = Relu();
+    MaxPool pool = MaxPool(2);
+    Conv conv2 = Conv(3, 4, {3, 3, 3, 3}, {2, 2, 2, 2}, 1);
+    Sigmoid sigmoid = Sigmoid();
+    vector<Layer*> layers = {&conv1, &relu, &pool, &conv2, &sigmoid};
+
+    Tensor input;
+    input.resize(2, 61, 23);
+    for (double& value : input.data) {
+      value = (double)rand() / RAND_MAX * 2 - 1;
+    }
+    Tensor expected;
+    ConvNet::_run(layers, input, expected);
+
+    for (int strip_rows : {1, 3, 40}) {
+      StripStream stream = StripStream(layers, input.shape(), strip_rows);
+      Tensor output;
+      stream.run(input, output);
+      if (output.shape() != expected.shape() || output.data != expected.data) {
+        throw(string) "Test failed! " + (string) __FUNCTION__;
       }
     }
-    // cout << endl;
 
-    return label;
+    // Small strips keep a fraction of the whole-image buffers, and read each input row a bounded
+    // number of times.
+    StripStream stream = StripStream(layers, input.shape(), 2);
+    int rows_read = 0;
+    Tensor output;
+    output.resize(4, 15, 6);
+    stream.run(
+        [&](int begin, int end, Tensor& strip) {
+          rows_read += end - begin;
+          read_rows(input, begin, end, strip);
+        },
+        [&](int begin, const Tensor& strip) { _copy_rows(strip, 0, output, begin, strip.height); });
+    size_t whole = 0;
+    for (vector<int>& shape : stream.shapes) {
+      whole += shape[0] * shape[1] * shape[2];
+    }
+    if (output.data != expected.data || stream.buffered() * 3 > whole || rows_read > 2 * input.height) {
+      throw(string) "Test failed! " + (string) __FUNCTION__;
+    }
   }
 
-  void fit(vector<vector<vector<vector<double>>>> X, int Y[]) {
-    /* Fit function.
+ private:
+  vector<Tensor> strips;  // strips[L] holds the rows of layers[L]'s input; strips.back() the output
+
+  // The input rows of layers[L] that its output rows [out.first, out.second) read, inside the
+  // input. Conv padding rows are not included.
+  pair<int, int> _input_rows(int L, pair<int, int> out) const {
+    Layer* layer = layers[L];
+    if (Conv* conv = dynamic_cast<Conv*>(layer)) {
+      int top = conv->pads(shapes[L][1], shapes[L][2])[0];
+      int stride = conv->stride_per_filter[0];
+      int k = conv->size_per_filter[0];
+      return {max(0, out.first * stride - top), min(shapes[L][1], (out.second - 1) * stride - top + k)};
+    } else if (Pool* pool = dynamic_cast<Pool*>(layer)) {
+      return {out.first * pool->stride, (out.second - 1) * pool->stride + pool->height};
+    }
+    return out;
+  }
 
-    This is the gradient descent function.
+  void _forward_strip(int L, pair<int, int> out_rows, const Tensor& in, Tensor& out) const {
+    Layer* layer = layers[L];
+    if (Conv* conv = dynamic_cast<Conv*>(layer)) {
+      array<int, 4> pad = conv->pads(shapes[L][1], shapes[L][2]);
+      // Padding rows above the strip exist only at the top of the image.
+      pad[0] = max(0, pad[0] - out_rows.first * conv->stride_per_filter[0]);
+      out.resize(conv->num_filters, out_rows.second - out_rows.first, shapes[L + 1][2]);
+      out.layout = Layout::CHW;
+      for (int f = 0; f < conv->num_filters; f++) {
+        fill(out.plane(f), out.plane(f) + out.height * out.width, conv->biases[f]);
+      }
+      conv->_forward_direct(in.data.data(), in.height, in.width, out.data.data(), out.height, out.width, pad);
+    } else if (Pool* pool = dynamic_cast<Pool*>(layer)) {
+      pool->forward(in, out);
+    } else {
+      static_cast<Act*>(layer)->forward(in, out);
+    }
+  }
 
-    (1) Take a minibatch of examples (20%)
-    (2) Run each example through _calc_dLoss_dParam and average out the gradient for the minibatch examples
-    (3) Take a step alpha from current weights and biases towards the directions of the gradient
-    (4) Repeat steps 2-4 until some convergence criteria
-    (5) Evaluate the Loss every so often
+  // Copies rows [from_row, from_row + n) of every channel of from to rows [to_row, to_row + n) of
+  // to, which has the same channels and width.
+  void static _copy_rows(const Tensor& from, int from_row, Tensor& to, int to_row, int n) {
+    for (int c = 0; c < from.channels; c++) {
+      copy(from.plane(c) + (size_t)from_row * from.width, from.plane(c) + (size_t)(from_row + n) * from.width,
+           to.plane(c) + (size_t)to_row * to.width);
+    }
+  }
+};
 
-    */
+// Compile-time networks for fixed topologies, e.g.
+//   StaticConvNet<StaticShape<1, 12, 12>, StaticConv<4, 3>, StaticAct<Relu>, StaticMaxPool<2>, StaticFlatten,
+//                 StaticDense<10>, StaticAct<Sigmoid>>
+// Every intermediate shape is a constant, the feature maps live in two std::arrays inside the
+// network, and each stage calls the next directly, so a forward pass neither allocates nor
+// dispatches virtually. The parameters stay in ordinary layers (trained by a ConvNet, say) that the
+// network is bound to on construction, and the Conv and Dense kernels are theirs.
+//
+// A stage provides Output<In> (its output shape for input shape In), Bound (how it refers to its
+// layer), bind<In>(layer), which checks the layer against the stage, forward<In>(bound, in, out)
+// and in_place, true when forward may be given the same buffer twice.
+template <int Channels, int Height, int Width>
+struct StaticShape {
+  static constexpr int channels = Channels;
+  static constexpr int height = Height;
+  static constexpr int width = Width;
+  static constexpr int size = Channels * Height * Width;
+};
 
-    int num_steps = 100;
-    double alpha = 0.01;
-    double minibatch_ratio = 0.1;
+// Square filters; Padding may be Conv::same. Runs the Direct kernel.
+template <int Filters, int K, int Stride = 1, int Padding = 0>
+struct StaticConv {
+  using Bound = const Conv*;
+  static constexpr bool in_place = false;
+
+  // Total zero rows and columns, split as in Conv::pads.
+  template <class In>
+  static constexpr int pad_rows =
+      Padding == Conv::same ? max(0, ((In::height + Stride - 1) / Stride - 1) * Stride + K - In::height) : 2 * Padding;
+  template <class In>
+  static constexpr int pad_cols =
+      Padding == Conv::same ? max(0, ((In::width + Stride - 1) / Stride - 1) * Stride + K - In::width) : 2 * Padding;
+
+  template <class In>
+  using Output = StaticShape<Filters, (In::height + pad_rows<In> - K) / Stride + 1,
+                             (In::width + pad_cols<In> - K) / Stride + 1>;
+
+  template <class In>
+  static Bound bind(Layer* layer) {
+    using Out = Output<In>;
+    vector<int> out_shape = {Out::channels, Out::height, Out::width};
+    Conv* conv = dynamic_cast<Conv*>(layer);
+    if (!conv || conv->num_filters != Filters || conv->size_per_filter[0] != K ||
+        conv->stride_per_filter[0] != Stride || conv->padding != Padding ||
+        conv->output_shape({In::channels, In::height, In::width}) != out_shape) {
+      throw(string) "StaticConv does not match the layer it is bound to!";
+    }
+    return conv;
+  }
 
-    for (int i = 0; i < num_steps; i++) {
-      vector<int> batch = take_minibatch(X.size(), minibatch_ratio);
+  template <class In>
+  static void forward(Bound conv, const double* in, double* out) {
+    using Out = Output<In>;
+    constexpr array<int, 4> pad = {pad_rows<In> / 2, pad_cols<In> / 2, pad_rows<In> - pad_rows<In> / 2,
+                                   pad_cols<In> - pad_cols<In> / 2};
+    for (int f = 0; f < Filters; f++) {
+      fill(out + f * Out::height * Out::width, out + (f + 1) * Out::height * Out::width, conv->biases[f]);
+    }
+    conv->_forward_direct(in, In::height, In::width, out, Out::height, Out::width, pad);
+  }
+};
 
-      if (i % 10 == 0) {
-        cout << "Step: " << i << ". Loss is " << TotalLoss(X, Y) << ". Accuracy is " << TotalAccuracy(X, Y) << endl;
-      }
+template <int Size, int Stride = Size>
+struct StaticMaxPool {
+  using Bound = const MaxPool*;
+  static constexpr bool in_place = false;
 
-      vector<tuple<vector<vector<vector<double>>>, vector<double>>> dParam_acc;
+  template <class In>
+  using Output = StaticShape<In::channels, (In::height - Size) / Stride + 1, (In::width - Size) / Stride + 1>;
 
-      for (int j = 0; j < batch.size(); j++) {
-        h(X[batch[j]]);  // Saves a bunch of variables that we need for the backward pass
-        vector<tuple<vector<vector<vector<double>>>, vector<double>>> dParam_per_layer =
-            _calc_dLoss_dParam(Y[batch[j]]);
+  template <class In>
+  static Bound bind(Layer* layer) {
+    static_assert(In::height >= Size && In::width >= Size, "MaxPool window is larger than its input!");
+    MaxPool* pool = dynamic_cast<MaxPool*>(layer);
+    if (!pool || pool->height != Size || pool->width != Size || pool->stride != Stride) {
+      throw(string) "StaticMaxPool does not match the layer it is bound to!";
+    }
+    return pool;
+  }
 
-        if (j == 0) {
-          dParam_acc = dParam_per_layer;
-        } else {
-          for (int k = 0; k < dParam_per_layer.size(); k++) {
-            tuple<vector<vector<vector<double>>>, vector<double>> dParam = dParam_per_layer[k];
+  template <class In>
+  static void forward(Bound, const double* in, double* out) {
+    using Out = Output<In>;
+    for (int c = 0; c < In::channels; c++) {
+      MaxPool::_max_pool_plane(in + c * In::height * In::width, In::width, out + c * Out::height * Out::width,
+                               Out::height, Out::width, Size, Size, Stride);
+    }
+  }
+};
 
-            // Do the accumulation for weights
-            vector<vector<vector<double>>> weights = get<0>(dParam);
-            get<0>(dParam_acc[k]) = Layer::add_tensors(get<0>(dParam_acc[k]), weights);
+// A = Relu, Sigmoid, ... The activation is called without virtual dispatch.
+template <class A>
+struct StaticAct {
+  using Bound = const A*;
+  static constexpr bool in_place = true;
 
-            // Do the accumulation for biases
-            vector<double> biases = get<1>(dParam);
-            get<1>(dParam_acc[k]) = Layer::add_vectors(get<1>(dParam_acc[k]), biases);
-          }
-        }
-      }
-      for (int k = 0; k < dParam_acc.size(); k++) {
-        get<0>(dParam_acc[k]) = Layer::scalar_multiple(get<0>(dParam_acc[k]), batch.size());
-        get<1>(dParam_acc[k]) = Layer::scalar_multiple(get<1>(dParam_acc[k]), batch.size());
-      }
+  template <class In>
+  using Output = In;
 
-      // Add tensor to weights (first part of the tuple) and vector (second part of tuple) to biases
-      // Do this for each layer (that's why dParam is a vector)
+  template <class In>
+  static Bound bind(Layer* layer) {
+    A* act = dynamic_cast<A*>(layer);
+    if (!act) {
+      throw(string) "StaticAct does not match the layer it is bound to!";
+    }
+    return act;
+  }
 
-      // Add dParam to dParam_acc;
+  template <class In>
+  static void forward(Bound act, const double* in, double* out) {
+    for (int i = 0; i < In::size; i++) {
+      out[i] = act->A::activation_func(in[i]);
+    }
+  }
+};
 
-      int k = 0;
-      for (int L = layers.size() - 1; L >= 0; L--) {
-        bool is_last_output_box = false;
-        Layer* layer = layers[L];
-        if (Conv* conv = dynamic_cast<Conv*>(layer)) {
-        } else if (MaxPool* pool = dynamic_cast<MaxPool*>(layer)) {
-        } else if (Act* act = dynamic_cast<Act*>(layer)) {
-        } else if (Flatten* flatten = dynamic_cast<Flatten*>(layer)) {
-        } else if (Dense* dense = dynamic_cast<Dense*>(layer)) {
-          dense->weights =
-              Layer::add_tensors(dense->weights, Layer::scalar_multiple(get<0>(dParam_acc[k]), -1 * alpha));
+// Channel-major feature maps are already flat: nothing to do.
+struct StaticFlatten {
+  using Bound = const Flatten*;
+  static constexpr bool in_place = true;
 
-          dense->biases = Layer::add_vectors(dense->biases, Layer::scalar_multiple(get<1>(dParam_acc[k]), -1 * alpha));
+  template <class In>
+  using Output = StaticShape<In::size, 1, 1>;
 
-          k += 1;
-        }
-      }
+  template <class In>
+  static Bound bind(Layer* layer) {
+    Flatten* flatten = dynamic_cast<Flatten*>(layer);
+    if (!flatten) {
+      throw(string) "StaticFlatten does not match the layer it is bound to!";
     }
-    cout << "Step: " << num_steps-1 << ". Loss is " << TotalLoss(X, Y) << ". Accuracy is " << TotalAccuracy(X, Y) << endl;
+    return flatten;
   }
 
-  vector<int> take_minibatch(int N, double r) {
-    vector<int> v(N);                     // vector with 100 ints.
-    iota(std::begin(v), std::end(v), 0);  // Fill with 0, 1, ..., 99.
+  template <class In>
+  static void forward(Bound, const double*, double*) {}
+};
 
-    int k = floor(N * r);  // size of each batch
+// The number of inputs is the size of the incoming shape. Binds to a Dense layer, not a SparseDense.
+template <int Out>
+struct StaticDense {
+  using Bound = const Dense*;
+  static constexpr bool in_place = false;
 
-    vector<int> out;
-    size_t nelems = k;
-    if (be_random) {
-      std::sample(v.begin(), v.end(), std::back_inserter(out), nelems, std::mt19937{std::random_device{}()});
-    } else {
-      std::sample(v.begin(), v.end(), std::back_inserter(out), nelems, std::mt19937{});
+  template <class In>
+  using Output = StaticShape<Out, 1, 1>;
+
+  template <class In>
+  static Bound bind(Layer* layer) {
+    Dense* dense = dynamic_cast<Dense*>(layer);
+    if (!dense || dynamic_cast<SparseDense*>(layer) || dense->num_out != Out || dense->num_in != In::size) {
+      throw(string) "StaticDense does not match the layer it is bound to!";
     }
+    return dense;
+  }
 
-    return out;
+  template <class In>
+  static void forward(Bound dense, const double* in, double* out) {
+    dense->Dense::forward(in, out);
   }
+};
 
-  // Calculate the accuracy per example
-  double Accuracy(vector<vector<vector<double>>> x, int y) {
-    if (y == 10) {
-      throw(string) "Mismatch between label definition in Loss and incoming label!";
-    }
-    int label = predict(x);
+// The stages after a feature map of shape In, each holding its bound layer.
+template <class In, class... Stages>
+struct StaticChain {
+  using Output = In;
+  static constexpr int max_size = In::size;
 
-    if (label == y) {
-      return 1;
-    } else {
-      return 0;
-    }
-  }
+  void bind(Layer* const*) {}
 
-  // Calculate the accuracy
-  double TotalAccuracy(vector<vector<vector<vector<double>>>> X, int Y[]) {
-    double acc{0};
+  // Runs the stages on in, using other as the second buffer, and returns the buffer with the output.
+  double* forward(double* in, double*) const { return in; }
+};
 
-    for (int i = 0; i < X.size(); i++) {
-      acc += Accuracy(X[i], Y[i]);
-    }
-    return acc;
+template <class In, class First, class... Rest>
+struct StaticChain<In, First, Rest...> {
+  using Next = StaticChain<typename First::template Output<In>, Rest...>;
+  using Output = typename Next::Output;
+  static constexpr int max_size = max(In::size, Next::max_size);
+
+  typename First::Bound layer = nullptr;
+  Next rest;
+
+  void bind(Layer* const* layers) {
+    layer = First::template bind<In>(layers[0]);
+    rest.bind(layers + 1);
   }
 
-  // Calculate the loss function
-  double Loss(vector<vector<vector<double>>> x, int y) {
-    if (y == 10) {
-      throw(string) "Mismatch between label definition in Loss and incoming label!";
+  double* forward(double* in, double* other) const {
+    if constexpr (First::in_place) {
+      First::template forward<In>(layer, in, in);
+      return rest.forward(in, other);
+    } else {
+      First::template forward<In>(layer, in, other);
+      return rest.forward(other, in);
     }
-    vector<double> y_vector(10, 0);
-    y_vector[y] = 1;
-
-    vector<vector<vector<double>>> feature_map = h(x);
-    double acc{0};
+  }
+};
 
-    for (int i = 0; i < feature_map.size(); i++) {
-      acc += (feature_map[i][0][0] - y_vector[i]) * (feature_map[i][0][0] - y_vector[i]) / 2;
+template <class In, class... Stages>
+class StaticConvNet {
+ public:
+  using Output = typename StaticChain<In, Stages...>::Output;
+  static constexpr int num_stages = sizeof...(Stages);
+
+  // layers holds one layer per stage, in order, e.g. the layers a ConvNet was built from. They must
+  // outlive the network; updates to their parameters are seen by it.
+  StaticConvNet(const vector<Layer*>& layers) {
+    if (layers.size() != num_stages) {
+      throw(string) "StaticConvNet needs one layer per stage!";
     }
-    return acc;
+    chain.bind(layers.data());
   }
 
-  // Calculate the loss function
-  double TotalLoss(vector<vector<vector<vector<double>>>> X, int Y[]) {
-    double acc{0};
+  // x is channel-major, In::size long. The result stays valid until the next call.
+  const double* forward(const double* x) {
+    copy(x, x + In::size, buffers[0].data());
+    return chain.forward(buffers[0].data(), buffers[1].data());
+  }
 
-    for (int i = 0; i < X.size(); i++) {
-      acc += Loss(X[i], Y[i]);
+  const double* forward(const vector<vector<vector<double>>>& x) {
+    if (x.size() != In::channels || x[0].size() != In::height || x[0][0].size() != In::width) {
+      throw(string) "StaticConvNet input does not have the compiled shape!";
     }
-    return acc;
+    double* in = buffers[0].data();
+    for (auto& channel : x) {
+      for (auto& row : channel) {
+        in = copy(row.begin(), row.end(), in);
+      }
+    }
+    return chain.forward(buffers[0].data(), buffers[1].data());
   }
 
-  vector<tuple<vector<vector<vector<double>>>, vector<double>>> _calc_dLoss_dParam(int y) {
-    /*
-    Return data type:
-    Vector of a tuple of gradients, one per layer
-    First thing in the tuple is the tensor of weight derivatives
-    Second thing in the tuple is the vector of bias derivatives.
-
-    NOTE: vector of biases might become a matrix of biases for the convolution layer.
-    */
+  int predict(const vector<vector<vector<double>>>& x) {
+    const double* z = forward(x);
+    return max_element(z, z + Output::size) - z;
+  }
 
-    vector<vector<vector<vector<double>>>> da_L_dz_L_per_layer(layers.size(), {{{}}});
+ private:
+  StaticChain<In, Stages...> chain;
+  array<double, StaticChain<In, Stages...>::max_size> buffers[2];
+};
 
-    vector<double> y_vector(10, 0);
-    y_vector[y] = 1;
+// Tests of StaticConvNet, which has no instantiation of its own to hold them.
+struct StaticConvNetTests {
+  // The same layers as a ConvNet and as a StaticConvNet: same outputs and predictions, parameter
+  // updates are picked up, and layers that do not match their stage are rejected.
+  void static static_test() {
+    Conv conv1 = Conv(1, 3, vector<int>(3, 3), vector<int>(3, 1), Conv::same);
+    Relu relu1 = Relu();
+    Conv conv2 = Conv(3, 4, vector<int>(4, 3), vector<int>(4, 2));
+    Relu relu2 = Relu();
+    MaxPool pool = MaxPool(2);
+    Flatten flatten = Flatten();
+    Dense dense = Dense(10, 4 * 2 * 2);
+    Sigmoid sigmoid = Sigmoid();
+    vector<Layer*> layers = {&conv1, &relu1, &conv2, &relu2, &pool, &flatten, &dense, &sigmoid};
+    ConvNet model = ConvNet(layers);
+
+    using Net = StaticConvNet<StaticShape<1, 12, 12>, StaticConv<3, 3, 1, Conv::same>, StaticAct<Relu>,
+                              StaticConv<4, 3, 2>, StaticAct<Relu>, StaticMaxPool<2>, StaticFlatten, StaticDense<10>,
+                              StaticAct<Sigmoid>>;
+    static_assert(is_same<Net::Output, StaticShape<10, 1, 1>>::value, "StaticConvNet shapes are wrong");
+    Net net = Net(layers);
+
+    vector<vector<vector<double>>> x(1, vector<vector<double>>(12, vector<double>(12, 0)));
+    for (int trial = 0; trial < 3; trial++) {
+      Layer::rand_init(x[0], 12, 12);
+      vector<vector<vector<double>>> expected = model.h(x);
+      const double* output = net.forward(x);
+      for (int i = 0; i < 10; i++) {
+        if (abs(output[i] - expected[i][0][0]) > 1e-12) {
+          throw(string) "Test failed! " + (string) __FUNCTION__;
+        }
+      }
+      if (net.predict(x) != model.predict(x)) {
+        throw(string) "Test failed! " + (string) __FUNCTION__;
+      }
+      dense.biases[trial] += 1;  // Seen by both on the next trial
+    }
 
-    vector<tuple<vector<vector<vector<double>>>, vector<double>>> dParam_per_layer;
+    Dense wrong = Dense(10, 4 * 2 * 2 + 1);
+    try {
+      Net(vector<Layer*>{&conv1, &relu1, &conv2, &relu2, &pool, &flatten, &wrong, &sigmoid});
+    } catch (string) {
+      return;
+    }
+    throw(string) "Test failed! " + (string) __FUNCTION__;
+  }
+};
 
-    map<vector<int>, double> layer_neuron_to_sensitivity;
+// Vyukov's intrusive multi-producer single-consumer queue. push() is a single atomic exchange and
+// never blocks; pop() may only be called from one thread. Node needs an atomic<Node*> next.
+template <class Node>
+class MpscQueue {
+ public:
+  MpscQueue() : head(&stub), tail(&stub) {}
 
-    for (int L = layers.size() - 1; L >= 0; L--) {
-      bool is_last_output_box = false;
-      Layer* layer = layers[L];
-      if (Conv* conv = dynamic_cast<Conv*>(layer)) {
-        // a = conv->h(a);
-      } else if (MaxPool* pool = dynamic_cast<MaxPool*>(layer)) {
-        // a = pool->h(a);
-      } else if (Act* act = dynamic_cast<Act*>(layer)) {
-        /*
-        For sigmoid: g'(a)
-        */
-        da_L_dz_L_per_layer[L - 1] = act->da_dz(a[L - 1]);
-      } else if (Flatten* flatten = dynamic_cast<Flatten*>(layer)) {
-        // v = flatten->f(a);
-        // is_last_output_box = true;
-      } else if (Dense* dense = dynamic_cast<Dense*>(layer)) {
-        /*
-        Dense + Act:
-        dLoss/dW_(output_sigmal, incoming_signal)
+  void push(Node* node) {
+    node->next.store(nullptr, memory_order_relaxed);
+    Node* prev = head.exchange(node, memory_order_acq_rel);
+    prev->next.store(node, memory_order_release);
+  }
 
-        dLoss/dW_{i,j}^L = dz_i^L/dW_{i,j}^L * [da_i^L/dz_i^L * dLoss/da_i^L]
+  // nullptr when empty, or when the only remaining push has not finished linking its node yet.
+  Node* pop() {
+    Node* t = tail;
+    Node* next = t->next.load(memory_order_acquire);
+    if (t == &stub) {
+      if (!next) {
+        return nullptr;
+      }
+      tail = next;
+      t = next;
+      next = next->next.load(memory_order_acquire);
+    }
+    if (next) {
+      tail = next;
+      return t;
+    }
+    if (t != head.load(memory_order_acquire)) {
+      return nullptr;
+    }
+    push(&stub);
+    next = t->next.load(memory_order_acquire);
+    if (next) {
+      tail = next;
+      return t;
+    }
+    return nullptr;
+  }
 
-        dLoss/dW_{i,j}^{L-1} = dz_i^{L-1}/dW_{i,j}^{L-1} * da_i^{L-1}/dz_i^{L-1} * ...
-          \sum_k^{num_neurons_in_L} (dz_k^L/da_i^{L-1} * [da_k^L/dz_k^L * ...])
+ private:
+  atomic<Node*> head;
+  Node* tail;
+  Node stub;
+};
 
-        L(x, y) = \sum_i^I 1/2(a_i^L - y_i)^2
-        a^L = g(z^L)
-        z^L = W^L*a^{L-1}
+// Bounded single-producer single-consumer ring. push() and pop() never block and never allocate:
+// they fail when the ring is full or empty. Only one thread may push and only one may pop. The two
+// indices sit on separate cache lines so that the producer and the consumer do not share one.
+template <class T>
+class SpscQueue {
+ public:
+  explicit SpscQueue(int capacity) : slots(capacity + 1) {}
 
-        dz_i^L/dw_{i,j}^L = a_j^{L-1}           ok
-        dz_i^{L-1}/dW_{i,j}^{L-1} = a_j^{L-2}   ok
+  bool push(T value) {
+    size_t t = tail.load(memory_order_relaxed);
+    size_t next = t + 1 == slots.size() ? 0 : t + 1;
+    if (next == head.load(memory_order_acquire)) {
+      return false;
+    }
+    slots[t] = move(value);
+    tail.store(next, memory_order_release);
+    return true;
+  }
 
-        da_i^L/dz_i^L = (above)                 ok
-        da_i^{L-1}/dz_i^{L-1} = (above)         ok
+  bool pop(T& value) {
+    size_t h = head.load(memory_order_relaxed);
+    if (h == tail.load(memory_order_acquire)) {
+      return false;
+    }
+    value = move(slots[h]);
+    head.store(h + 1 == slots.size() ? 0 : h + 1, memory_order_release);
+    return true;
+  }
 
-        dz_k^L/da_i^{L-1} = W_{k,i}^L           ok
+ private:
+  vector<T> slots;  // One more than the capacity, so that a full ring is not mistaken for an empty one
+  alignas(64) atomic<size_t> head{0};
+  alignas(64) atomic<size_t> tail{0};
+};
 
-        dLoss/da_i^L = (a_i^L - y_i)            ok
+struct InferenceRequest {
+  atomic<InferenceRequest*> next{nullptr};
+  vector<vector<vector<double>>> x;
+  promise<int> label;
+  chrono::steady_clock::time_point enqueued;
+};
 
-        dLoss/dB_i^L = dz_i^L/dB_i^L * [da_i^L/dz_i^L * dLoss/da_i^L]
-        */
+// Serves predict() for single requests by batching them. Requests go through a lock-free queue to
+// one batching thread, which closes a batch when it holds max_batch_size requests or its oldest
+// request has waited max_wait. Workers run each batch through ConvNet::forward_batch with their own
+// contexts and complete the requests' futures. The model must be compiled and must not be modified
+// while the server runs.
+class InferenceServer {
+ public:
+  InferenceServer(const ConvNet& model, int max_batch_size = 16,
+                  chrono::microseconds max_wait = chrono::microseconds(2000),
+                  int num_workers = max(1u, thread::hardware_concurrency()))
+      : model(model) {
+    if (model.input_shape.empty()) {
+      throw(string) "Compile the ConvNet before serving it!";
+    }
+    this->max_batch_size = max_batch_size;
+    this->max_wait = max_wait;
 
-        vector<vector<vector<double>>> dW(dense->num_out, vector<vector<double>>(dense->num_in, vector<double>(1, 0)));
-        vector<double> dB(dense->num_out, 0);
+    batcher = thread([this]() { _batch_loop(); });
+    for (int i = 0; i < num_workers; i++) {
+      workers.emplace_back([this]() { _work_loop(); });
+    }
+  }
 
-        if (L == layers.size() - 2) {
-          for (int i = 0; i < dense->num_out; i++) {
-            double sensitivity_path_val = da_L_dz_L_per_layer[L][i][0][0];
-            sensitivity_path_val *= (a[L + 1][i][0][0] - y_vector[i]);
+  ~InferenceServer() { stop(); }
 
-            layer_neuron_to_sensitivity[vector<int>{L, i, 0, 0}] = sensitivity_path_val;
+  future<int> submit(vector<vector<vector<double>>> x) {
+    // Counted before the check, so that a concurrent stop() cannot see pending == 0 and let the
+    // batching thread exit between the check and the push.
+    pending++;
+    if (stopping) {
+      pending--;
+      throw(string) "InferenceServer is stopped!";
+    }
+    InferenceRequest* request = new InferenceRequest();
+    request->x = move(x);
+    request->enqueued = chrono::steady_clock::now();
+    future<int> label = request->label.get_future();
+
+    requests.push(request);
+    if (batcher_idle) {
+      lock_guard<mutex> lock(idle_mutex);
+      idle_cv.notify_one();
+    }
+    return label;
+  }
 
-            for (int j = 0; j < dense->num_in; j++) {
-              dW[i][j][0] = a[L - 1][j][0][0];
+  // Serves everything already submitted, then stops the threads.
+  void stop() {
+    if (stopping.exchange(true)) {
+      return;
+    }
+    {
+      lock_guard<mutex> lock(idle_mutex);
+      idle_cv.notify_one();
+    }
+    batcher.join();
+    {
+      lock_guard<mutex> lock(batches_mutex);
+      batches_cv.notify_all();
+    }
+    for (thread& worker : workers) {
+      worker.join();
+    }
+  }
 
-              dW[i][j][0] *= layer_neuron_to_sensitivity[vector<int>{L, i, 0, 0}];
-              // dW[i][j][0] *= da_L_dz_L_per_layer[L][i][0][0]; // to be reused
-              // dW[i][j][0] *= (a[L + 1][i][0][0] - y_vector[i]); // to be reused
-            }
+  // Counters and per-request latencies (enqueue to completion) since the last reset_stats().
+  atomic<long> batches_run{0};
+  atomic<long> requests_run{0};
 
-            dB[i] = layer_neuron_to_sensitivity[vector<int>{L, i, 0, 0}];
-          }
-        } else {  // runs when L = layers.size() - 4
-                  /*
-                  layers.size() - 1 Final activation
-                  layers.size() - 2 Last Dense layer
-                  layers.size() - 3 Second to last activation
-                  layers.size() - 4 Second to last (Dense) layer
-                  */
-          for (int i = 0; i < dense->num_out; i++) {
-            double sensitivity_path_val = da_L_dz_L_per_layer[L][i][0][0];
+  vector<double> latencies_us() {
+    lock_guard<mutex> lock(stats_mutex);
+    return latencies;
+  }
 
-            for (int j = 0; j < dense->num_in; j++) {
-              dW[i][j][0] = a[L - 1][j][0][0];
+  void reset_stats() {
+    lock_guard<mutex> lock(stats_mutex);
+    latencies.clear();
+    batches_run = 0;
+    requests_run = 0;
+  }
 
-              // dW[i][j][0] *= da_L_dz_L_per_layer[L][i][0][0];
+  void static serve_test() {
+    Conv conv = Conv(1, 4, {3, 3, 3, 3}, {1, 1, 1, 1});
+    Relu relu = Relu();
+    MaxPool pool = MaxPool(2);
+    Flatten flatten = Flatten();
+    Dense dense = Dense(10, 4 * 5 * 5);
+    Sigmoid sigmoid = Sigmoid();
+    ConvNet model = ConvNet(vector<Layer*>{&conv, &relu, &pool, &flatten, &dense, &sigmoid});
+    model.compile({1, 12, 12}, false);
+
+    vector<vector<vector<vector<double>>>> images(64, {vector<vector<double>>(12, vector<double>(12, 0))});
+    vector<int> expected;
+    for (auto& image : images) {
+      Layer::rand_init(image[0], 12, 12);
+      expected.push_back(model.predict(image));
+    }
 
-              double sum = 0;
+    InferenceServer server = InferenceServer(model, 8, chrono::microseconds(5000), 2);
+    vector<future<int>> labels(images.size());
+    vector<thread> clients;
+    for (int t = 0; t < 4; t++) {
+      clients.emplace_back([&, t]() {
+        for (int i = t; i < images.size(); i += 4) {
+          labels[i] = server.submit(images[i]);
+        }
+      });
+    }
+    for (thread& client : clients) {
+      client.join();
+    }
+    for (int i = 0; i < images.size(); i++) {
+      if (labels[i].get() != expected[i]) {
+        throw(string) "Test failed! " + (string) __FUNCTION__;
+      }
+    }
+    if (server.requests_run != images.size() || server.batches_run >= server.requests_run) {
+      throw(string) "Test failed! " + (string) __FUNCTION__;
+    }
+  }
 
-              Dense* next_dense = dynamic_cast<Dense*>(layers[L + 2]);
+ private:
+  const ConvNet& model;
+  int max_batch_size;
+  chrono::microseconds max_wait;
+
+  MpscQueue<InferenceRequest> requests;
+  atomic<long> pending{0};  // Submitted but not yet taken by the batching thread
+  atomic<bool> stopping{false};
+  atomic<bool> batcher_idle{false};
+  atomic<bool> batcher_done{false};
+  mutex idle_mutex;
+  condition_variable idle_cv;
+  thread batcher;
+
+  deque<vector<InferenceRequest*>> batches;
+  mutex batches_mutex;
+  condition_variable batches_cv;
+  vector<thread> workers;
+
+  mutex stats_mutex;
+  vector<double> latencies;
+
+  void _batch_loop() {
+    vector<InferenceRequest*> batch;
+    while (true) {
+      InferenceRequest* request = requests.pop();
+      if (request) {
+        pending--;
+        batch.push_back(request);
+      }
 
-              for (int k = 0; k < next_dense->num_out; k++) {
-                double part_sum = next_dense->weights[k][i][0];
-                part_sum *= layer_neuron_to_sensitivity[vector<int>{L + 2, k, 0, 0}];
-                // part_sum *= da_L_dz_L_per_layer[L + 2][k][0][0];
-                // part_sum *= (a[L + 3][k][0][0] - y_vector[k]);
+      bool full = batch.size() == max_batch_size;
+      bool expired = !batch.empty() && chrono::steady_clock::now() - batch[0]->enqueued >= max_wait;
+      bool draining = stopping && pending == 0;
+      if (full || expired || (draining && !batch.empty())) {
+        {
+          lock_guard<mutex> lock(batches_mutex);
+          batches.push_back(move(batch));
+        }
+        batches_cv.notify_one();
+        batch.clear();
+      } else if (draining) {
+        batcher_done = true;
+        return;
+      }
 
-                sum += part_sum;
-              }
-              double sensitivity_path_val_new = sensitivity_path_val * sum;
+      if (!request) {
+        // Nothing to take: sleep until the next submit, or until the open batch expires.
+        unique_lock<mutex> lock(idle_mutex);
+        batcher_idle = true;
+        chrono::microseconds timeout = batch.empty() ? chrono::microseconds(10000) : chrono::microseconds(50);
+        idle_cv.wait_for(lock, timeout, [this]() { return pending > 0 || stopping; });
+        batcher_idle = false;
+      }
+    }
+  }
 
-              layer_neuron_to_sensitivity[vector<int>{L, i, 0, 0}] = sensitivity_path_val_new;
+  void _work_loop() {
+    vector<ExecutionContext> ctxs(max_batch_size);
+    while (true) {
+      vector<InferenceRequest*> batch;
+      {
+        unique_lock<mutex> lock(batches_mutex);
+        batches_cv.wait(lock, [this]() { return !batches.empty() || batcher_done; });
+        if (batches.empty()) {
+          return;
+        }
+        batch = move(batches.front());
+        batches.pop_front();
+      }
 
-              dW[i][j][0] *= layer_neuron_to_sensitivity[vector<int>{L, i, 0, 0}];
-            }
-            dB[i] = layer_neuron_to_sensitivity[vector<int>{L, i, 0, 0}];
-          }
+      int n = batch.size();
+      for (int b = 0; b < n; b++) {
+        ctxs[b].input.load(batch[b]->x);
+      }
+      try {
+        model.forward_batch(ctxs, n);
+      } catch (string error) {
+        for (InferenceRequest* request : batch) {
+          request->label.set_exception(make_exception_ptr(runtime_error(error)));
+          delete request;
         }
+        continue;
+      }
 
-        tuple<vector<vector<vector<double>>>, vector<double>> dParam_tuple = make_tuple(dW, dB);
-        dParam_per_layer.push_back(dParam_tuple);
+      chrono::steady_clock::time_point done = chrono::steady_clock::now();
+      {
+        lock_guard<mutex> lock(stats_mutex);
+        for (InferenceRequest* request : batch) {
+          latencies.push_back(chrono::duration<double, micro>(done - request->enqueued).count());
+        }
+      }
+      batches_run++;
+      requests_run += n;
+      for (int b = 0; b < n; b++) {
+        batch[b]->label.set_value(ConvNet::argmax(ctxs[b].a.back()));
+        delete batch[b];
       }
     }
-    return dParam_per_layer;
   }
+};
 
-  void static h_test_1(vector<vector<vector<vector<double>>>> X, int Y[100]) {
-    Flatten flatten = Flatten();
-    Dense dense = Dense(3, 16);
-    Sigmoid sigmoid = Sigmoid();
-    ConvNet model = ConvNet(vector<Layer*>{&flatten, &dense, &sigmoid});
-    // Do a forward pass with the first "image"
-    int label = model.predict(X[0]);
-    cout << label << endl;
+struct LoadPoint {
+  double offered_qps;
+  double throughput_qps;
+  double mean_batch_size;
+  double p50_us;
+  double p95_us;
+  double p99_us;
+};
 
-    if (!(label >= 0 && 10 > label)) {
-      throw(string) "Test failed! " + (string) __FUNCTION__;
+// Open-loop load generator: submits requests to an InferenceServer at a fixed rate regardless of
+// how fast they complete, and reports throughput and latency percentiles for each rate.
+class LoadGenerator {
+ public:
+  static LoadPoint run(InferenceServer& server, const vector<vector<vector<vector<double>>>>& images, double qps,
+                       double seconds) {
+    server.reset_stats();
+    int n = max(1, (int)(qps * seconds));
+    vector<future<int>> labels;
+    labels.reserve(n);
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (int i = 0; i < n; i++) {
+      this_thread::sleep_until(start + chrono::duration_cast<chrono::steady_clock::duration>(
+                                           chrono::duration<double>(i / qps)));
+      labels.push_back(server.submit(images[i % images.size()]));
     }
+    for (future<int>& label : labels) {
+      label.get();
+    }
+    double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
 
-    vector<tuple<vector<vector<vector<double>>>, vector<double>>> dParam_per_layer = model._calc_dLoss_dParam(Y[0]);
-    // (L(W+h) - L(W-h))/(2*h)
-
-    for (int i = 0; i < dense.num_out; i++) {
-      for (int j = 0; j < dense.num_out; j++) {
-        if (!(i == 0 && j == 0) && (rand() % 100) < 30) {
-          continue;
-        } else {
-          tuple<vector<vector<vector<double>>>, vector<double>> dParam = dParam_per_layer[0];
-          double epsilon{0.001};
+    vector<double> latencies = server.latencies_us();
+    sort(latencies.begin(), latencies.end());
+    auto percentile = [&](double p) { return latencies[min(latencies.size() - 1, (size_t)(p * latencies.size()))]; };
 
-          // Might be better to loop over descreasing values of epsilon
-          dense.weights[i][j][0] += epsilon;
-          double loss1 = model.Loss(X[0], Y[0]);
+    return LoadPoint{qps, n / elapsed, (double)server.requests_run / max(1L, server.batches_run.load()),
+                     percentile(0.5), percentile(0.95), percentile(0.99)};
+  }
 
-          dense.weights[i][j][0] -= 2 * epsilon;
-          double loss2 = model.Loss(X[0], Y[0]);
+  static vector<LoadPoint> sweep(InferenceServer& server, const vector<vector<vector<vector<double>>>>& images,
+                                 vector<double> qps_levels, double seconds_per_level, ostream& out = cout) {
+    out << right << setw(12) << "offered qps" << setw(12) << "served qps" << setw(12) << "mean batch" << setw(12)
+        << "p50 us" << setw(12) << "p95 us" << setw(12) << "p99 us" << endl;
+
+    vector<LoadPoint> curve;
+    for (double qps : qps_levels) {
+      LoadPoint point = run(server, images, qps, seconds_per_level);
+      out << fixed << setprecision(1) << setw(12) << point.offered_qps << setw(12) << point.throughput_qps
+          << setw(12) << point.mean_batch_size << setw(12) << point.p50_us << setw(12) << point.p95_us << setw(12)
+          << point.p99_us << defaultfloat << endl;
+      curve.push_back(point);
+    }
+    return curve;
+  }
 
-          double num_dLoss_dWs = (loss1 - loss2) / (2 * epsilon);
-          cout << get<0>(dParam)[i][j][0] << endl;
-          cout << num_dLoss_dWs << endl;
-          cout << "Difference in derivatives: " << num_dLoss_dWs - get<0>(dParam)[i][j][0] << endl;
+  void static sweep_test() {
+    Flatten flatten = Flatten();
+    Dense dense1 = Dense(32, 64);
+    Relu relu = Relu();
+    Dense dense2 = Dense(10, 32);
+    ConvNet model = ConvNet(vector<Layer*>{&flatten, &dense1, &relu, &dense2});
+    model.compile({1, 8, 8}, false);
+
+    vector<vector<vector<vector<double>>>> images(16, {vector<vector<double>>(8, vector<double>(8, 0))});
+    for (auto& image : images) {
+      Layer::rand_init(image[0], 8, 8);
+    }
 
-          dense.weights[i][j][0] += epsilon;
-        }
+    InferenceServer server = InferenceServer(model, 16, chrono::microseconds(1000), 1);
+    vector<LoadPoint> curve = sweep(server, images, {1000, 5000, 20000}, 0.05);
+    for (LoadPoint& point : curve) {
+      if (!(point.throughput_qps > 0 && point.p50_us <= point.p99_us && point.mean_batch_size >= 1)) {
+        throw(string) "Test failed! " + (string) __FUNCTION__;
       }
     }
   }
+};
 
-  void static h_test_1_bias(vector<vector<vector<vector<double>>>> X, int Y[100]) {
-    Flatten flatten = Flatten();
-    Dense dense = Dense(3, 16);
-    Sigmoid sigmoid = Sigmoid();
-    ConvNet model = ConvNet(vector<Layer*>{&flatten, &dense, &sigmoid});
-    // Do a forward pass with the first "image"
-    int label = model.predict(X[0]);
-    cout << label << endl;
-
-    if (!(label >= 0 && 10 > label)) {
-      throw(string) "Test failed! " + (string) __FUNCTION__;
+// Streams frames through a compiled ConvNet split into stages of contiguous layers, one thread per
+// stage, each pinned to its own core so that its layers' parameters stay in that core's cache.
+// Frames move between stages through bounded SPSC queues. A fixed pool of `depth` frames circulates,
+// each holding the activations of every layer, so the steady state allocates nothing. The stages
+// are balanced on the time each layer takes on this machine, measured when the executor is built.
+// submit() must be called from one thread and next() from one thread. They may be the same thread
+// if it never has more than depth frames in flight. The model must not be modified while the
+// executor exists.
+class PipelineExecutor {
+ public:
+  PipelineExecutor(const ConvNet& model, int num_stages, int depth = 0, bool pin_threads = true)
+      : model(model), free_frames(max(1, depth > 0 ? depth : 2 * num_stages)) {
+    if (model.input_shape.empty()) {
+      throw(string) "Compile the ConvNet before pipelining it!";
     }
+    layer_costs = measure(model);
+    boundaries = partition(layer_costs, num_stages);
+    this->depth = max(1, depth > 0 ? depth : 2 * num_stages);
 
-    vector<tuple<vector<vector<vector<double>>>, vector<double>>> dParam_per_layer = model._calc_dLoss_dParam(Y[0]);
-    // (L(b+h) - L(b-h))/(2*h)
+    frames = vector<Frame>(this->depth);
+    for (Frame& frame : frames) {
+      free_frames.push(&frame);
+    }
+    for (int s = 0; s <= stages(); s++) {
+      queues.push_back(make_unique<SpscQueue<Frame*>>(this->depth));
+    }
+    for (int s = 0; s < stages(); s++) {
+      threads.emplace_back([this, s, pin_threads]() {
+        if (pin_threads) {
+          _pin(s);
+        }
+        _stage_loop(s);
+      });
+    }
+  }
 
-    for (int i = 0; i < dense.num_out; i++) {
-      if (!(i == 0) && (rand() % 100) < 30) {
-        continue;
-      } else {
-        tuple<vector<vector<vector<double>>>, vector<double>> dParam = dParam_per_layer[0];
-        double epsilon{0.001};
+  // Frames still in flight are dropped.
+  ~PipelineExecutor() {
+    stopping = true;
+    for (thread& t : threads) {
+      t.join();
+    }
+  }
 
-        // Might be better to loop over descreasing values of epsilon
-        dense.biases[i] += epsilon;
-        double loss1 = model.Loss(X[0], Y[0]);
+  PipelineExecutor(const PipelineExecutor&) = delete;
+  PipelineExecutor& operator=(const PipelineExecutor&) = delete;
 
-        dense.biases[i] -= 2 * epsilon;
-        double loss2 = model.Loss(X[0], Y[0]);
+  vector<double> layer_costs;  // Seconds per frame for each layer, as measured
+  vector<int> boundaries;      // Stage s runs layers [boundaries[s], boundaries[s + 1])
 
-        double num_dLoss_dBs = (loss1 - loss2) / (2 * epsilon);
-        cout << get<1>(dParam)[i] << endl;
-        cout << num_dLoss_dBs << endl;
-        cout << "Difference in derivatives: " << num_dLoss_dBs - get<1>(dParam)[i] << endl;
+  int stages() const { return boundaries.size() - 1; }
 
-        dense.biases[i] += epsilon;
-      }
+  // Seconds per frame for the given stage.
+  double stage_cost(int s) const {
+    double cost = 0;
+    for (int L = boundaries[s]; L < boundaries[s + 1]; L++) {
+      cost += layer_costs[L];
     }
+    return cost;
   }
 
-  void static h_test_2(vector<vector<vector<vector<double>>>> X, int Y[100]) {
-    Flatten flatten = Flatten();
-    Dense dense1 = Dense(8, 16);
-    Sigmoid sigmoid1 = Sigmoid();
-    Dense dense2 = Dense(3, 8);
-    Sigmoid sigmoid2 = Sigmoid();
-    ConvNet model = ConvNet(vector<Layer*>{&flatten, &dense1, &sigmoid1, &dense2, &sigmoid2});
-    // Do a forward pass with the first "image"
-    int label = model.predict(X[0]);
-    cout << label << endl;
-
-    if (!(label >= 0 && 10 > label)) {
-      throw(string) "Test failed! " + (string) __FUNCTION__;
+  // Queues a frame, waiting while all frames are in flight. An input of the wrong shape is reported
+  // by the next() that would have returned its output.
+  void submit(const vector<vector<vector<double>>>& x) {
+    Frame* frame = nullptr;
+    _wait([&]() { return free_frames.pop(frame); });
+    frame->ctx.input.load(x);
+    frame->error.clear();
+    if (!frame->ctx.input.has_shape(model.input_shape)) {
+      frame->error = "ConvNet is not compiled for this input shape!";
     }
+    queues[0]->push(frame);
+  }
 
-    vector<tuple<vector<vector<vector<double>>>, vector<double>>> dParam_per_layer = model._calc_dLoss_dParam(Y[0]);
-    // (L(W+h) - L(W-h))/(2*h)
-
-    for (int i = 0; i < dense1.num_out; i++) {
-      for (int j = 0; j < dense1.num_out; j++) {
-        if (!(i == 0 && j == 0) && (rand() % 100) < 30) {
-          continue;
-        } else {
-          tuple<vector<vector<vector<double>>>, vector<double>> dParam = dParam_per_layer[1];
-          double epsilon{.001};
+  // Waits for the oldest submitted frame to leave the last stage and swaps its output into output,
+  // whose buffer the frame takes in exchange.
+  void next(Tensor& output) {
+    Frame* frame = nullptr;
+    _wait([&]() { return queues.back()->pop(frame); });
+    string error;
+    swap(error, frame->error);
+    if (error.empty()) {
+      swap(output, frame->ctx.a.back());
+    }
+    free_frames.push(frame);
+    if (!error.empty()) {
+      throw error;
+    }
+  }
 
-          // Might be better to loop over descreasing values of epsilon
-          dense1.weights[i][j][0] += epsilon;
-          double loss1 = model.Loss(X[0], Y[0]);
+  // Labels for a stream of frames, in order, keeping the pipeline full from the calling thread.
+  vector<int> predict(const vector<vector<vector<vector<double>>>>& stream) {
+    vector<int> labels;
+    labels.reserve(stream.size());
+    Tensor output;
+    for (int i = 0; i < stream.size(); i++) {
+      if (i - labels.size() == depth) {
+        next(output);
+        labels.push_back(ConvNet::argmax(output));
+      }
+      submit(stream[i]);
+    }
+    while (labels.size() < stream.size()) {
+      next(output);
+      labels.push_back(ConvNet::argmax(output));
+    }
+    return labels;
+  }
 
-          dense1.weights[i][j][0] -= 2 * epsilon;
-          double loss2 = model.Loss(X[0], Y[0]);
+  // Seconds each layer takes on one frame: the fastest of `runs` passes over a random input, after
+  // a pass that warms up the buffers.
+  vector<double> static measure(const ConvNet& model, int runs = 5) {
+    ExecutionContext ctx;
+    mt19937 rng(1);
+    uniform_real_distribution<double> uniform(-1, 1);
+    vector<double> costs(model.layers.size(), numeric_limits<double>::max());
+    for (int run = 0; run <= runs; run++) {
+      ctx.input.resize(model.input_shape[0], model.input_shape[1], model.input_shape[2]);
+      ctx.input.layout = Layout::CHW;
+      for (double& value : ctx.input.data) {
+        value = uniform(rng);
+      }
+      for (int L = 0; L < model.layers.size(); L++) {
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        _run_layer(model, ctx, L);
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        if (run > 0) {
+          costs[L] = min(costs[L], seconds);
+        }
+      }
+    }
+    return costs;
+  }
 
-          double num_dLoss_dWs = (loss1 - loss2) / (2 * epsilon);
-          cout << get<0>(dParam)[i][j][0] << endl;
-          cout << num_dLoss_dWs << endl;
-          cout << "Difference in derivatives: " << num_dLoss_dWs - get<0>(dParam)[i][j][0] << endl;
+  // Splits the layers into num_stages contiguous, non-empty ranges (fewer if there are fewer
+  // layers) so that the most expensive range, which bounds the throughput, is as cheap as possible.
+  // Returns the range boundaries.
+  vector<int> static partition(const vector<double>& costs, int num_stages) {
+    int n = costs.size();
+    int k = max(1, min(num_stages, n));
+    vector<double> prefix(n + 1, 0);
+    for (int i = 0; i < n; i++) {
+      prefix[i + 1] = prefix[i] + costs[i];
+    }
 
-          dense1.weights[i][j][0] += epsilon;
+    // best[s][i] is the cheapest most expensive range for the first i layers in s ranges, and
+    // start[s][i] where the last of those ranges begins.
+    vector<vector<double>> best(k + 1, vector<double>(n + 1, numeric_limits<double>::max()));
+    vector<vector<int>> start(k + 1, vector<int>(n + 1, 0));
+    best[0][0] = 0;
+    for (int s = 1; s <= k; s++) {
+      for (int i = s; i <= n; i++) {
+        for (int j = s - 1; j < i; j++) {
+          double cost = max(best[s - 1][j], prefix[i] - prefix[j]);
+          if (cost < best[s][i]) {
+            best[s][i] = cost;
+            start[s][i] = j;
+          }
         }
       }
     }
+
+    vector<int> boundaries(k + 1, n);
+    for (int s = k; s > 0; s--) {
+      boundaries[s - 1] = start[s][boundaries[s]];
+    }
+    return boundaries;
   }
 
-  void static h_test_2_bias(vector<vector<vector<vector<double>>>> X, int Y[100]) {
+  void static pipeline_test() {
+    vector<int> split = partition({1, 1, 1, 1, 4}, 2);
+    if (split != vector<int>{0, 4, 5} || partition({1, 2}, 4) != vector<int>{0, 1, 2} ||
+        partition({3, 1, 1, 1}, 1) != vector<int>{0, 4}) {
+      throw(string) "Test failed! " + (string) __FUNCTION__;
+    }
+
+    Conv conv1 = Conv(1, 4, {3, 3, 3, 3}, {1, 1, 1, 1});
+    Relu relu1 = Relu();
+    MaxPool pool = MaxPool(2);
+    Conv conv2 = Conv(4, 4, {3, 3, 3, 3}, {1, 1, 1, 1});
+    Relu relu2 = Relu();
     Flatten flatten = Flatten();
-    Dense dense1 = Dense(8, 16);
-    Sigmoid sigmoid1 = Sigmoid();
-    Dense dense2 = Dense(3, 8);
-    Sigmoid sigmoid2 = Sigmoid();
-    ConvNet model = ConvNet(vector<Layer*>{&flatten, &dense1, &sigmoid1, &dense2, &sigmoid2});
-    // Do a forward pass with the first "image"
-    int label = model.predict(X[0]);
-    cout << label << endl;
+    Dense dense = Dense(10, 4 * 3 * 3);
+    Sigmoid sigmoid = Sigmoid();
+    ConvNet model = ConvNet(vector<Layer*>{&conv1, &relu1, &pool, &conv2, &relu2, &flatten, &dense, &sigmoid});
+    model.compile({1, 12, 12}, false);
+
+    vector<vector<vector<vector<double>>>> images(24, {vector<vector<double>>(12, vector<double>(12, 0))});
+    vector<vector<vector<vector<double>>>> expected;
+    vector<int> labels;
+    for (auto& image : images) {
+      Layer::rand_init(image[0], 12, 12);
+      expected.push_back(model.h(image));
+      labels.push_back(model.predict(image));
+    }
 
-    if (!(label >= 0 && 10 > label)) {
+    PipelineExecutor pipeline = PipelineExecutor(model, 3, 4);
+    if (pipeline.stages() != 3 || pipeline.boundaries.front() != 0 || pipeline.boundaries.back() != 8) {
+      throw(string) "Test failed! " + (string) __FUNCTION__;
+    }
+    for (int s = 0; s < pipeline.stages(); s++) {
+      if (pipeline.boundaries[s] >= pipeline.boundaries[s + 1]) {
+        throw(string) "Test failed! " + (string) __FUNCTION__;
+      }
+    }
+    if (pipeline.predict(images) != labels) {
       throw(string) "Test failed! " + (string) __FUNCTION__;
     }
 
-    vector<tuple<vector<vector<vector<double>>>, vector<double>>> dParam_per_layer = model._calc_dLoss_dParam(Y[0]);
-    // (L(b+h) - L(b-h))/(2*h)
+    // A producer thread and a consumer thread, with outputs identical to the sequential model's.
+    thread producer([&]() {
+      for (int repeat = 0; repeat < 3; repeat++) {
+        for (auto& image : images) {
+          pipeline.submit(image);
+        }
+      }
+    });
+    Tensor output;
+    bool same = true;
+    for (int i = 0; i < 3 * images.size(); i++) {
+      pipeline.next(output);
+      same = same && output.to_nested() == expected[i % images.size()];
+    }
+    producer.join();
+    if (!same) {
+      throw(string) "Test failed! " + (string) __FUNCTION__;
+    }
 
-    for (int i = 0; i < dense1.num_out; i++) {
-      if (!(i == 0) && (rand() % 100) < 30) {
-        continue;
-      } else {
-        tuple<vector<vector<vector<double>>>, vector<double>> dParam = dParam_per_layer[1];
-        double epsilon{0.001};
+    // Once warm, submitting and collecting frames allocates nothing on the calling thread.
+    {
+      AllocationScope scope;
+      for (int i = 0; i < 8; i++) {
+        pipeline.submit(images[i]);
+        pipeline.next(output);
+      }
+#ifdef CNN_ALLOCATION_HOOK
+      if (scope.allocations() != 0) {
+        throw(string) "Test failed! " + (string) __FUNCTION__;
+      }
+#endif
+    }
 
-        // Might be better to loop over descreasing values of epsilon
-        dense1.biases[i] += epsilon;
-        double loss1 = model.Loss(X[0], Y[0]);
+    // Errors come out of next() in order, and the frames after them are unaffected.
+    pipeline.submit({vector<vector<double>>(5, vector<double>(5, 0))});
+    pipeline.submit(images[0]);
+    bool thrown = false;
+    try {
+      pipeline.next(output);
+    } catch (string error) {
+      thrown = true;
+    }
+    pipeline.next(output);
+    if (!thrown || output.to_nested() != expected[0]) {
+      throw(string) "Test failed! " + (string) __FUNCTION__;
+    }
+  }
 
-        dense1.biases[i] -= 2 * epsilon;
-        double loss2 = model.Loss(X[0], Y[0]);
+ private:
+  struct Frame {
+    ExecutionContext ctx;
+    string error;  // Set by the first failing stage; later stages pass the frame on untouched
+  };
 
-        double num_dLoss_dBs = (loss1 - loss2) / (2 * epsilon);
-        cout << get<1>(dParam)[i] << endl;
-        cout << num_dLoss_dBs << endl;
-        cout << "Difference in derivatives: " << num_dLoss_dBs - get<1>(dParam)[i] << endl;
+  const ConvNet& model;
+  int depth;
+  vector<Frame> frames;
+  SpscQueue<Frame*> free_frames;                // From next() back to submit()
+  vector<unique_ptr<SpscQueue<Frame*>>> queues;  // queues[s] feeds stage s; the last one feeds next()
+  vector<thread> threads;
+  atomic<bool> stopping{false};
+
+  // Runs layers[L] of the model on a frame, entering the model layout before the first layer and
+  // leaving it after the last.
+  void static _run_layer(const ConvNet& model, ExecutionContext& ctx, int L) {
+    if (L == 0) {
+      ctx.a.resize(model.layers.size());
+      model._enter_layout(ctx);
+    }
+    ConvNet::_forward_layer_consuming(model.layers[L], L == 0 ? ctx.input : ctx.a[L - 1], ctx.a[L]);
+    if (L == model.layers.size() - 1) {
+      model._leave_layout(ctx.a[L], ctx);
+    }
+  }
 
-        dense1.biases[i] += epsilon;
+  void _stage_loop(int s) {
+    SpscQueue<Frame*>& in = *queues[s];
+    SpscQueue<Frame*>& out = *queues[s + 1];
+    Frame* frame = nullptr;
+    while (_wait([&]() { return in.pop(frame); })) {
+      if (frame->error.empty()) {
+        try {
+          for (int L = boundaries[s]; L < boundaries[s + 1]; L++) {
+            _run_layer(model, frame->ctx, L);
+          }
+        } catch (string error) {
+          frame->error = error;
+        }
       }
+      out.push(frame);
     }
   }
 
-  void static fit_test_1(vector<vector<vector<vector<double>>>> X, int Y[100]) {
-    Flatten flatten = Flatten();
-    Dense dense = Dense(3, 16);
-    Sigmoid sigmoid = Sigmoid();
-    ConvNet model = ConvNet(vector<Layer*>{&flatten, &dense, &sigmoid});
-
-    model.fit(X, Y);
+  // Spins until ready() holds, yielding at first and then sleeping briefly, so that an idle
+  // pipeline does not keep its cores busy. False if the executor stops first.
+  template <class Ready>
+  bool _wait(Ready ready) {
+    for (int spins = 0; !ready(); spins++) {
+      if (stopping) {
+        return false;
+      }
+      if (spins < 64) {
+        this_thread::yield();
+      } else {
+        this_thread::sleep_for(chrono::microseconds(20));
+      }
+    }
+    return true;
   }
 
-  void static fit_test_2(vector<vector<vector<vector<double>>>> X, int Y[100]) {
-    Flatten flatten = Flatten();
-    Dense dense1 = Dense(8, 16);
-    Sigmoid sigmoid1 = Sigmoid();
-    Dense dense2 = Dense(3, 8);
-    Sigmoid sigmoid2 = Sigmoid();
-    ConvNet model = ConvNet(vector<Layer*>{&flatten, &dense1, &sigmoid1, &dense2, &sigmoid2});
-
-    model.fit(X, Y);
+  // Pins the calling thread to the stage-th CPU this process may run on.
+  void static _pin(int stage) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+      return;
+    }
+    vector<int> cpus;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &allowed)) {
+        cpus.push_back(cpu);
+      }
+    }
+    if (cpus.empty()) {
+      return;
+    }
+    cpu_set_t pinned;
+    CPU_ZERO(&pinned);
+    CPU_SET(cpus[stage % cpus.size()], &pinned);
+    sched_setaffinity(0, sizeof(pinned), &pinned);
   }
 };
 
@@ -1180,21 +6995,53 @@ int main() {
     Conv::convolve_test();
     cout << "convole_test done\n" << endl;
 
+    // Tiled convolution kernel test
+    Conv::h_tiling_test();
+    cout << "h_tiling_test done\n" << endl;
+
+    Conv::padding_test();
+    cout << "padding_test done\n" << endl;
+
+    // Convolution algorithms and their planner
+    ConvPlanner::plan_test();
+    cout << "ConvPlanner plan_test done\n" << endl;
+
     // Flat max pool test
     MaxPool::_max_pool_test();
     cout << "_max_pool_test done\n" << endl;
 
+    AvgPool::pool_test();
+    cout << "pool_test done\n" << endl;
+
     // TODO: make a depth maxpool test if necessary
 
+    Layer::expression_test();
+    cout << "expression_test done\n" << endl;
+
     Sigmoid::sigmoid_test();
     cout << "sigmoid_test done\n" << endl;
 
     Relu::relu_test();
     cout << "relu_test done\n" << endl;
 
+    HalfPrecision::conversion_test();
+    cout << "HalfPrecision conversion_test done\n" << endl;
+
+    RngStream::rng_test();
+    cout << "RngStream rng_test done\n" << endl;
+
+    EpochShuffler::sampler_test();
+    cout << "sampler_test done\n" << endl;
+
     Dense::h_test();
     cout << "Dense h_test done\n" << endl;
 
+    Dense::gather_test();
+    cout << "Dense gather_test done\n" << endl;
+
+    SparseDense::sparse_test();
+    cout << "SparseDense sparse_test done\n" << endl;
+
     ConvNet::h_test_1(X, Y);
     cout << "ConvNet h_test_1 done\n" << endl;
 
@@ -1212,6 +7059,63 @@ int main() {
 
     ConvNet::fit_test_2(X, Y);
     cout << "ConvNet fit_test_2 done \n" << endl;
+
+    ConvNet::fit_optimizers_test();
+    cout << "ConvNet fit_optimizers_test done \n" << endl;
+
+    ShmAllreduce::allreduce_test();
+    cout << "ShmAllreduce allreduce_test done \n" << endl;
+
+    ConvNet::fit_data_parallel_test();
+    cout << "ConvNet fit_data_parallel_test done \n" << endl;
+
+    ConvNet::tape_gradient_test();
+    cout << "ConvNet tape_gradient_test done \n" << endl;
+
+    ConvNet::sparse_dense_test();
+    cout << "ConvNet sparse_dense_test done \n" << endl;
+
+    ConvNet::optimize_test();
+    cout << "ConvNet optimize_test done \n" << endl;
+
+    ConvNet::checkpoint_test();
+    cout << "ConvNet checkpoint_test done \n" << endl;
+
+    ConvNet::reduced_precision_test();
+    cout << "ConvNet reduced_precision_test done \n" << endl;
+
+    StripStream::strip_test();
+    cout << "StripStream strip_test done \n" << endl;
+
+    ConvNet::channels_last_test();
+    cout << "ConvNet channels_last_test done \n" << endl;
+
+    ConvNet::flatten_view_test();
+    cout << "ConvNet flatten_view_test done \n" << endl;
+
+    StaticConvNetTests::static_test();
+    cout << "StaticConvNet static_test done \n" << endl;
+
+    ConvNet::autotune_test();
+    cout << "ConvNet autotune_test done \n" << endl;
+
+    ConvNet::concurrent_inference_test();
+    cout << "ConvNet concurrent_inference_test done \n" << endl;
+
+    ConvNet::allocation_test();
+    cout << "ConvNet allocation_test done \n" << endl;
+
+    ConvNet::profile_test(X, Y);
+    cout << "ConvNet profile_test done \n" << endl;
+
+    InferenceServer::serve_test();
+    cout << "InferenceServer serve_test done \n" << endl;
+
+    LoadGenerator::sweep_test();
+    cout << "LoadGenerator sweep_test done \n" << endl;
+
+    PipelineExecutor::pipeline_test();
+    cout << "PipelineExecutor pipeline_test done \n" << endl;
   } catch (string my_exception) {
     cout << my_exception << endl;
     return 1;  // Do not go past the first exception in a test